@@ -20,12 +20,14 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int emi_err;
+extern __thread int emi_err;
 
 enum emi_open_modes {
 	EMI_RO = 0b01,
@@ -54,6 +56,13 @@ enum emi_errors {
 	EMI_E_BOT,
 	EMI_E_EOT,
 	EMI_E_EOF,
+	EMI_E_BLOCK_SIZE,
+	EMI_E_IO,
+	EMI_E_HEADER_CRC,
+	EMI_E_META,
+	EMI_E_META_SIZE,
+	EMI_E_DELTA,
+	EMI_E_VOLUME,
 
 	EMI_E_MAX,
 };
@@ -62,11 +71,52 @@ enum emi_media_flags {
 	EMI_WRPROTECT	= 1 << 0,	// write prohibited
 	EMI_WORM		= 1 << 1,	// Write Once Read Many
 	EMI_USED		= 1 << 2,	// used (not blank) media
+	EMI_COMPRESSED	= 1 << 3,	// tape data blocks are stored compressed
 };
 
-#define EMI_FLAGS_ALL		(EMI_WRPROTECT | EMI_WORM | EMI_USED)
+#define EMI_FLAGS_ALL		(EMI_WRPROTECT | EMI_WORM | EMI_USED | EMI_COMPRESSED)
 #define EMI_FLAGS_SETTABLE	(EMI_WRPROTECT)
 
+enum emi_io_types {
+	EMI_IO_STDIO,		// stdio streams
+	EMI_IO_FD,			// raw file descriptor, positioned I/O
+	EMI_IO_MMAP,		// memory mapped image file
+	EMI_IO_MEM,			// image kept entirely in memory
+	EMI_IO_REMOTE,		// image served by emimgd
+	EMI_IO_MAX
+};
+
+#define EMI_IO_TYPE_MASK	0xff
+
+enum emi_io_flags {
+	EMI_IO_PERSIST		= 1 << 8,	// EMI_IO_MEM: write image back (atomically) on close
+	EMI_IO_HUGEPAGES	= 1 << 9,	// EMI_IO_MEM: use huge pages for image memory
+	EMI_IO_DIRECT		= 1 << 10,	// EMI_IO_FD: bypass page cache (O_DIRECT)
+};
+
+enum emi_ptape_stream_flags {
+	EMI_PT_RAW			= 1 << 0,	// stream data has no image header
+};
+
+struct emi_io;
+struct emi_writer;
+struct emi_disk_wc;
+struct emi_tapeset;
+struct emi_journal;
+struct emi_hot;
+
+enum emi_meta_tags {
+	EMI_META_LABEL		= 1,		// media label (text, not NUL-terminated)
+	EMI_META_VOLUME		= 2,		// volume layout and member images
+	EMI_META_TAPESET	= 3,		// tape set catalog
+	EMI_META_USER		= 0x8000,	// first tag free for application use
+};
+
+enum emi_volume_modes {
+	EMI_VOL_STRIPE		= 1,		// consecutive tracks on consecutive members
+	EMI_VOL_MIRROR		= 2,		// each member holds all the data
+};
+
 enum emi_media_type {
 	EMI_T_DISK,			// hard disk drive
 	EMI_T_PTAPE,		// punched tape
@@ -74,6 +124,36 @@ enum emi_media_type {
 	EMI_T_MAX
 };
 
+// magnetic tape structure faults (see emi_mtape_check())
+enum emi_mtape_faults {
+	EMI_MTF_NO_BOT = 1,		// no BOT marker at tape start
+	EMI_MTF_BOT,			// BOT marker past tape start
+	EMI_MTF_TYPE,			// unknown block type
+	EMI_MTF_SIZE,			// block size out of range
+	EMI_MTF_HEADER,			// image ends inside block header
+	EMI_MTF_DATA,			// image ends inside block data or footer
+	EMI_MTF_FOOTER,			// block footer doesn't match its header
+	EMI_MTF_CDATA,			// compressed block data is corrupt
+	EMI_MTF_LEN,			// block written past tape length
+	EMI_MTF_NO_EOT,			// tape ends without EOT marker
+	EMI_MTF_MAX
+};
+
+#define EMI_MTAPE_CHECK_FAULTS 16
+
+struct emi_mtape_check {
+	uint64_t blocks;		// data blocks
+	uint64_t marks;			// tape marks
+	uint64_t erased;		// erased gaps
+	uint64_t eot;			// EOT marker offset (0: not reached)
+	uint64_t trailing;		// stale data past EOT marker (bytes)
+	unsigned fault_count;	// all faults found
+	struct {
+		uint64_t offset;	// image file offset of the faulty block
+		int fault;
+	} faults[EMI_MTAPE_CHECK_FAULTS];	// first faults on tape, in tape order
+};
+
 struct emi {
 	char magic[4];			// 4
 	uint8_t v_major;		// 1
@@ -88,40 +168,137 @@ struct emi {
 	uint8_t heads;			// 1
 	uint8_t spt;			// 1
 	uint16_t block_size;	// 2
-	uint32_t len;			// 4
+	uint64_t len;			// 4 (v2.0) or 8 (v2.1+)
+	uint32_t data_offset;	// 4 (v3+) image data start
+	uint32_t meta_len;		// 4 (v3+) metadata area length
+	uint32_t crc;			// 4 (v3+) header and metadata checksum
 // --------------------------------
-#define EMI_HEADER_SIZE		  25
+#define EMI_HEADER_SIZE_V20	  25
+#define EMI_HEADER_SIZE_V21	  29
+#define EMI_HEADER_SIZE		  41
+// v3 image data starts page-aligned, metadata has to fit before it
+#define EMI_DATA_ALIGN		4096
+#define EMI_META_MAX		(EMI_DATA_ALIGN - EMI_HEADER_SIZE)
+// tape changes are tracked in units of this size (disk: sectors)
+#define EMI_DIRTY_TAPE_UNIT	4096
+#define EMI_DIRTY_UNIT(e)	((e)->type == EMI_T_DISK ? (e)->block_size : EMI_DIRTY_TAPE_UNIT)
 	char *img_name;
-	FILE *image;
+	const struct emi_io *io;	// storage backend
+	void *io_data;			// storage backend private data
+	unsigned io_flags;		// storage backend selection and flags
+	uint32_t hsize;			// header size (data start offset) of this image
+	uint64_t pos;			// current tape position (mtape: image file offset, ptape: data offset)
+	uint8_t *cbuf;			// tape block compression buffer
+	uint32_t cbuf_size;
+	uint8_t *pbuf;			// punched tape I/O buffer
+	uint64_t pbuf_pos;		// tape position of the buffer start
+	uint32_t pbuf_len;		// valid bytes in buffer
+	int pbuf_dirty;
 	uint8_t hbuf[EMI_HEADER_SIZE];
+	uint32_t hsum;			// checksum of header state last read or written
+	int hvalid;				// image opened in full, header is written back on close (if changed)
+	uint8_t *meta;			// metadata area: (tag (2), length (2), value)*
+	uint64_t *dirty;		// bitmap of data units written since last checkpoint
+	uint64_t dirty_size;	// bitmap size (units)
+	uint64_t dirty_lo;		// dirty units range
+	uint64_t dirty_hi;
+	char *ckpt;				// last checkpoint taken or restored (NULL: none)
+	struct emi_writer *writer;	// background tape writer (NULL: writes are synchronous)
+	struct emi_disk_wc *wc;	// disk write coalescing (NULL: writes go straight to the image)
+	struct emi_journal *journal;	// prior contents of written data (NULL: not journaled)
+	struct emi_hot *hot;	// data read recording (NULL: not recording)
+
+	pthread_mutex_t lock;	// serializes access to image state
+	unsigned refs;			// number of emi_open() users sharing this image
+	dev_t dev;				// image file identity in the open image registry
+	ino_t ino;
+	struct emi *reg_next;
+	int registered;
 };
 
 // management
 struct emi * emi_open(char *img_name);
+struct emi * emi_open_io(char *img_name, unsigned io);
+int emi_set_io(unsigned io);
+struct emi * emi_open_mem(char *img_name, unsigned flags);
+struct emi * emi_open_bundle(char *bundle_name, char *name);
 void emi_close(struct emi *e);
 const char * emi_get_err(int i);
 void emi_header_print(struct emi *e);
 int emi_flag_set(struct emi *e, uint32_t flag);
 int emi_flag_clear(struct emi *e, uint32_t flag);
+int emi_meta_set(struct emi *e, uint16_t tag, const void *data, uint16_t len);
+int emi_meta_get(struct emi *e, uint16_t tag, void *buf, uint16_t len);
+int emi_upgrade(char *img_name);
+int emi_preallocate(struct emi *e, int sparse);
+int emi_checkpoint(struct emi *e, char *path);
+int emi_checkpoint_restore(struct emi *e, char *path);
+int emi_diff(struct emi *a, struct emi *b, char *path);
+int emi_patch(struct emi *e, char *path);
+int emi_writer_start(struct emi *e);
+int emi_writer_stop(struct emi *e);
+int emi_flush(struct emi *e);
+struct emi * emi_clone(struct emi *src, char *img_name);
+int emi_journal_start(struct emi *e, uint64_t budget);
+int emi_journal_stop(struct emi *e);
+int emi_journal_range(struct emi *e, uint64_t *oldest, uint64_t *newest);
+int emi_journal_rewind(struct emi *e, uint64_t point);
+int emi_hot_record(struct emi *e, unsigned seconds);
+int emi_hot_prefetch(struct emi *e);
+int emi_bundle_create(char *bundle_name, char **images, unsigned count);
+int emi_bundle_count(char *bundle_name);
+const char * emi_bundle_member(char *bundle_name, unsigned i, uint64_t *size);
 
 // disk
 struct emi * emi_disk_create(char *img_name, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt);
 int emi_disk_read(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect);
 int emi_disk_write(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect);
+int emi_disk_read_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count);
+int emi_disk_write_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count);
+int emi_disk_coalesce(struct emi *e, uint32_t max_bytes, unsigned max_ms);
+int emi_disk_copy_range(struct emi *src, struct emi *dst, uint32_t lba, unsigned count);
+int emi_disk_resize(struct emi *e, uint16_t cylinders, int shrink);
+struct emi * emi_disk_reshape(struct emi *src, char *img_name, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt);
+struct emi * emi_volume_create(char *img_name, unsigned mode, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, char **members, unsigned count);
 
 // magnetic tape
-struct emi * emi_mtape_create(char *img_name, uint32_t size);
+struct emi * emi_mtape_create(char *img_name, uint64_t size, uint32_t flags);
 int emi_mtape_read(struct emi *e, uint8_t *buf);
+int emi_mtape_read_buf(struct emi *e, uint8_t *buf, unsigned size);
 int emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size);
 int emi_mtape_write_eof(struct emi *e);
 int emi_mtape_fwd(struct emi *e);
 int emi_mtape_rew(struct emi *e);
 int emi_mtape_bot(struct emi *e);
+int emi_mtape_erase(struct emi *e);
+int emi_mtape_compact(struct emi *e);
+int emi_mtape_check(struct emi *e, struct emi_mtape_check *c, int truncate);
+const char * emi_mtape_fault_desc(int fault);
+
+// magnetic tape sets
+struct emi_tapeset * emi_tapeset_create(char *img_name, uint64_t vol_size, uint32_t flags);
+struct emi_tapeset * emi_tapeset_open(char *img_name);
+void emi_tapeset_close(struct emi_tapeset *ts);
+int emi_tapeset_load(struct emi_tapeset *ts, unsigned vol);
+int emi_tapeset_volume(struct emi_tapeset *ts);
+int emi_tapeset_count(struct emi_tapeset *ts);
+struct emi * emi_tapeset_tape(struct emi_tapeset *ts);
+int emi_tapeset_bot(struct emi_tapeset *ts);
+int emi_tapeset_read(struct emi_tapeset *ts, uint8_t *buf);
+int emi_tapeset_read_buf(struct emi_tapeset *ts, uint8_t *buf, unsigned size);
+int emi_tapeset_write(struct emi_tapeset *ts, uint8_t *buf, unsigned size);
+int emi_tapeset_write_eof(struct emi_tapeset *ts);
 
 // punched tape
 struct emi * emi_ptape_create(char *img_name);
+struct emi * emi_ptape_stream(int fd, unsigned mode, unsigned flags);
 int emi_ptape_read(struct emi *e);
 int emi_ptape_write(struct emi *e, uint8_t data);
+int emi_ptape_read_buf(struct emi *e, uint8_t *buf, unsigned size);
+int emi_ptape_write_buf(struct emi *e, uint8_t *buf, unsigned size);
+int emi_ptape_seek(struct emi *e, uint64_t pos);
+int64_t emi_ptape_pos(struct emi *e);
+int64_t emi_ptape_len(struct emi *e);
 
 #ifdef __cplusplus
 }
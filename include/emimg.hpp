@@ -0,0 +1,625 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Header-only C++20 interface to emimg.
+//
+// Images are owned by move-only handles that close them on destruction.
+// Data is transferred directly to/from caller's std::span, errors come
+// back in emimg::result<T>, which holds either a value or an EMI_E_* code.
+//
+// emimg::fixed_disk<G> binds disk geometry at compile time. Sector offsets
+// and bounds are then constants, checked either at compile time
+// (read<C, H, S>()) or with constant limits (read(c, h, s, ...)).
+
+#ifndef E4IMG_HPP
+#define E4IMG_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <utility>
+
+#include "emimg.h"
+
+namespace emimg {
+
+// -----------------------------------------------------------------------
+// ---- Errors -----------------------------------------------------------
+// -----------------------------------------------------------------------
+
+class error {
+public:
+	constexpr explicit error(int code) : code_(code < 0 ? -code : code) { }
+	constexpr int code() const { return code_; }
+	const char * message() const { return emi_get_err(-code_); }
+private:
+	int code_;
+};
+
+template <class T>
+class result {
+public:
+	result(T &&value) : value_(std::move(value)), err_(EMI_E_OK) { }
+	result(emimg::error err) : value_(), err_(err) { }
+
+	explicit operator bool() const { return err_.code() == EMI_E_OK; }
+	bool has_value() const { return err_.code() == EMI_E_OK; }
+	emimg::error error() const { return err_; }
+
+	T & value() & { return value_; }
+	T && value() && { return std::move(value_); }
+	T & operator*() & { return value_; }
+	T && operator*() && { return std::move(value_); }
+	T * operator->() { return &value_; }
+
+private:
+	T value_;
+	emimg::error err_;
+};
+
+template <>
+class result<void> {
+public:
+	result() : err_(EMI_E_OK) { }
+	result(emimg::error err) : err_(err) { }
+
+	explicit operator bool() const { return err_.code() == EMI_E_OK; }
+	bool has_value() const { return err_.code() == EMI_E_OK; }
+	emimg::error error() const { return err_; }
+
+private:
+	emimg::error err_;
+};
+
+// -----------------------------------------------------------------------
+// Turn library return code into a result
+inline result<void> check(int res)
+{
+	if (res < 0) {
+		return error(res);
+	}
+	return { };
+}
+
+// -----------------------------------------------------------------------
+// ---- Images -----------------------------------------------------------
+// -----------------------------------------------------------------------
+
+class image {
+public:
+	image() = default;
+	explicit image(struct emi *e) : e_(e) { }
+	image(const image &) = delete;
+	image & operator=(const image &) = delete;
+	image(image &&o) noexcept : e_(std::exchange(o.e_, nullptr)) { }
+	image & operator=(image &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			e_ = std::exchange(o.e_, nullptr);
+		}
+		return *this;
+	}
+	~image() { close(); }
+
+	// Open with the default storage backend (emi_set_io(), EMIMG_IO)
+	static result<image> open(const std::string &name)
+	{
+		struct emi *e = emi_open(const_cast<char *>(name.c_str()));
+		if (!e) {
+			return error(emi_err);
+		}
+		return image(e);
+	}
+
+	static result<image> open(const std::string &name, unsigned io)
+	{
+		struct emi *e = emi_open_io(const_cast<char *>(name.c_str()), io);
+		if (!e) {
+			return error(emi_err);
+		}
+		return image(e);
+	}
+
+	// Read-only member 'name' of image bundle 'bundle'
+	static result<image> open_bundle(const std::string &bundle, const std::string &name)
+	{
+		struct emi *e = emi_open_bundle(const_cast<char *>(bundle.c_str()), const_cast<char *>(name.c_str()));
+		if (!e) {
+			return error(emi_err);
+		}
+		return image(e);
+	}
+
+	void close()
+	{
+		if (e_) {
+			emi_close(e_);
+			e_ = nullptr;
+		}
+	}
+
+	struct emi * get() const { return e_; }
+	struct emi * release() { return std::exchange(e_, nullptr); }
+	explicit operator bool() const { return e_ != nullptr; }
+
+	int type() const { return e_->type; }
+	uint32_t flags() const { return e_->flags; }
+	result<void> flag_set(uint32_t flag) { return check(emi_flag_set(e_, flag)); }
+	result<void> flag_clear(uint32_t flag) { return check(emi_flag_clear(e_, flag)); }
+
+	result<void> label(const std::string &text)
+	{
+		return check(emi_meta_set(e_, EMI_META_LABEL, text.data(), text.size()));
+	}
+	result<std::string> label() const
+	{
+		char buf[EMI_META_MAX];
+		int len = emi_meta_get(e_, EMI_META_LABEL, buf, sizeof(buf));
+		if (len < 0) {
+			return error(len);
+		}
+		return std::string(buf, len);
+	}
+
+	result<void> checkpoint(const std::string &path)
+	{
+		return check(emi_checkpoint(e_, const_cast<char *>(path.c_str())));
+	}
+	result<void> checkpoint_restore(const std::string &path)
+	{
+		return check(emi_checkpoint_restore(e_, const_cast<char *>(path.c_str())));
+	}
+	result<void> patch(const std::string &path)
+	{
+		return check(emi_patch(e_, const_cast<char *>(path.c_str())));
+	}
+
+	// Tape writes done by a background thread, errors reported later
+	result<void> writer_start() { return check(emi_writer_start(e_)); }
+	result<void> writer_stop() { return check(emi_writer_stop(e_)); }
+	// All data written so far goes to the image file
+	result<void> flush() { return check(emi_flush(e_)); }
+
+	// Keep up to 'budget' bytes of overwritten data, to step image back in time
+	result<void> journal_start(uint64_t budget) { return check(emi_journal_start(e_, budget)); }
+	result<void> journal_stop() { return check(emi_journal_stop(e_)); }
+	result<void> journal_range(uint64_t &oldest, uint64_t &newest) { return check(emi_journal_range(e_, &oldest, &newest)); }
+	result<void> rewind(uint64_t point) { return check(emi_journal_rewind(e_, point)); }
+	// Record data read in the next 'seconds' for later opens to read ahead
+	result<void> hot_record(unsigned seconds) { return check(emi_hot_record(e_, seconds)); }
+	result<void> hot_prefetch() { return check(emi_hot_prefetch(e_)); }
+
+	// New image sharing storage with this one where the filesystem allows
+	result<image> clone(const std::string &name)
+	{
+		struct emi *e = emi_clone(e_, const_cast<char *>(name.c_str()));
+		if (!e) {
+			return error(emi_err);
+		}
+		return image(e);
+	}
+
+protected:
+	struct emi *e_ = nullptr;
+};
+
+// -----------------------------------------------------------------------
+// ---- Disks ------------------------------------------------------------
+// -----------------------------------------------------------------------
+
+// Disk geometry, usable as a template argument
+struct geometry {
+	uint16_t cyls;
+	uint8_t heads;
+	uint8_t spt;
+	uint16_t sector;
+
+	constexpr uint32_t sectors() const { return (uint32_t) cyls * heads * spt; }
+	constexpr uint64_t capacity() const { return (uint64_t) sectors() * sector; }
+	constexpr uint32_t lba(unsigned c, unsigned h, unsigned s) const { return s + h * spt + c * heads * spt; }
+	constexpr bool contains(unsigned c, unsigned h, unsigned s) const { return (c < cyls) && (h < heads) && (s < spt); }
+	constexpr bool operator==(const geometry &) const = default;
+};
+
+// Presets known to the emimg tool
+namespace presets {
+	inline constexpr geometry win20a { 615, 4, 16, 512 };		// Amepol Winchester 20MB
+	inline constexpr geometry win20 { 615, 4, 17, 512 };		// Winchester 20MB
+	inline constexpr geometry m9425 { 203, 2, 12, 512 };		// MERA 9425 (IBM 5440) 14" disk
+	inline constexpr geometry flop5dsdd { 40, 2, 9, 512 };		// Floppy 5.25" DSDD 360KB
+	inline constexpr geometry flop5dshd { 80, 2, 15, 512 };	// Floppy 5.25" DSHD 1.2MB
+}
+
+// Disk with geometry known only at run time
+class disk : public image {
+public:
+	disk() = default;
+	explicit disk(image &&i) : image(std::move(i)) { }
+
+	static result<disk> create(const std::string &name, const geometry &g)
+	{
+		struct emi *e = emi_disk_create(const_cast<char *>(name.c_str()), g.sector, g.cyls, g.heads, g.spt);
+		if (!e) {
+			return error(emi_err);
+		}
+		return disk(image(e));
+	}
+
+	static result<disk> open(const std::string &name) { return from(image::open(name)); }
+	static result<disk> open(const std::string &name, unsigned io) { return from(image::open(name, io)); }
+
+	geometry geom() const { return { e_->cylinders, e_->heads, e_->spt, e_->block_size }; }
+
+	result<void> preallocate(bool sparse = false) { return check(emi_preallocate(e_, sparse)); }
+	// Hold writes (up to 'max_bytes' for up to 'max_ms'), write them out merged
+	result<void> coalesce(uint32_t max_bytes, unsigned max_ms) { return check(emi_disk_coalesce(e_, max_bytes, max_ms)); }
+	// Copy 'count' sectors at 'lba' from 'src' to the same place on this disk
+	result<void> copy_range(const disk &src, uint32_t lba, unsigned count)
+	{
+		return check(emi_disk_copy_range(src.get(), e_, lba, count));
+	}
+	// Change the number of cylinders in place, fewer only with 'shrink' set
+	result<void> resize(uint16_t cyls, bool shrink = false) { return check(emi_disk_resize(e_, cyls, shrink)); }
+	// New disk of geometry 'g', sectors keep their CHS addresses
+	result<disk> reshape(const std::string &name, const geometry &g)
+	{
+		struct emi *e = emi_disk_reshape(e_, const_cast<char *>(name.c_str()), g.sector, g.cyls, g.heads, g.spt);
+		if (!e) {
+			return error(emi_err);
+		}
+		return disk(image(e));
+	}
+
+	// 'buf' needs to hold exactly one sector
+	result<void> read(unsigned c, unsigned h, unsigned s, std::span<uint8_t> buf)
+	{
+		if (buf.size() != e_->block_size) {
+			return error(EMI_E_BLOCK_SIZE);
+		}
+		return check(emi_disk_read(e_, buf.data(), c, h, s));
+	}
+	result<void> write(unsigned c, unsigned h, unsigned s, std::span<const uint8_t> buf)
+	{
+		if (buf.size() != e_->block_size) {
+			return error(EMI_E_BLOCK_SIZE);
+		}
+		return check(emi_disk_write(e_, const_cast<uint8_t *>(buf.data()), c, h, s));
+	}
+
+	// 'buf' holds any number of consecutive sectors
+	result<void> read_lba(uint32_t lba, std::span<uint8_t> buf)
+	{
+		if (buf.size() % e_->block_size) {
+			return error(EMI_E_BLOCK_SIZE);
+		}
+		return check(emi_disk_read_lba(e_, buf.data(), lba, buf.size() / e_->block_size));
+	}
+	result<void> write_lba(uint32_t lba, std::span<const uint8_t> buf)
+	{
+		if (buf.size() % e_->block_size) {
+			return error(EMI_E_BLOCK_SIZE);
+		}
+		return check(emi_disk_write_lba(e_, const_cast<uint8_t *>(buf.data()), lba, buf.size() / e_->block_size));
+	}
+
+protected:
+	// Check that opened image is a disk
+	static result<disk> from(result<image> &&i)
+	{
+		if (!i) {
+			return i.error();
+		}
+		if (i->type() != EMI_T_DISK) {
+			return error(EMI_E_IMG_TYPE);
+		}
+		return disk(std::move(i).value());
+	}
+};
+
+// Disk with geometry fixed at compile time. Opening an image of any other
+// geometry fails with EMI_E_GEOM.
+template <geometry G>
+class fixed_disk : public disk {
+	static_assert(G.sectors() > 0, "Disk geometry can't be empty");
+
+public:
+	static constexpr geometry geom = G;
+	using sector = std::span<uint8_t, G.sector>;
+	using const_sector = std::span<const uint8_t, G.sector>;
+
+	fixed_disk() = default;
+
+	static result<fixed_disk> create(const std::string &name)
+	{
+		auto d = disk::create(name, G);
+		if (!d) {
+			return d.error();
+		}
+		return fixed_disk(std::move(d).value());
+	}
+
+	static result<fixed_disk> open(const std::string &name) { return from(disk::open(name)); }
+	static result<fixed_disk> open(const std::string &name, unsigned io) { return from(disk::open(name, io)); }
+
+	// geometry is bound at compile time, use reshape() to get another one
+	result<void> resize(uint16_t cyls, bool shrink = false) = delete;
+
+	// sector address known at compile time
+	template <unsigned C, unsigned H, unsigned S>
+	result<void> read(sector buf)
+	{
+		static_assert(G.contains(C, H, S), "Sector address is outside of disk geometry");
+		return check(emi_disk_read_lba(e_, buf.data(), G.lba(C, H, S), 1));
+	}
+	template <unsigned C, unsigned H, unsigned S>
+	result<void> write(const_sector buf)
+	{
+		static_assert(G.contains(C, H, S), "Sector address is outside of disk geometry");
+		return check(emi_disk_write_lba(e_, const_cast<uint8_t *>(buf.data()), G.lba(C, H, S), 1));
+	}
+
+	// sector address known at run time, checked against constant limits
+	result<void> read(unsigned c, unsigned h, unsigned s, sector buf)
+	{
+		if (!G.contains(c, h, s)) {
+			return error(EMI_E_SEEK);
+		}
+		return check(emi_disk_read_lba(e_, buf.data(), G.lba(c, h, s), 1));
+	}
+	result<void> write(unsigned c, unsigned h, unsigned s, const_sector buf)
+	{
+		if (!G.contains(c, h, s)) {
+			return error(EMI_E_SEEK);
+		}
+		return check(emi_disk_write_lba(e_, const_cast<uint8_t *>(buf.data()), G.lba(c, h, s), 1));
+	}
+
+	// whole tracks and cylinders in a single transfer
+	result<void> read_track(unsigned c, unsigned h, std::span<uint8_t, (size_t) G.spt * G.sector> buf)
+	{
+		if ((c >= G.cyls) || (h >= G.heads)) {
+			return error(EMI_E_SEEK);
+		}
+		return check(emi_disk_read_lba(e_, buf.data(), G.lba(c, h, 0), G.spt));
+	}
+	result<void> read_cylinder(unsigned c, std::span<uint8_t, (size_t) G.heads * G.spt * G.sector> buf)
+	{
+		if (c >= G.cyls) {
+			return error(EMI_E_SEEK);
+		}
+		return check(emi_disk_read_lba(e_, buf.data(), G.lba(c, 0, 0), G.heads * G.spt));
+	}
+
+private:
+	explicit fixed_disk(disk &&d) : disk(std::move(d)) { }
+
+	// Check that opened disk has geometry G
+	static result<fixed_disk> from(result<disk> &&d)
+	{
+		if (!d) {
+			return d.error();
+		}
+		if (d->geom() != G) {
+			return error(EMI_E_GEOM);
+		}
+		return fixed_disk(std::move(d).value());
+	}
+};
+
+// -----------------------------------------------------------------------
+// ---- Tapes ------------------------------------------------------------
+// -----------------------------------------------------------------------
+
+class mtape : public image {
+public:
+	mtape() = default;
+	explicit mtape(image &&i) : image(std::move(i)) { }
+
+	static result<mtape> create(const std::string &name, uint64_t size, uint32_t flags = 0)
+	{
+		struct emi *e = emi_mtape_create(const_cast<char *>(name.c_str()), size, flags);
+		if (!e) {
+			return error(emi_err);
+		}
+		return mtape(image(e));
+	}
+
+	static result<mtape> open(const std::string &name) { return from(image::open(name)); }
+	static result<mtape> open(const std::string &name, unsigned io) { return from(image::open(name, io)); }
+
+	// Read next block into 'buf'. Returns block length, blocks that
+	// don't fit fail with EMI_E_BLOCK_SIZE.
+	result<unsigned> read(std::span<uint8_t> buf)
+	{
+		int res = emi_mtape_read_buf(e_, buf.data(), std::min<size_t>(buf.size(), UINT_MAX));
+		if (res < 0) {
+			return error(res);
+		}
+		return (unsigned) res;
+	}
+	result<void> write(std::span<const uint8_t> buf)
+	{
+		return check(emi_mtape_write(e_, const_cast<uint8_t *>(buf.data()), buf.size()));
+	}
+	result<void> write_eof() { return check(emi_mtape_write_eof(e_)); }
+	result<void> fwd() { return check(emi_mtape_fwd(e_)); }
+	result<void> rew() { return check(emi_mtape_rew(e_)); }
+	result<void> bot() { return check(emi_mtape_bot(e_)); }
+	result<void> erase() { return check(emi_mtape_erase(e_)); }
+	result<void> compact() { return check(emi_mtape_compact(e_)); }
+	// Check tape structure, optionally cutting it at the first fault
+	result<struct emi_mtape_check> verify(bool truncate = false)
+	{
+		struct emi_mtape_check c;
+		int res = emi_mtape_check(e_, &c, truncate);
+		if (res < 0) {
+			return error(res);
+		}
+		return c;
+	}
+
+protected:
+	// Check that opened image is a magnetic tape
+	static result<mtape> from(result<image> &&i)
+	{
+		if (!i) {
+			return i.error();
+		}
+		if (i->type() != EMI_T_MTAPE) {
+			return error(EMI_E_IMG_TYPE);
+		}
+		return mtape(std::move(i).value());
+	}
+};
+
+// Magnetic tape spanning several volumes, switched automatically at EOT
+class tapeset {
+public:
+	tapeset() = default;
+	explicit tapeset(struct emi_tapeset *ts) : ts_(ts) { }
+	tapeset(const tapeset &) = delete;
+	tapeset & operator=(const tapeset &) = delete;
+	tapeset(tapeset &&o) noexcept : ts_(std::exchange(o.ts_, nullptr)) { }
+	tapeset & operator=(tapeset &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			ts_ = std::exchange(o.ts_, nullptr);
+		}
+		return *this;
+	}
+	~tapeset() { close(); }
+
+	static result<tapeset> create(const std::string &name, uint64_t vol_size, uint32_t flags = 0)
+	{
+		struct emi_tapeset *ts = emi_tapeset_create(const_cast<char *>(name.c_str()), vol_size, flags);
+		if (!ts) {
+			return error(emi_err);
+		}
+		return tapeset(ts);
+	}
+
+	static result<tapeset> open(const std::string &name)
+	{
+		struct emi_tapeset *ts = emi_tapeset_open(const_cast<char *>(name.c_str()));
+		if (!ts) {
+			return error(emi_err);
+		}
+		return tapeset(ts);
+	}
+
+	void close()
+	{
+		if (ts_) {
+			emi_tapeset_close(ts_);
+			ts_ = nullptr;
+		}
+	}
+
+	struct emi_tapeset * get() const { return ts_; }
+	explicit operator bool() const { return ts_ != nullptr; }
+
+	unsigned volume() const { return emi_tapeset_volume(ts_); }
+	unsigned count() const { return emi_tapeset_count(ts_); }
+	result<void> load(unsigned vol) { return check(emi_tapeset_load(ts_, vol)); }
+	result<void> bot() { return check(emi_tapeset_bot(ts_)); }
+
+	result<unsigned> read(std::span<uint8_t> buf)
+	{
+		int res = emi_tapeset_read_buf(ts_, buf.data(), std::min<size_t>(buf.size(), UINT_MAX));
+		if (res < 0) {
+			return error(res);
+		}
+		return (unsigned) res;
+	}
+	result<void> write(std::span<const uint8_t> buf)
+	{
+		return check(emi_tapeset_write(ts_, const_cast<uint8_t *>(buf.data()), buf.size()));
+	}
+	result<void> write_eof() { return check(emi_tapeset_write_eof(ts_)); }
+
+private:
+	struct emi_tapeset *ts_ = nullptr;
+};
+
+class ptape : public image {
+public:
+	ptape() = default;
+	explicit ptape(image &&i) : image(std::move(i)) { }
+
+	static result<ptape> create(const std::string &name)
+	{
+		struct emi *e = emi_ptape_create(const_cast<char *>(name.c_str()));
+		if (!e) {
+			return error(emi_err);
+		}
+		return ptape(image(e));
+	}
+
+	static result<ptape> open(const std::string &name) { return from(image::open(name)); }
+	static result<ptape> open(const std::string &name, unsigned io) { return from(image::open(name, io)); }
+
+	// Tape on a pipe or FIFO, read (EMI_RO) or punched (EMI_WO) front to back
+	static result<ptape> stream(int fd, unsigned mode, unsigned flags = 0)
+	{
+		struct emi *e = emi_ptape_stream(fd, mode, flags);
+		if (!e) {
+			return error(emi_err);
+		}
+		return ptape(image(e));
+	}
+
+	// Returns number of bytes read (less than requested at end of tape)
+	result<unsigned> read(std::span<uint8_t> buf)
+	{
+		int res = emi_ptape_read_buf(e_, buf.data(), buf.size());
+		if (res < 0) {
+			return error(res);
+		}
+		return (unsigned) res;
+	}
+	result<void> write(std::span<const uint8_t> buf)
+	{
+		return check(emi_ptape_write_buf(e_, const_cast<uint8_t *>(buf.data()), buf.size()));
+	}
+	result<void> seek(uint64_t pos) { return check(emi_ptape_seek(e_, pos)); }
+	int64_t pos() const { return emi_ptape_pos(e_); }
+	int64_t len() const { return emi_ptape_len(e_); }
+
+protected:
+	// Check that opened image is a punched tape
+	static result<ptape> from(result<image> &&i)
+	{
+		if (!i) {
+			return i.error();
+		}
+		if (i->type() != EMI_T_PTAPE) {
+			return error(EMI_E_IMG_TYPE);
+		}
+		return ptape(std::move(i).value());
+	}
+};
+
+} // namespace emimg
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,615 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Image bundles: many (small) images packed into one read-only file.
+//
+// Bundle layout (all numbers big-endian):
+//
+//  header : magic "E4IB" (4), version major (1), minor (1), reserved (2),
+//           member count (4), names area length (4),
+//           index and names checksum (4), reserved (4)
+//  index  : per member, sorted by name: data offset (8), data size (8),
+//           name offset in names area (4), reserved (4)
+//  names  : NUL-terminated member names
+//  data   : member image files, as they are, each one starting
+//           at EMI_DATA_ALIGN boundary
+//
+// Bundle file is mapped once per process and stays mapped (a bundle
+// replaced later with a new one is not noticed), so opening a member
+// costs only a binary search in the index. Members are served by the
+// storage backend below straight from the mapping.
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_BUNDLE_MAGIC "E4IB"
+#define EMI_BUNDLE_IMG_MAGIC "E4IM"	// member image magic (see emimg.c)
+#define EMI_BUNDLE_V_MAJOR 1
+#define EMI_BUNDLE_V_MINOR 0
+#define EMI_BUNDLE_HEADER_SIZE 24
+#define EMI_BUNDLE_ENTRY_SIZE 24
+#define EMI_BUNDLE_TMP_SUFFIX ".tmp"
+#define EMI_BUNDLE_COPY_BUF_SIZE (1024 * 1024)
+
+#define EMI_BUNDLE_ALIGN(x) (((x) + EMI_DATA_ALIGN - 1) & ~(uint64_t) (EMI_DATA_ALIGN - 1))
+
+struct emi_bundle {
+	char *name;
+	uint8_t *map;
+	uint64_t size;
+	unsigned count;
+	const uint8_t *index;
+	const char *names;
+	uint32_t names_len;
+	struct emi_bundle *next;
+};
+
+// member being served by the storage backend
+struct emi_io_bundle {
+	const uint8_t *data;
+	uint64_t size;
+};
+
+// member being packed
+struct emi_bundle_src {
+	char *path;
+	const char *name;
+	uint64_t size;
+	uint64_t offset;
+	uint32_t name_off;
+};
+
+static pthread_mutex_t emi_bundle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct emi_bundle *emi_bundles;
+
+uint32_t emi_crc32(uint32_t crc, const void *buf, size_t len);
+
+// -----------------------------------------------------------------------
+static uint64_t emi_bundle_get64(const uint8_t *pos)
+{
+	return ((uint64_t) ntohl(*(uint32_t*)pos) << 32) | ntohl(*(uint32_t*)(pos+4));
+}
+
+// -----------------------------------------------------------------------
+static void emi_bundle_put64(uint8_t *pos, uint64_t v)
+{
+	*(uint32_t*)pos = htonl(v >> 32);
+	*(uint32_t*)(pos+4) = htonl(v & 0xffffffff);
+}
+
+// -----------------------------------------------------------------------
+static int emi_bundle_map(struct emi_bundle *b)
+{
+	struct stat st;
+
+	int fd = open(b->name, O_RDONLY);
+	if (fd < 0) {
+		return -EMI_E_OPEN;
+	}
+	if (fstat(fd, &st) || (st.st_size < EMI_BUNDLE_HEADER_SIZE)) {
+		close(fd);
+		return -EMI_E_HEADER_READ;
+	}
+
+	b->size = st.st_size;
+	b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	// mapping stays valid after the descriptor is closed
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		b->map = NULL;
+		return -EMI_E_ALLOC;
+	}
+
+	const uint8_t *pos = b->map;
+	if (strncmp((const char*) pos, EMI_BUNDLE_MAGIC, 4)) {
+		return -EMI_E_MAGIC;
+	}
+	if (pos[4] != EMI_BUNDLE_V_MAJOR) {
+		return -EMI_E_FORMAT_V_MAJOR;
+	}
+	if (pos[5] > EMI_BUNDLE_V_MINOR) {
+		return -EMI_E_FORMAT_V_MINOR;
+	}
+	b->count = ntohl(*(uint32_t*)(pos + 8));
+	b->names_len = ntohl(*(uint32_t*)(pos + 12));
+	uint32_t crc = ntohl(*(uint32_t*)(pos + 16));
+
+	b->index = b->map + EMI_BUNDLE_HEADER_SIZE;
+	b->names = (const char*) b->index + (uint64_t) b->count * EMI_BUNDLE_ENTRY_SIZE;
+	if (EMI_BUNDLE_HEADER_SIZE + (uint64_t) b->count * EMI_BUNDLE_ENTRY_SIZE + b->names_len > b->size) {
+		return -EMI_E_HEADER_READ;
+	}
+	// every name offset has to point at a NUL-terminated string
+	if (b->count && (!b->names_len || b->names[b->names_len - 1])) {
+		return -EMI_E_HEADER_READ;
+	}
+	if (emi_crc32(0, b->index, (uint64_t) b->count * EMI_BUNDLE_ENTRY_SIZE + b->names_len) != crc) {
+		return -EMI_E_HEADER_CRC;
+	}
+
+	madvise(b->map, b->size, MADV_RANDOM);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Get bundle mapping, map it on first use
+static struct emi_bundle * emi_bundle_get(char *bundle_name)
+{
+	struct emi_bundle *b;
+
+	pthread_mutex_lock(&emi_bundle_lock);
+
+	for (b = emi_bundles ; b ; b = b->next) {
+		if (!strcmp(b->name, bundle_name)) {
+			pthread_mutex_unlock(&emi_bundle_lock);
+			return b;
+		}
+	}
+
+	b = calloc(1, sizeof(struct emi_bundle));
+	if (!b || !(b->name = strdup(bundle_name))) {
+		free(b);
+		pthread_mutex_unlock(&emi_bundle_lock);
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	int res = emi_bundle_map(b);
+	if (res != EMI_E_OK) {
+		if (b->map) munmap(b->map, b->size);
+		free(b->name);
+		free(b);
+		pthread_mutex_unlock(&emi_bundle_lock);
+		emi_err = res;
+		return NULL;
+	}
+
+	b->next = emi_bundles;
+	emi_bundles = b;
+
+	pthread_mutex_unlock(&emi_bundle_lock);
+
+	return b;
+}
+
+// -----------------------------------------------------------------------
+static const char * emi_bundle_entry_name(struct emi_bundle *b, const uint8_t *ent)
+{
+	uint32_t name_off = ntohl(*(uint32_t*)(ent + 16));
+
+	if (name_off >= b->names_len) {
+		return NULL;
+	}
+
+	return b->names + name_off;
+}
+
+// -----------------------------------------------------------------------
+static const uint8_t * emi_bundle_find(struct emi_bundle *b, const char *name)
+{
+	unsigned lo = 0;
+	unsigned hi = b->count;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		const uint8_t *ent = b->index + (uint64_t) mid * EMI_BUNDLE_ENTRY_SIZE;
+		const char *ent_name = emi_bundle_entry_name(b, ent);
+		if (!ent_name) {
+			return NULL;
+		}
+		int cmp = strcmp(name, ent_name);
+		if (!cmp) {
+			return ent;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Set up image 'e' on member 'name' of bundle 'bundle_name'
+int emi_bundle_attach(struct emi *e, char *bundle_name, char *name)
+{
+	struct emi_bundle *b = emi_bundle_get(bundle_name);
+	if (!b) {
+		return emi_err;
+	}
+
+	const uint8_t *ent = emi_bundle_find(b, name);
+	if (!ent) {
+		return -EMI_E_OPEN;
+	}
+
+	uint64_t offset = emi_bundle_get64(ent);
+	uint64_t size = emi_bundle_get64(ent + 8);
+	if ((offset > b->size) || (size > b->size - offset)) {
+		return -EMI_E_HEADER_READ;
+	}
+
+	struct emi_io_bundle *m = malloc(sizeof(struct emi_io_bundle));
+	if (!m) {
+		return -EMI_E_ALLOC;
+	}
+	m->data = b->map + offset;
+	m->size = size;
+
+	e->io = &emi_io_bundle;
+	e->io_data = m;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Number of bundle members
+int emi_bundle_count(char *bundle_name)
+{
+	struct emi_bundle *b = emi_bundle_get(bundle_name);
+	if (!b) {
+		return emi_err;
+	}
+
+	return b->count;
+}
+
+// -----------------------------------------------------------------------
+// Name and image size of the i-th bundle member (members are sorted by name)
+const char * emi_bundle_member(char *bundle_name, unsigned i, uint64_t *size)
+{
+	struct emi_bundle *b = emi_bundle_get(bundle_name);
+	if (!b) {
+		return NULL;
+	}
+
+	if (i >= b->count) {
+		emi_err = -EMI_E_OPEN;
+		return NULL;
+	}
+
+	const uint8_t *ent = b->index + (uint64_t) i * EMI_BUNDLE_ENTRY_SIZE;
+	const char *name = emi_bundle_entry_name(b, ent);
+	if (!name) {
+		emi_err = -EMI_E_HEADER_READ;
+		return NULL;
+	}
+	if (size) {
+		*size = emi_bundle_get64(ent + 8);
+	}
+
+	return name;
+}
+
+// -----------------------------------------------------------------------
+static int emi_bundle_src_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct emi_bundle_src*) a)->name, ((const struct emi_bundle_src*) b)->name);
+}
+
+// -----------------------------------------------------------------------
+static int emi_bundle_copy(int dst_fd, struct emi_bundle_src *s, uint8_t *buf)
+{
+	uint64_t done = 0;
+
+	int src_fd = open(s->path, O_RDONLY);
+	if (src_fd < 0) {
+		return -EMI_E_OPEN;
+	}
+
+	// copy within the kernel if possible
+	while (done < s->size) {
+		loff_t src_off = done;
+		loff_t dst_off = s->offset + done;
+		ssize_t res = copy_file_range(src_fd, &src_off, dst_fd, &dst_off, s->size - done, 0);
+		if (res <= 0) {
+			break;
+		}
+		done += res;
+	}
+
+	while (done < s->size) {
+		size_t chunk = s->size - done < EMI_BUNDLE_COPY_BUF_SIZE ? s->size - done : EMI_BUNDLE_COPY_BUF_SIZE;
+		ssize_t res = pread(src_fd, buf, chunk, done);
+		if (res <= 0) {
+			close(src_fd);
+			return -EMI_E_READ;
+		}
+		if (pwrite(dst_fd, buf, res, s->offset + done) != res) {
+			close(src_fd);
+			return -EMI_E_WRITE;
+		}
+		done += res;
+	}
+
+	close(src_fd);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Check that the file is an image, get its size
+static int emi_bundle_src_check(struct emi_bundle_src *s)
+{
+	struct stat st;
+	char magic[4];
+
+	int fd = open(s->path, O_RDONLY);
+	if (fd < 0) {
+		return -EMI_E_OPEN;
+	}
+	if (fstat(fd, &st) || (pread(fd, magic, 4, 0) != 4)) {
+		close(fd);
+		return -EMI_E_HEADER_READ;
+	}
+	close(fd);
+
+	if (strncmp(magic, EMI_BUNDLE_IMG_MAGIC, 4)) {
+		return -EMI_E_MAGIC;
+	}
+	s->size = st.st_size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Pack 'count' image files into bundle 'bundle_name'. Members are named
+// after the image file name (without directory). Bundle is written
+// to a temporary file first, which then replaces the old one (if any).
+int emi_bundle_create(char *bundle_name, char **images, unsigned count)
+{
+	int res;
+	int fd = -1;
+	uint8_t *meta = NULL;
+	uint8_t *buf = NULL;
+	char *tmp_name = NULL;
+
+	struct emi_bundle_src *src = calloc(count ? count : 1, sizeof(struct emi_bundle_src));
+	if (!src) {
+		return -EMI_E_ALLOC;
+	}
+
+	uint64_t names_len = 0;
+	for (unsigned i=0 ; i<count ; i++) {
+		src[i].path = images[i];
+		const char *slash = strrchr(images[i], '/');
+		src[i].name = slash ? slash + 1 : images[i];
+		if (!*src[i].name) {
+			res = -EMI_E_OPEN;
+			goto fin;
+		}
+		res = emi_bundle_src_check(src + i);
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+		names_len += strlen(src[i].name) + 1;
+	}
+	if (names_len > UINT32_MAX) {
+		res = -EMI_E_META_SIZE;
+		goto fin;
+	}
+
+	qsort(src, count, sizeof(struct emi_bundle_src), emi_bundle_src_cmp);
+
+	// lay out the bundle
+	uint64_t meta_len = EMI_BUNDLE_HEADER_SIZE + (uint64_t) count * EMI_BUNDLE_ENTRY_SIZE + names_len;
+	uint64_t offset = EMI_BUNDLE_ALIGN(meta_len);
+	uint32_t name_off = 0;
+	for (unsigned i=0 ; i<count ; i++) {
+		if ((i > 0) && !strcmp(src[i-1].name, src[i].name)) {
+			res = -EMI_E_EXISTS;
+			goto fin;
+		}
+		src[i].name_off = name_off;
+		src[i].offset = offset;
+		name_off += strlen(src[i].name) + 1;
+		offset = EMI_BUNDLE_ALIGN(offset + src[i].size);
+	}
+
+	meta = calloc(1, meta_len);
+	buf = malloc(EMI_BUNDLE_COPY_BUF_SIZE);
+	tmp_name = malloc(strlen(bundle_name) + sizeof(EMI_BUNDLE_TMP_SUFFIX));
+	if (!meta || !buf || !tmp_name) {
+		res = -EMI_E_ALLOC;
+		goto fin;
+	}
+	sprintf(tmp_name, "%s%s", bundle_name, EMI_BUNDLE_TMP_SUFFIX);
+
+	uint8_t *ent = meta + EMI_BUNDLE_HEADER_SIZE;
+	char *names = (char*) ent + (uint64_t) count * EMI_BUNDLE_ENTRY_SIZE;
+	for (unsigned i=0 ; i<count ; i++, ent += EMI_BUNDLE_ENTRY_SIZE) {
+		emi_bundle_put64(ent, src[i].offset);
+		emi_bundle_put64(ent + 8, src[i].size);
+		*(uint32_t*)(ent + 16) = htonl(src[i].name_off);
+		strcpy(names + src[i].name_off, src[i].name);
+	}
+
+	memcpy(meta, EMI_BUNDLE_MAGIC, 4);
+	meta[4] = EMI_BUNDLE_V_MAJOR;
+	meta[5] = EMI_BUNDLE_V_MINOR;
+	*(uint32_t*)(meta + 8) = htonl(count);
+	*(uint32_t*)(meta + 12) = htonl(names_len);
+	*(uint32_t*)(meta + 16) = htonl(emi_crc32(0, meta + EMI_BUNDLE_HEADER_SIZE, meta_len - EMI_BUNDLE_HEADER_SIZE));
+
+	fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		res = -EMI_E_OPEN;
+		goto fin;
+	}
+
+	res = -EMI_E_WRITE;
+	if ((pwrite(fd, meta, meta_len, 0) != meta_len) || ftruncate(fd, offset)) {
+		goto fin;
+	}
+
+	for (unsigned i=0 ; i<count ; i++) {
+		res = emi_bundle_copy(fd, src + i, buf);
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+	}
+
+	res = -EMI_E_WRITE;
+	if (fsync(fd)) {
+		goto fin;
+	}
+	if (close(fd)) {
+		fd = -1;
+		goto fin;
+	}
+	fd = -1;
+	if (rename(tmp_name, bundle_name)) {
+		goto fin;
+	}
+
+	res = EMI_E_OK;
+
+fin:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if ((res != EMI_E_OK) && tmp_name) {
+		unlink(tmp_name);
+	}
+	free(tmp_name);
+	free(buf);
+	free(meta);
+	free(src);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_open(struct emi *e, char *img_name, int create)
+{
+	// bundle members are set up with emi_bundle_attach()
+	return -EMI_E_IO;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_bundle_close(struct emi *e)
+{
+	// bundle stays mapped
+	free(e->io_data);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_bundle_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_bundle *m = e->io_data;
+
+	if (offset >= m->size) {
+		return 0;
+	}
+	if (count > m->size - offset) {
+		count = m->size - offset;
+	}
+
+	memcpy(buf, m->data + offset, count);
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_bundle_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	return -EMI_E_WRPROTECT;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_sync(struct emi *e)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_bundle_size(struct emi *e)
+{
+	struct emi_io_bundle *m = e->io_data;
+
+	return m->size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_truncate(struct emi *e, uint64_t size)
+{
+	return -EMI_E_WRPROTECT;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_bundle_map(struct emi *e, uint64_t offset, size_t len)
+{
+	struct emi_io_bundle *m = e->io_data;
+
+	if ((offset > m->size) || (len > m->size - offset)) {
+		return NULL;
+	}
+
+	// mapping is read-only, callers only read through it
+	return (void*) (m->data + offset);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return -EMI_E_WRPROTECT;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_bundle_fd(struct emi *e)
+{
+	return -1;
+}
+
+const struct emi_io emi_io_bundle = {
+	"bundle",
+	emi_io_bundle_open,
+	emi_io_bundle_close,
+	emi_io_bundle_read,
+	emi_io_bundle_write,
+	emi_io_bundle_sync,
+	emi_io_bundle_size,
+	emi_io_bundle_truncate,
+	emi_io_bundle_map,
+	emi_io_bundle_discard,
+	emi_io_bundle_allocate,
+	emi_io_bundle_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
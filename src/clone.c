@@ -0,0 +1,705 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Image cloning and data range copying.
+//
+// Data is copied with the cheapest method both images allow:
+//  * shared extents (FICLONERANGE), on filesystems that can do it
+//    (btrfs, xfs) - no data is copied until one of the images changes,
+//  * copy_file_range(), copying within the kernel (or on the server side
+//    on network filesystems),
+//  * pread()/pwrite() by several threads, for files the kernel can't copy
+//    between,
+//  * storage backend read/write, for images not kept in plain files.
+// Each method falls back to the next one if it can't do the job.
+//
+// Disk reshape copies sectors to an image of different geometry, keeping
+// their CHS addresses. Cylinders are handed out to several threads,
+// each one moving data a track at a time.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_COPY_CHUNK (8 * 1024 * 1024)
+#define EMI_COPY_THREADS_MAX 8
+#define EMI_COPY_ALIGN 4096
+
+struct emi_copy {
+	int src_fd;
+	int dst_fd;
+	uint64_t src_off;
+	uint64_t dst_off;
+	uint64_t len;
+	uint64_t next;			// next chunk to copy
+	int err;
+	pthread_mutex_t lock;
+};
+
+struct emi_reshape {
+	struct emi *src;
+	struct emi *dst;
+	int src_fd;				// -1: image data not in a plain file
+	int dst_fd;
+	uint64_t src_size;		// source image file size (sparse image may end early)
+	uint32_t cylinders;		// cylinders, heads and sectors in both geometries
+	unsigned heads;
+	unsigned spt;
+	uint32_t next;			// next cylinder to copy
+	int err;
+	pthread_mutex_t lock;	// work distribution, serialized backend I/O
+};
+
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+int emi_media_open(struct emi *e);
+int emi_media_sync(struct emi *e);
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len);
+int emi_mtape_copy(struct emi *src, struct emi *dst);
+struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags);
+
+// -----------------------------------------------------------------------
+static int emi_copy_clone(int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range r = {
+		.src_fd = src_fd,
+		.src_offset = src_off,
+		.src_length = len,
+		.dest_offset = dst_off,
+	};
+
+	if (!ioctl(dst_fd, FICLONERANGE, &r)) {
+		return EMI_E_OK;
+	}
+#endif
+
+	return -EMI_E_IO;
+}
+
+// -----------------------------------------------------------------------
+static int emi_copy_kernel(int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len)
+{
+	loff_t in = src_off;
+	loff_t out = dst_off;
+
+	while (len > 0) {
+		ssize_t res = copy_file_range(src_fd, &in, dst_fd, &out, len, 0);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_IO;
+		}
+		// source is shorter than expected
+		if (res == 0) {
+			return -EMI_E_READ;
+		}
+		len -= res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_copy_chunk(struct emi_copy *c, uint8_t *buf, uint64_t pos, uint64_t len)
+{
+	uint64_t done = 0;
+
+	while (done < len) {
+		ssize_t res = pread(c->src_fd, buf + done, len - done, c->src_off + pos + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_READ;
+		}
+		if (res == 0) {
+			return -EMI_E_READ;
+		}
+		done += res;
+	}
+
+	done = 0;
+	while (done < len) {
+		ssize_t res = pwrite(c->dst_fd, buf + done, len - done, c->dst_off + pos + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_WRITE;
+		}
+		done += res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_copy_worker(void *ptr)
+{
+	struct emi_copy *c = ptr;
+	uint8_t *buf;
+
+	// aligned, in case descriptors are opened with O_DIRECT
+	if (posix_memalign((void **) &buf, EMI_COPY_ALIGN, EMI_COPY_CHUNK)) {
+		pthread_mutex_lock(&c->lock);
+		c->err = -EMI_E_ALLOC;
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&c->lock);
+		uint64_t pos = c->next;
+		if (c->err || (pos >= c->len)) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		c->next += EMI_COPY_CHUNK;
+		pthread_mutex_unlock(&c->lock);
+
+		uint64_t len = c->len - pos < EMI_COPY_CHUNK ? c->len - pos : EMI_COPY_CHUNK;
+		int res = emi_copy_chunk(c, buf, pos, len);
+		if (res != EMI_E_OK) {
+			pthread_mutex_lock(&c->lock);
+			c->err = res;
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_copy_parallel(int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len)
+{
+	pthread_t threads[EMI_COPY_THREADS_MAX];
+	unsigned count = 0;
+	struct emi_copy c = {
+		.src_fd = src_fd,
+		.dst_fd = dst_fd,
+		.src_off = src_off,
+		.dst_off = dst_off,
+		.len = len,
+	};
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned want = (len + EMI_COPY_CHUNK - 1) / EMI_COPY_CHUNK;
+	if (want > cpus) want = cpus;
+	if (want > EMI_COPY_THREADS_MAX) want = EMI_COPY_THREADS_MAX;
+
+	pthread_mutex_init(&c.lock, NULL);
+
+	// calling thread copies too
+	while (count + 1 < want) {
+		if (pthread_create(threads + count, NULL, emi_copy_worker, &c)) {
+			break;
+		}
+		count++;
+	}
+	emi_copy_worker(&c);
+	for (unsigned i=0 ; i<count ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&c.lock);
+
+	return c.err;
+}
+
+// -----------------------------------------------------------------------
+static int emi_copy_io(struct emi *src, uint64_t src_off, struct emi *dst, uint64_t dst_off, uint64_t len)
+{
+	int res = EMI_E_OK;
+	uint64_t done = 0;
+
+	uint8_t *buf = malloc(EMI_COPY_CHUNK);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+
+	while (done < len) {
+		size_t chunk = len - done < EMI_COPY_CHUNK ? len - done : EMI_COPY_CHUNK;
+		if (src->io->read(src, buf, chunk, src_off + done) != chunk) {
+			res = -EMI_E_READ;
+			break;
+		}
+		if (dst->io->write(dst, buf, chunk, dst_off + done) != chunk) {
+			res = -EMI_E_WRITE;
+			break;
+		}
+		done += chunk;
+	}
+
+	free(buf);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Copy 'len' bytes of image file data between images (locks held,
+// media driver buffers synced). Destination range has to be within
+// destination image size.
+static int emi_copy(struct emi *src, uint64_t src_off, struct emi *dst, uint64_t dst_off, uint64_t len)
+{
+	if (!len) {
+		return EMI_E_OK;
+	}
+
+	int src_fd = src->io->fd(src);
+	int dst_fd = dst->io->fd(dst);
+
+	if ((src_fd >= 0) && (dst_fd >= 0)) {
+		if (emi_copy_clone(src_fd, src_off, dst_fd, dst_off, len) == EMI_E_OK) {
+			return EMI_E_OK;
+		}
+		if (emi_copy_kernel(src_fd, src_off, dst_fd, dst_off, len) == EMI_E_OK) {
+			return EMI_E_OK;
+		}
+		if (emi_copy_parallel(src_fd, src_off, dst_fd, dst_off, len) == EMI_E_OK) {
+			return EMI_E_OK;
+		}
+	}
+
+	return emi_copy_io(src, src_off, dst, dst_off, len);
+}
+
+// -----------------------------------------------------------------------
+static struct emi * __emi_clone(struct emi *src, char *img_name)
+{
+	int res;
+
+	// data held by media drivers goes to the image first
+	res = emi_media_sync(src);
+	if (res != EMI_E_OK) {
+		emi_err = res;
+		return NULL;
+	}
+
+	int64_t size = src->io->size(src);
+	if (size < 0) {
+		emi_err = size;
+		return NULL;
+	}
+	uint64_t len = size > src->hsize ? size - src->hsize : 0;
+
+	struct emi *dst = emi_create(img_name, src->type, src->block_size, src->cylinders, src->heads, src->spt, src->len, src->flags);
+	if (!dst) {
+		return NULL;
+	}
+
+	// same metadata, but a clone of a volume is a plain disk
+	if (src->meta && dst->meta) {
+		memcpy(dst->meta, src->meta, src->meta_len);
+		dst->meta_len = src->meta_len;
+		emi_meta_set(dst, EMI_META_VOLUME, NULL, 0);
+	}
+
+	if ((src->type == EMI_T_MTAPE) && (src->v_major != dst->v_major)) {
+		// clone is in the current format, older tape blocks have other
+		// headers and need to be rewritten one by one
+		res = emi_mtape_copy(src, dst);
+	} else {
+		res = dst->io->truncate(dst, dst->hsize + len);
+		if (res == EMI_E_OK) {
+			res = emi_copy(src, src->hsize, dst, dst->hsize, len);
+		}
+	}
+	if (res == EMI_E_OK) {
+		res = emi_media_open(dst);
+	}
+	if (res != EMI_E_OK) {
+		emi_close(dst);
+		unlink(img_name);
+		emi_err = res;
+		return NULL;
+	}
+
+	return dst;
+}
+
+// -----------------------------------------------------------------------
+// Create image 'img_name' as a copy of 'src', sharing storage with it
+// where the filesystem allows
+struct emi * emi_clone(struct emi *src, char *img_name)
+{
+	if (!img_name) {
+		emi_err = -EMI_E_OPEN;
+		return NULL;
+	}
+
+	emi_lock(src);
+	struct emi *e = __emi_clone(src, img_name);
+	emi_unlock(src);
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_disk_copy_range(struct emi *src, struct emi *dst, uint32_t lba, unsigned count)
+{
+	int res;
+
+	if ((src->type != EMI_T_DISK) || (dst->type != EMI_T_DISK)) {
+		return -EMI_E_ACCESS;
+	}
+	if (dst->flags & EMI_WRPROTECT) {
+		return -EMI_E_WRPROTECT;
+	}
+	if (src->block_size != dst->block_size) {
+		return -EMI_E_GEOM;
+	}
+
+	uint64_t src_sectors = (uint64_t) src->cylinders * src->heads * src->spt;
+	uint64_t dst_sectors = (uint64_t) dst->cylinders * dst->heads * dst->spt;
+	if (((uint64_t) lba + count > src_sectors) || ((uint64_t) lba + count > dst_sectors)) {
+		return -EMI_E_GEOM;
+	}
+
+	// sectors held for coalescing would override copied data
+	res = emi_media_sync(src);
+	if (res == EMI_E_OK) {
+		res = emi_media_sync(dst);
+	}
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	uint64_t offset = (uint64_t) lba * dst->block_size;
+	uint64_t len = (uint64_t) count * dst->block_size;
+
+	if (src == dst) {
+		return EMI_E_OK;
+	}
+
+	// sparse image may end before the range
+	int64_t size = dst->io->size(dst);
+	if (size < 0) {
+		return size;
+	}
+	if (size < dst->hsize + offset + len) {
+		res = dst->io->truncate(dst, dst->hsize + offset + len);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+	}
+
+	res = emi_copy(src, src->hsize + offset, dst, dst->hsize + offset, len);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	emi_dirty_mark(dst, offset, len);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Copy 'count' sectors starting at 'lba' from disk 'src' to the same
+// place on disk 'dst'
+int emi_disk_copy_range(struct emi *src, struct emi *dst, uint32_t lba, unsigned count)
+{
+	// lock order doesn't depend on the argument order
+	struct emi *first = src < dst ? src : dst;
+	struct emi *second = src < dst ? dst : src;
+
+	emi_lock(first);
+	if (second != first) {
+		emi_lock(second);
+	}
+
+	int res = __emi_disk_copy_range(src, dst, lba, count);
+
+	if (second != first) {
+		emi_unlock(second);
+	}
+	emi_unlock(first);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_reshape_read(struct emi_reshape *r, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+	uint64_t done = 0;
+
+	// data past the end of sparse image reads as zeros
+	if (offset + len > r->src_size) {
+		uint64_t avail = offset < r->src_size ? r->src_size - offset : 0;
+		memset(buf + avail, 0, len - avail);
+		len = avail;
+	}
+
+	if (r->src_fd < 0) {
+		pthread_mutex_lock(&r->lock);
+		int64_t res = r->src->io->read(r->src, buf, len, offset);
+		pthread_mutex_unlock(&r->lock);
+		return res == len ? EMI_E_OK : -EMI_E_READ;
+	}
+
+	while (done < len) {
+		ssize_t res = pread(r->src_fd, buf + done, len - done, offset + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_READ;
+		}
+		if (res == 0) {
+			return -EMI_E_READ;
+		}
+		done += res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_reshape_write(struct emi_reshape *r, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+	uint64_t done = 0;
+
+	// destination is created sparse, zeros don't need writing
+	while ((done < len) && !buf[done]) done++;
+	if (done == len) {
+		return EMI_E_OK;
+	}
+	done = 0;
+
+	if (r->dst_fd < 0) {
+		pthread_mutex_lock(&r->lock);
+		int64_t res = r->dst->io->write(r->dst, buf, len, offset);
+		pthread_mutex_unlock(&r->lock);
+		return res == len ? EMI_E_OK : -EMI_E_WRITE;
+	}
+
+	while (done < len) {
+		ssize_t res = pwrite(r->dst_fd, buf + done, len - done, offset + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_WRITE;
+		}
+		done += res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_reshape_worker(void *ptr)
+{
+	struct emi_reshape *r = ptr;
+	struct emi *src = r->src;
+	struct emi *dst = r->dst;
+	int res = EMI_E_OK;
+
+	// one track of each geometry
+	uint64_t src_len = (uint64_t) r->spt * src->block_size;
+	uint64_t dst_len = (uint64_t) r->spt * dst->block_size;
+	unsigned sect_len = src->block_size < dst->block_size ? src->block_size : dst->block_size;
+	uint8_t *src_buf = malloc(src_len);
+	uint8_t *dst_buf = src->block_size == dst->block_size ? src_buf : calloc(1, dst_len);
+
+	if (!src_buf || !dst_buf) {
+		res = -EMI_E_ALLOC;
+	}
+
+	while (res == EMI_E_OK) {
+		pthread_mutex_lock(&r->lock);
+		uint32_t cyl = r->next;
+		if (r->err || (cyl >= r->cylinders)) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		r->next++;
+		pthread_mutex_unlock(&r->lock);
+
+		for (unsigned head=0 ; head<r->heads ; head++) {
+			uint64_t src_lba = ((uint64_t) cyl * src->heads + head) * src->spt;
+			uint64_t dst_lba = ((uint64_t) cyl * dst->heads + head) * dst->spt;
+
+			res = emi_reshape_read(r, src_buf, src_len, src->hsize + src_lba * src->block_size);
+			if (res != EMI_E_OK) {
+				break;
+			}
+			// sectors are cut or padded with zeros to the new size
+			if (dst_buf != src_buf) {
+				for (unsigned sect=0 ; sect<r->spt ; sect++) {
+					memcpy(dst_buf + sect * dst->block_size, src_buf + sect * src->block_size, sect_len);
+				}
+			}
+			res = emi_reshape_write(r, dst_buf, dst_len, dst->hsize + dst_lba * dst->block_size);
+			if (res != EMI_E_OK) {
+				break;
+			}
+		}
+	}
+
+	if (res != EMI_E_OK) {
+		pthread_mutex_lock(&r->lock);
+		r->err = res;
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	if (dst_buf != src_buf) {
+		free(dst_buf);
+	}
+	free(src_buf);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Descriptor for the workers' own reads and writes. Tracks aren't
+// aligned for O_DIRECT, such images go through the storage backend.
+static int emi_reshape_fd(struct emi *e)
+{
+	if (e->io_flags & EMI_IO_DIRECT) {
+		return -1;
+	}
+
+	return e->io->fd(e);
+}
+
+// -----------------------------------------------------------------------
+static int emi_reshape_copy(struct emi *src, struct emi *dst, uint64_t src_size)
+{
+	pthread_t threads[EMI_COPY_THREADS_MAX];
+	unsigned count = 0;
+	struct emi_reshape r = {
+		.src = src,
+		.dst = dst,
+		.src_fd = emi_reshape_fd(src),
+		.dst_fd = emi_reshape_fd(dst),
+		.src_size = src_size,
+		.cylinders = src->cylinders < dst->cylinders ? src->cylinders : dst->cylinders,
+		.heads = src->heads < dst->heads ? src->heads : dst->heads,
+		.spt = src->spt < dst->spt ? src->spt : dst->spt,
+	};
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned want = r.cylinders;
+	if (want > cpus) want = cpus;
+	if (want > EMI_COPY_THREADS_MAX) want = EMI_COPY_THREADS_MAX;
+
+	pthread_mutex_init(&r.lock, NULL);
+
+	// calling thread copies too
+	while (count + 1 < want) {
+		if (pthread_create(threads + count, NULL, emi_reshape_worker, &r)) {
+			break;
+		}
+		count++;
+	}
+	emi_reshape_worker(&r);
+	for (unsigned i=0 ; i<count ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&r.lock);
+
+	return r.err;
+}
+
+// -----------------------------------------------------------------------
+static struct emi * __emi_disk_reshape(struct emi *src, char *img_name, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt)
+{
+	int res;
+
+	// sectors held for coalescing go to the image first
+	res = emi_media_sync(src);
+	if (res != EMI_E_OK) {
+		emi_err = res;
+		return NULL;
+	}
+
+	int64_t size = src->io->size(src);
+	if (size < 0) {
+		emi_err = size;
+		return NULL;
+	}
+
+	struct emi *dst = emi_create(img_name, EMI_T_DISK, block_size, cylinders, heads, spt, 0, src->flags);
+	if (!dst) {
+		return NULL;
+	}
+
+	// same metadata, but a reshaped volume is a plain disk
+	if (src->meta && dst->meta) {
+		memcpy(dst->meta, src->meta, src->meta_len);
+		dst->meta_len = src->meta_len;
+		emi_meta_set(dst, EMI_META_VOLUME, NULL, 0);
+	}
+
+	res = dst->io->truncate(dst, dst->hsize + (uint64_t) cylinders * heads * spt * block_size);
+	if (res == EMI_E_OK) {
+		if ((heads == src->heads) && (spt == src->spt) && (block_size == src->block_size)) {
+			// same track layout: sectors of common cylinders are one range
+			uint64_t len = (uint64_t) (cylinders < src->cylinders ? cylinders : src->cylinders) * heads * spt * block_size;
+			if (size < src->hsize + len) {
+				len = size > src->hsize ? size - src->hsize : 0;
+			}
+			res = emi_copy(src, src->hsize, dst, dst->hsize, len);
+		} else {
+			res = emi_reshape_copy(src, dst, size);
+		}
+	}
+	if (res == EMI_E_OK) {
+		res = emi_media_open(dst);
+	}
+	if (res != EMI_E_OK) {
+		emi_close(dst);
+		unlink(img_name);
+		emi_err = res;
+		return NULL;
+	}
+
+	return dst;
+}
+
+// -----------------------------------------------------------------------
+// Create disk image 'img_name' of a different geometry, holding 'src'
+// sectors at the same CHS addresses. Sectors outside the new geometry
+// are dropped, sector data is cut or padded with zeros to the new size.
+struct emi * emi_disk_reshape(struct emi *src, char *img_name, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt)
+{
+	if (!img_name) {
+		emi_err = -EMI_E_OPEN;
+		return NULL;
+	}
+	if (src->type != EMI_T_DISK) {
+		emi_err = -EMI_E_ACCESS;
+		return NULL;
+	}
+	if ((cylinders <= 0) || (heads <= 0) || (spt <= 0) || (block_size <= 0)) {
+		emi_err = -EMI_E_GEOM;
+		return NULL;
+	}
+
+	emi_lock(src);
+	struct emi *e = __emi_disk_reshape(src, img_name, block_size, cylinders, heads, spt);
+	emi_unlock(src);
+
+	return e;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,55 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// CRC-32 (IEEE 802.3, reflected, polynomial 0xedb88320)
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+// -----------------------------------------------------------------------
+static void crc_table_init()
+{
+	for (uint32_t i=0 ; i<256 ; i++) {
+		uint32_t c = i;
+		for (int k=0 ; k<8 ; k++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Update 'crc' with 'len' bytes from 'buf'. Start with crc = 0.
+uint32_t emi_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc_table_once, crc_table_init);
+
+	crc = ~crc;
+	while (len--) {
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
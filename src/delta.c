@@ -0,0 +1,978 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Sector-delta files: image data changes, to be applied on top of the
+// parent delta (if there is one), a full image dump (EMI_DELTA_F_FULL),
+// or the image as it is. All integers are big-endian.
+//
+//  header : magic "E4DL" (4), version (1), image format major (1),
+//           image format minor (1), flags (1), media type (2),
+//           block size (2), cylinders (2), heads (1), spt (1),
+//           len (8), tape position (8), image data size (8),
+//           parent name length (2), parent name (relative to the
+//           directory of the delta file)
+//  record : data offset (8), length (4), data
+//  end    : offset 0xffffffffffffffff, length 0
+//  crc    : CRC-32 of everything above (4)
+//
+// Offsets are relative to image data start, so deltas don't depend
+// on image header size.
+
+#define _XOPEN_SOURCE 500
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_DELTA_MAGIC "E4DL"
+#define EMI_DELTA_VERSION 1
+#define EMI_DELTA_HDR_SIZE 44
+#define EMI_DELTA_REC_SIZE 12
+#define EMI_DELTA_END UINT64_MAX
+// records are split into chunks of this size
+#define EMI_DELTA_CHUNK (64 * 1024)
+// blank areas of this size are skipped in full dumps
+#define EMI_DELTA_ZERO_UNIT 4096
+// longest parent chain followed
+#define EMI_DELTA_DEPTH_MAX 1024
+// most threads used to compare images
+#define EMI_DELTA_THREADS_MAX 16
+
+enum emi_delta_flags {
+	EMI_DELTA_F_FULL = 1 << 0,	// holds all image data, apply to a blank image
+};
+
+struct emi_delta_hdr {
+	uint8_t v_major;
+	uint8_t v_minor;
+	uint8_t flags;
+	uint16_t type;
+	uint16_t block_size;
+	uint16_t cylinders;
+	uint8_t heads;
+	uint8_t spt;
+	uint64_t len;
+	uint64_t pos;
+	uint64_t size;
+	char *parent;
+};
+
+struct emi_delta {
+	FILE *f;
+	uint32_t crc;
+};
+
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+int emi_media_sync(struct emi *e);
+void emi_journal_reset(struct emi *e);
+char * emi_path_rel(const char *base, const char *name);
+uint32_t emi_crc32(uint32_t crc, const void *buf, size_t len);
+
+// -----------------------------------------------------------------------
+static uint64_t emi_delta_get64(uint8_t *pos)
+{
+	return ((uint64_t) ntohl(*(uint32_t*)pos) << 32) | ntohl(*(uint32_t*)(pos+4));
+}
+
+// -----------------------------------------------------------------------
+static void emi_delta_put64(uint8_t *pos, uint64_t v)
+{
+	*(uint32_t*)pos = htonl(v >> 32);
+	*(uint32_t*)(pos+4) = htonl(v & 0xffffffff);
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_zero(uint8_t *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_put(struct emi_delta *d, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, d->f) != len) {
+		return -EMI_E_WRITE;
+	}
+
+	d->crc = emi_crc32(d->crc, buf, len);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_record(struct emi_delta *d, uint64_t offset, const void *data, uint32_t len)
+{
+	int res;
+	uint8_t rec[EMI_DELTA_REC_SIZE];
+
+	emi_delta_put64(rec, offset);
+	*(uint32_t*)(rec+8) = htonl(len);
+
+	res = emi_delta_put(d, rec, EMI_DELTA_REC_SIZE);
+	if ((res != EMI_E_OK) || !len) {
+		return res;
+	}
+
+	return emi_delta_put(d, data, len);
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_create(struct emi_delta *d, char *path, struct emi *e, char *parent, uint8_t flags, uint64_t size)
+{
+	int res;
+	uint8_t hdr[EMI_DELTA_HDR_SIZE];
+	size_t parent_len = parent ? strlen(parent) : 0;
+
+	if (parent_len > 0xffff) {
+		return -EMI_E_OPEN;
+	}
+
+	d->crc = 0;
+	d->f = fopen(path, "w");
+	if (!d->f) {
+		return -EMI_E_OPEN;
+	}
+
+	uint8_t *pos = hdr;
+	memcpy(pos, EMI_DELTA_MAGIC, 4); pos += 4;
+	*pos = EMI_DELTA_VERSION; pos += 1;
+	*pos = e->v_major; pos += 1;
+	*pos = e->v_minor; pos += 1;
+	*pos = flags; pos += 1;
+	*(uint16_t*)pos = htons(e->type); pos += 2;
+	*(uint16_t*)pos = htons(e->block_size); pos += 2;
+	*(uint16_t*)pos = htons(e->cylinders); pos += 2;
+	*pos = e->heads; pos += 1;
+	*pos = e->spt; pos += 1;
+	emi_delta_put64(pos, e->len); pos += 8;
+	emi_delta_put64(pos, e->type == EMI_T_MTAPE ? e->pos - e->hsize : e->pos); pos += 8;
+	emi_delta_put64(pos, size); pos += 8;
+	*(uint16_t*)pos = htons(parent_len); pos += 2;
+
+	res = emi_delta_put(d, hdr, EMI_DELTA_HDR_SIZE);
+	if ((res == EMI_E_OK) && parent_len) {
+		res = emi_delta_put(d, parent, parent_len);
+	}
+	if (res != EMI_E_OK) {
+		fclose(d->f);
+		unlink(path);
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Terminate delta file (res == EMI_E_OK) or drop it (res < 0)
+static int emi_delta_finish(struct emi_delta *d, char *path, int res)
+{
+	uint32_t crc;
+
+	if (res == EMI_E_OK) {
+		res = emi_delta_record(d, EMI_DELTA_END, NULL, 0);
+	}
+	if (res == EMI_E_OK) {
+		crc = htonl(d->crc);
+		if ((fwrite(&crc, 1, 4, d->f) != 4) || fflush(d->f) || fsync(fileno(d->f))) {
+			res = -EMI_E_WRITE;
+		}
+	}
+	if (fclose(d->f) && (res == EMI_E_OK)) {
+		res = -EMI_E_WRITE;
+	}
+	if (res != EMI_E_OK) {
+		unlink(path);
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Store data chunk in delta file, leaving out blank areas
+static int emi_delta_record_sparse(struct emi_delta *d, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+	int res;
+	uint32_t start = 0;
+	uint32_t pos = 0;
+
+	while (pos < len) {
+		uint32_t unit = len - pos > EMI_DELTA_ZERO_UNIT ? EMI_DELTA_ZERO_UNIT : len - pos;
+		if (emi_delta_zero(buf + pos, unit)) {
+			if (pos > start) {
+				res = emi_delta_record(d, offset + start, buf + start, pos - start);
+				if (res != EMI_E_OK) {
+					return res;
+				}
+			}
+			start = pos + unit;
+		}
+		pos += unit;
+	}
+
+	if (pos > start) {
+		return emi_delta_record(d, offset + start, buf + start, pos - start);
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Store image data range in delta file
+static int emi_delta_dump(struct emi_delta *d, struct emi *e, uint64_t offset, uint64_t len, uint8_t *buf, int sparse)
+{
+	int res;
+
+	while (len > 0) {
+		uint32_t chunk = len > EMI_DELTA_CHUNK ? EMI_DELTA_CHUNK : len;
+		if (e->io->read(e, buf, chunk, e->hsize + offset) != chunk) {
+			return -EMI_E_READ;
+		}
+		if (sparse) {
+			res = emi_delta_record_sparse(d, offset, buf, chunk);
+		} else {
+			res = emi_delta_record(d, offset, buf, chunk);
+		}
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_get(FILE *f, void *buf, size_t len)
+{
+	if (fread(buf, 1, len, f) != len) {
+		return -EMI_E_DELTA;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Check delta file CRC, leave file positioned at the start
+static int emi_delta_verify(FILE *f, uint8_t *buf)
+{
+	uint32_t crc = 0;
+	uint32_t file_crc;
+
+	if (fseeko(f, 0, SEEK_END)) {
+		return -EMI_E_SEEK;
+	}
+	off_t size = ftello(f);
+	if (size < EMI_DELTA_HDR_SIZE + EMI_DELTA_REC_SIZE + 4) {
+		return -EMI_E_DELTA;
+	}
+	rewind(f);
+
+	size -= 4;
+	while (size > 0) {
+		size_t chunk = size > EMI_DELTA_CHUNK ? EMI_DELTA_CHUNK : size;
+		if (emi_delta_get(f, buf, chunk) != EMI_E_OK) {
+			return -EMI_E_DELTA;
+		}
+		crc = emi_crc32(crc, buf, chunk);
+		size -= chunk;
+	}
+
+	if (emi_delta_get(f, &file_crc, 4) != EMI_E_OK) {
+		return -EMI_E_DELTA;
+	}
+	if (ntohl(file_crc) != crc) {
+		return -EMI_E_DELTA;
+	}
+
+	rewind(f);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_delta_header_read(FILE *f, struct emi_delta_hdr *h)
+{
+	uint8_t hdr[EMI_DELTA_HDR_SIZE];
+
+	if (emi_delta_get(f, hdr, EMI_DELTA_HDR_SIZE) != EMI_E_OK) {
+		return -EMI_E_DELTA;
+	}
+
+	uint8_t *pos = hdr;
+	if (memcmp(pos, EMI_DELTA_MAGIC, 4)) {
+		return -EMI_E_MAGIC;
+	}
+	pos += 4;
+	if (*pos != EMI_DELTA_VERSION) {
+		return -EMI_E_FORMAT_V_MAJOR;
+	}
+	pos += 1;
+	h->v_major = *pos; pos += 1;
+	h->v_minor = *pos; pos += 1;
+	h->flags = *pos; pos += 1;
+	h->type = ntohs(*(uint16_t*)pos); pos += 2;
+	h->block_size = ntohs(*(uint16_t*)pos); pos += 2;
+	h->cylinders = ntohs(*(uint16_t*)pos); pos += 2;
+	h->heads = *pos; pos += 1;
+	h->spt = *pos; pos += 1;
+	h->len = emi_delta_get64(pos); pos += 8;
+	h->pos = emi_delta_get64(pos); pos += 8;
+	h->size = emi_delta_get64(pos); pos += 8;
+	uint16_t parent_len = ntohs(*(uint16_t*)pos); pos += 2;
+
+	h->parent = NULL;
+	if (parent_len) {
+		h->parent = malloc(parent_len + 1);
+		if (!h->parent) {
+			return -EMI_E_ALLOC;
+		}
+		if (emi_delta_get(f, h->parent, parent_len) != EMI_E_OK) {
+			free(h->parent);
+			return -EMI_E_DELTA;
+		}
+		h->parent[parent_len] = '\0';
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Name the image keeps for its last checkpoint: absolute, so it stays
+// valid whatever directory the next checkpoint goes to
+static char * emi_delta_ckpt_name(char *path)
+{
+	char *name = realpath(path, NULL);
+
+	return name ? name : strdup(path);
+}
+
+// -----------------------------------------------------------------------
+// Name of checkpoint 'parent' as seen from the directory of delta 'path'
+static char * emi_delta_parent_name(char *path, char *parent)
+{
+	char *dir = strdup(path);
+	if (!dir) {
+		return NULL;
+	}
+	char *slash = strrchr(dir, '/');
+	if (slash) {
+		slash[1] = '\0';
+	} else {
+		strcpy(dir, ".");
+	}
+	char *real_dir = realpath(dir, NULL);
+	free(dir);
+
+	// relative parent name or no way to tell where the delta goes: keep it as it is
+	if ((parent[0] != '/') || !real_dir) {
+		free(real_dir);
+		return strdup(parent);
+	}
+
+	// leading directories both paths share
+	size_t common = 0;
+	size_t i;
+	for (i=0 ; real_dir[i] && (real_dir[i] == parent[i]) ; i++) {
+		if (real_dir[i] == '/') {
+			common = i;
+		}
+	}
+	if (!real_dir[i] && (parent[i] == '/')) {
+		common = i;
+	}
+
+	// go up from the rest of delta directory, then down to the parent
+	unsigned ups = 0;
+	for (i=common ; real_dir[i] ; i++) {
+		if ((real_dir[i] == '/') && real_dir[i+1]) {
+			ups++;
+		}
+	}
+	free(real_dir);
+
+	const char *rest = parent + common + 1;
+	char *name = malloc(3 * ups + strlen(rest) + 1);
+	if (!name) {
+		return NULL;
+	}
+	name[0] = '\0';
+	while (ups--) {
+		strcat(name, "../");
+	}
+	strcat(name, rest);
+
+	return name;
+}
+
+// -----------------------------------------------------------------------
+// Apply delta file (and its parents first) to the image
+static int emi_delta_apply(struct emi *e, char *path, uint8_t *buf, int depth)
+{
+	int res;
+	struct emi_delta_hdr h;
+	uint8_t rec[EMI_DELTA_REC_SIZE];
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return -EMI_E_OPEN;
+	}
+
+	res = emi_delta_verify(f, buf);
+	if (res != EMI_E_OK) {
+		fclose(f);
+		return res;
+	}
+
+	res = emi_delta_header_read(f, &h);
+	if (res != EMI_E_OK) {
+		fclose(f);
+		return res;
+	}
+
+	// delta has to be taken from the same kind of media
+	// (tape block layout also depends on image format version)
+	if ((h.type != e->type) || (h.block_size != e->block_size) || (h.cylinders != e->cylinders) || (h.heads != e->heads) || (h.spt != e->spt)
+	|| ((e->type == EMI_T_MTAPE) && ((h.v_major != e->v_major) || (h.v_minor != e->v_minor)))) {
+		res = -EMI_E_GEOM;
+		goto fin;
+	}
+
+	if (h.parent) {
+		if (depth >= EMI_DELTA_DEPTH_MAX) {
+			res = -EMI_E_DELTA;
+			goto fin;
+		}
+		char *parent = emi_path_rel(path, h.parent);
+		if (!parent) {
+			res = -EMI_E_ALLOC;
+			goto fin;
+		}
+		res = emi_delta_apply(e, parent, buf, depth + 1);
+		free(parent);
+	} else if (h.flags & EMI_DELTA_F_FULL) {
+		res = e->io->truncate(e, e->hsize);
+	}
+	if (res != EMI_E_OK) {
+		goto fin;
+	}
+
+	res = e->io->truncate(e, e->hsize + h.size);
+	if (res != EMI_E_OK) {
+		goto fin;
+	}
+
+	while (1) {
+		res = emi_delta_get(f, rec, EMI_DELTA_REC_SIZE);
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+		uint64_t offset = emi_delta_get64(rec);
+		uint32_t len = ntohl(*(uint32_t*)(rec+8));
+		if (offset == EMI_DELTA_END) {
+			break;
+		}
+		if ((offset > h.size) || (len > h.size - offset)) {
+			res = -EMI_E_DELTA;
+			goto fin;
+		}
+		while (len > 0) {
+			uint32_t chunk = len > EMI_DELTA_CHUNK ? EMI_DELTA_CHUNK : len;
+			res = emi_delta_get(f, buf, chunk);
+			if (res != EMI_E_OK) {
+				goto fin;
+			}
+			if (e->io->write(e, buf, chunk, e->hsize + offset) != chunk) {
+				res = -EMI_E_WRITE;
+				goto fin;
+			}
+			offset += chunk;
+			len -= chunk;
+		}
+	}
+
+	e->len = h.len;
+	e->pos = e->type == EMI_T_MTAPE ? e->hsize + h.pos : h.pos;
+
+fin:
+	free(h.parent);
+	fclose(f);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_dirty_test(struct emi *e, uint64_t i)
+{
+	return (e->dirty[i / 64] >> (i % 64)) & 1;
+}
+
+// -----------------------------------------------------------------------
+static void emi_dirty_clear(struct emi *e)
+{
+	if (e->dirty_hi) {
+		uint64_t first = e->dirty_lo / 64;
+		uint64_t last = (e->dirty_hi - 1) / 64;
+		memset(e->dirty + first, 0, (last - first + 1) * 8);
+	}
+
+	e->dirty_lo = e->dirty_hi = 0;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_checkpoint(struct emi *e, char *path)
+{
+	int res;
+	struct emi_delta d;
+	uint32_t unit = EMI_DIRTY_UNIT(e);
+
+	// checkpoint has to include data still held by media driver
+	res = emi_media_sync(e);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	int64_t img_size = e->io->size(e);
+	if (img_size < 0) {
+		return img_size;
+	}
+	uint64_t size = img_size > e->hsize ? img_size - e->hsize : 0;
+
+	uint8_t *buf = malloc(EMI_DELTA_CHUNK);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+
+	char *parent = NULL;
+	if (e->ckpt) {
+		parent = emi_delta_parent_name(path, e->ckpt);
+		if (!parent) {
+			free(buf);
+			return -EMI_E_ALLOC;
+		}
+	}
+
+	res = emi_delta_create(&d, path, e, parent, parent ? 0 : EMI_DELTA_F_FULL, size);
+	free(parent);
+	if (res != EMI_E_OK) {
+		free(buf);
+		return res;
+	}
+
+	if (!e->ckpt) {
+		// first checkpoint holds all data
+		res = emi_delta_dump(&d, e, 0, size, buf, 1);
+	} else {
+		// next ones only the units written since
+		uint64_t i = e->dirty_lo;
+		while ((res == EMI_E_OK) && (i < e->dirty_hi)) {
+			if (!(i % 64) && !e->dirty[i / 64]) {
+				i += 64;
+				continue;
+			}
+			if (!emi_dirty_test(e, i)) {
+				i++;
+				continue;
+			}
+			uint64_t first = i;
+			while ((i < e->dirty_hi) && emi_dirty_test(e, i)) {
+				i++;
+			}
+			// data past the end is gone (tape was compacted or restored)
+			uint64_t from = first * unit;
+			uint64_t to = i * unit;
+			if (to > size) {
+				to = size;
+			}
+			if (from < to) {
+				res = emi_delta_dump(&d, e, from, to - from, buf, 0);
+			}
+		}
+	}
+
+	res = emi_delta_finish(&d, path, res);
+	free(buf);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	// new checkpoint is the reference point for the next one
+	emi_dirty_clear(e);
+	free(e->ckpt);
+	e->ckpt = emi_delta_ckpt_name(path);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Save image state to 'path'. First checkpoint after image is opened
+// holds all image data, each next one only changes since the previous
+// checkpoint, referencing it by name.
+int emi_checkpoint(struct emi *e, char *path)
+{
+	emi_lock(e);
+	int res = __emi_checkpoint(e, path);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Load delta into image, 'ckpt' makes it the reference for next checkpoint
+static int emi_delta_load(struct emi *e, char *path, int ckpt)
+{
+	int res;
+
+	if (e->flags & EMI_WRPROTECT) {
+		return -EMI_E_WRPROTECT;
+	}
+
+	res = emi_media_sync(e);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+	// drop punched tape buffer contents
+	e->pbuf_len = 0;
+	// journal history doesn't lead to the loaded state
+	emi_journal_reset(e);
+
+	uint8_t *buf = malloc(EMI_DELTA_CHUNK);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+
+	res = emi_delta_apply(e, path, buf, 0);
+	free(buf);
+
+	// without a reference point (or after failed load) next checkpoint is a full one
+	emi_dirty_clear(e);
+	free(e->ckpt);
+	e->ckpt = ((res == EMI_E_OK) && ckpt) ? emi_delta_ckpt_name(path) : NULL;
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Restore image state saved in checkpoint 'path' (and the whole chain of
+// checkpoints it was based on)
+int emi_checkpoint_restore(struct emi *e, char *path)
+{
+	emi_lock(e);
+	int res = emi_delta_load(e, path, 1);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+struct emi_delta_extent {
+	uint64_t offset;
+	uint64_t len;
+};
+
+struct emi_diff_job {
+	struct emi *a;
+	struct emi *b;
+	int fd_a;				// descriptors for concurrent reads (-1 if none)
+	int fd_b;
+	pthread_mutex_t *io_lock;
+	uint64_t from;
+	uint64_t to;
+	uint32_t unit;
+	struct emi_delta_extent *ext;
+	unsigned ext_count;
+	unsigned ext_size;
+	int res;
+};
+
+// -----------------------------------------------------------------------
+static int emi_diff_extent_add(struct emi_diff_job *j, uint64_t offset, uint64_t len)
+{
+	// extend previous extent if adjacent
+	if (j->ext_count) {
+		struct emi_delta_extent *last = j->ext + j->ext_count - 1;
+		if (last->offset + last->len == offset) {
+			last->len += len;
+			return EMI_E_OK;
+		}
+	}
+
+	if (j->ext_count >= j->ext_size) {
+		unsigned size = j->ext_size ? j->ext_size * 2 : 64;
+		struct emi_delta_extent *ext = realloc(j->ext, size * sizeof(struct emi_delta_extent));
+		if (!ext) {
+			return -EMI_E_ALLOC;
+		}
+		j->ext = ext;
+		j->ext_size = size;
+	}
+
+	j->ext[j->ext_count].offset = offset;
+	j->ext[j->ext_count].len = len;
+	j->ext_count++;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Descriptor the compare threads can read from on their own. Unaligned
+// reads don't work with O_DIRECT, such images go through the backend.
+static int emi_diff_fd(struct emi *e)
+{
+	if (e->io_flags & EMI_IO_DIRECT) {
+		return -1;
+	}
+
+	return e->io->fd(e);
+}
+
+// -----------------------------------------------------------------------
+// Get image data: directly if backend has it mapped, through 'buf' otherwise
+static uint8_t * emi_diff_data(struct emi *e, int fd, uint64_t offset, uint32_t len, uint8_t *buf, pthread_mutex_t *io_lock)
+{
+	uint8_t *data = e->io->map(e, e->hsize + offset, len);
+	if (data) {
+		return data;
+	}
+
+	if (fd >= 0) {
+		uint32_t done = 0;
+		while (done < len) {
+			ssize_t res = pread(fd, buf + done, len - done, e->hsize + offset + done);
+			if (res < 0) {
+				if (errno == EINTR) continue;
+				return NULL;
+			}
+			if (res == 0) {
+				return NULL;
+			}
+			done += res;
+		}
+		return buf;
+	}
+
+	// backends don't have to handle concurrent I/O
+	pthread_mutex_lock(io_lock);
+	int64_t res = e->io->read(e, buf, len, e->hsize + offset);
+	pthread_mutex_unlock(io_lock);
+
+	return res == len ? buf : NULL;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_diff_thread(void *ptr)
+{
+	struct emi_diff_job *j = ptr;
+	uint32_t chunk_max = (EMI_DELTA_CHUNK / j->unit) * j->unit;
+	if (!chunk_max) {
+		chunk_max = j->unit;
+	}
+
+	uint8_t *buf_a = malloc(chunk_max);
+	uint8_t *buf_b = malloc(chunk_max);
+	if (!buf_a || !buf_b) {
+		j->res = -EMI_E_ALLOC;
+		goto fin;
+	}
+
+	for (uint64_t offset=j->from ; offset<j->to ; offset+=chunk_max) {
+		uint32_t chunk = j->to - offset > chunk_max ? chunk_max : j->to - offset;
+		uint8_t *pa = emi_diff_data(j->a, j->fd_a, offset, chunk, buf_a, j->io_lock);
+		uint8_t *pb = emi_diff_data(j->b, j->fd_b, offset, chunk, buf_b, j->io_lock);
+		if (!pa || !pb) {
+			j->res = -EMI_E_READ;
+			goto fin;
+		}
+		// most of the data is usually the same
+		if (!memcmp(pa, pb, chunk)) {
+			continue;
+		}
+		for (uint32_t u=0 ; u<chunk ; u+=j->unit) {
+			uint32_t len = chunk - u > j->unit ? j->unit : chunk - u;
+			if (memcmp(pa + u, pb + u, len)) {
+				j->res = emi_diff_extent_add(j, offset + u, len);
+				if (j->res != EMI_E_OK) {
+					goto fin;
+				}
+			}
+		}
+	}
+
+fin:
+	free(buf_a);
+	free(buf_b);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_diff(struct emi *a, struct emi *b, char *path)
+{
+	int res;
+	struct emi_delta d;
+	struct emi_diff_job jobs[EMI_DELTA_THREADS_MAX];
+	pthread_t threads[EMI_DELTA_THREADS_MAX];
+	int started[EMI_DELTA_THREADS_MAX];
+	pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	if ((a->type != b->type) || (a->block_size != b->block_size) || (a->cylinders != b->cylinders) || (a->heads != b->heads) || (a->spt != b->spt)
+	|| ((a->type == EMI_T_MTAPE) && ((a->v_major != b->v_major) || (a->v_minor != b->v_minor)))) {
+		return -EMI_E_GEOM;
+	}
+
+	res = emi_media_sync(a);
+	if (res == EMI_E_OK) {
+		res = emi_media_sync(b);
+	}
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	int64_t size_a = a->io->size(a);
+	int64_t size_b = b->io->size(b);
+	if ((size_a < 0) || (size_b < 0)) {
+		return -EMI_E_READ;
+	}
+	size_a = size_a > a->hsize ? size_a - a->hsize : 0;
+	size_b = size_b > b->hsize ? size_b - b->hsize : 0;
+	uint64_t common = size_a < size_b ? size_a : size_b;
+
+	// split common data into ranges of whole cylinders (disk) or chunks (tapes)
+	uint64_t split = (b->type == EMI_T_DISK) ? (uint64_t) b->heads * b->spt * b->block_size : EMI_DELTA_CHUNK;
+	if (!split) {
+		split = EMI_DELTA_CHUNK;
+	}
+	uint64_t splits = (common + split - 1) / split;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned count = cpus > 0 ? cpus : 1;
+	if (count > EMI_DELTA_THREADS_MAX) {
+		count = EMI_DELTA_THREADS_MAX;
+	}
+	if (count > splits) {
+		count = splits ? splits : 1;
+	}
+	uint64_t per_job = ((splits + count - 1) / count) * split;
+	int fd_a = emi_diff_fd(a);
+	int fd_b = emi_diff_fd(b);
+
+	memset(jobs, 0, sizeof(jobs));
+	for (unsigned i=0 ; i<count ; i++) {
+		jobs[i].a = a;
+		jobs[i].b = b;
+		jobs[i].fd_a = fd_a;
+		jobs[i].fd_b = fd_b;
+		jobs[i].io_lock = &io_lock;
+		jobs[i].unit = EMI_DIRTY_UNIT(b);
+		jobs[i].from = i * per_job < common ? i * per_job : common;
+		jobs[i].to = (i + 1) * per_job < common ? (i + 1) * per_job : common;
+		jobs[i].res = EMI_E_OK;
+		started[i] = !pthread_create(threads + i, NULL, emi_diff_thread, jobs + i);
+		// no thread, do it here
+		if (!started[i]) {
+			emi_diff_thread(jobs + i);
+		}
+	}
+	for (unsigned i=0 ; i<count ; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+		if ((res == EMI_E_OK) && (jobs[i].res != EMI_E_OK)) {
+			res = jobs[i].res;
+		}
+	}
+	if (res != EMI_E_OK) {
+		goto fin;
+	}
+
+	uint8_t *buf = malloc(EMI_DELTA_CHUNK);
+	if (!buf) {
+		res = -EMI_E_ALLOC;
+		goto fin;
+	}
+
+	res = emi_delta_create(&d, path, b, NULL, 0, size_b);
+	if (res != EMI_E_OK) {
+		free(buf);
+		goto fin;
+	}
+
+	// changed units, in image order
+	for (unsigned i=0 ; (i<count) && (res == EMI_E_OK) ; i++) {
+		for (unsigned k=0 ; (k<jobs[i].ext_count) && (res == EMI_E_OK) ; k++) {
+			res = emi_delta_dump(&d, b, jobs[i].ext[k].offset, jobs[i].ext[k].len, buf, 0);
+		}
+	}
+	// data only 'b' has (image grows with blanks when patched)
+	if ((res == EMI_E_OK) && (size_b > common)) {
+		res = emi_delta_dump(&d, b, common, size_b - common, buf, 1);
+	}
+
+	res = emi_delta_finish(&d, path, res);
+	free(buf);
+
+fin:
+	for (unsigned i=0 ; i<count ; i++) {
+		free(jobs[i].ext);
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Store differences between images 'a' and 'b' in delta file 'path',
+// so that patching 'a' with it gives 'b'
+int emi_diff(struct emi *a, struct emi *b, char *path)
+{
+	// always lock in the same order
+	struct emi *first = a < b ? a : b;
+	struct emi *second = a < b ? b : a;
+
+	emi_lock(first);
+	if (second != first) {
+		emi_lock(second);
+	}
+
+	int res = __emi_diff(a, b, path);
+
+	if (second != first) {
+		emi_unlock(second);
+	}
+	emi_unlock(first);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Apply delta file 'path' (made by emi_diff() or emi_checkpoint()) to image
+int emi_patch(struct emi *e, char *path)
+{
+	emi_lock(e);
+	int res = emi_delta_load(e, path, 0);
+	emi_unlock(e);
+
+	return res;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
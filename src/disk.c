@@ -15,13 +15,311 @@
 //  Foundation, Inc.,
 //  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+#define _XOPEN_SOURCE 600
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "emimg.h"
+#include "io.h"
+
+// Write coalescing: sector writes are held in memory and written out
+// sorted by offset, with adjacent sectors merged into a single write.
+// Held sectors are written out when there is no room for more, when the
+// oldest one waits for too long (timer thread), on emi_flush() and when
+// the image is closed. Reads see held data.
+struct emi_disk_wc {
+	struct emi *e;			// image sectors are held for
+	uint32_t max;			// number of sectors held at most
+	unsigned max_ms;		// time limit for holding a sector
+	uint32_t count;			// sectors held
+	uint32_t *lba;			// held sector numbers, by slot
+	uint8_t *data;			// held sector data, by slot
+	uint64_t *order;		// (lba, slot) pairs, sorted on write out
+	uint32_t *hash;			// lba -> slot + 1 (0: empty)
+	uint32_t hash_mask;
+	uint8_t *run;			// merged sectors buffer
+	struct timespec first;	// when the oldest sector got held
+	int err;				// failed timer write out result
+
+	pthread_t timer;
+	pthread_cond_t cond;
+	int quit;
+};
+
+// merged write size limit
+#define EMI_DISK_WC_RUN_MAX (1024 * 1024)
+
+struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags);
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len);
+uint8_t * emi_journal_prepare(struct emi *e, uint64_t offset, uint64_t len);
+void emi_journal_commit(struct emi *e);
+void emi_journal_reset(struct emi *e);
+void emi_hot_mark(struct emi *e, uint64_t offset, uint64_t len);
+
+// -----------------------------------------------------------------------
+static uint32_t * emi_disk_wc_find(struct emi_disk_wc *wc, uint32_t lba)
+{
+	uint32_t i = (lba * 2654435761u) & wc->hash_mask;
+
+	while (wc->hash[i] && (wc->lba[wc->hash[i] - 1] != lba)) {
+		i = (i + 1) & wc->hash_mask;
+	}
+
+	return wc->hash + i;
+}
+
+// -----------------------------------------------------------------------
+static int emi_disk_wc_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+// -----------------------------------------------------------------------
+// Write out all held sectors (image lock held)
+static int emi_disk_wc_flush(struct emi *e, struct emi_disk_wc *wc)
+{
+	int res = EMI_E_OK;
+	uint32_t run_max = EMI_DISK_WC_RUN_MAX / e->block_size;
+
+	if (!wc->count) {
+		return EMI_E_OK;
+	}
+
+	for (uint32_t i=0 ; i<wc->count ; i++) {
+		wc->order[i] = ((uint64_t) wc->lba[i] << 32) | i;
+	}
+	qsort(wc->order, wc->count, sizeof(uint64_t), emi_disk_wc_cmp);
+
+	uint32_t i = 0;
+	while (i < wc->count) {
+		uint32_t start = wc->order[i] >> 32;
+		uint32_t len = 0;
+		// merge adjacent sectors
+		while ((i < wc->count) && (len < run_max) && ((wc->order[i] >> 32) == start + len)) {
+			uint32_t slot = wc->order[i] & 0xffffffff;
+			memcpy(wc->run + (uint64_t) len * e->block_size, wc->data + (uint64_t) slot * e->block_size, e->block_size);
+			len++;
+			i++;
+		}
+		uint64_t size = (uint64_t) len * e->block_size;
+		if (e->io->write(e, wc->run, size, e->hsize + (uint64_t) start * e->block_size) != size) {
+			res = -EMI_E_WRITE;
+		}
+	}
+
+	wc->count = 0;
+	memset(wc->hash, 0, (wc->hash_mask + 1) * sizeof(uint32_t));
+
+	return res;
+}
 
-struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint32_t len, uint32_t flags);
+// -----------------------------------------------------------------------
+// Hold sectors to be written (image lock held)
+static void emi_disk_wc_put(struct emi *e, struct emi_disk_wc *wc, uint8_t *buf, uint32_t lba, unsigned count)
+{
+	if (!wc->count) {
+		clock_gettime(CLOCK_MONOTONIC, &wc->first);
+		pthread_cond_signal(&wc->cond);
+	}
+
+	for (unsigned i=0 ; i<count ; i++) {
+		uint32_t *h = emi_disk_wc_find(wc, lba + i);
+		if (!*h) {
+			wc->lba[wc->count] = lba + i;
+			*h = ++wc->count;
+		}
+		memcpy(wc->data + (uint64_t) (*h - 1) * e->block_size, buf + (uint64_t) i * e->block_size, e->block_size);
+	}
+}
+
+// -----------------------------------------------------------------------
+// Put held sectors over data read from the image (image lock held)
+static void emi_disk_wc_get(struct emi *e, struct emi_disk_wc *wc, uint8_t *buf, uint32_t lba, unsigned count)
+{
+	for (unsigned i=0 ; (i<count) && wc->count ; i++) {
+		uint32_t *h = emi_disk_wc_find(wc, lba + i);
+		if (*h) {
+			memcpy(buf + (uint64_t) i * e->block_size, wc->data + (uint64_t) (*h - 1) * e->block_size, e->block_size);
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+static void * emi_disk_wc_timer(void *ptr)
+{
+	struct emi_disk_wc *wc = ptr;
+	struct emi *e = wc->e;
+
+	pthread_mutex_lock(&e->lock);
+	while (!wc->quit) {
+		if (!wc->count) {
+			pthread_cond_wait(&wc->cond, &e->lock);
+			continue;
+		}
+		struct timespec t = wc->first;
+		t.tv_sec += wc->max_ms / 1000;
+		t.tv_nsec += (wc->max_ms % 1000) * 1000000L;
+		if (t.tv_nsec >= 1000000000L) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&wc->cond, &e->lock, &t)) {
+			int res = emi_disk_wc_flush(e, wc);
+			if (!wc->err) {
+				wc->err = res;
+			}
+		}
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static void emi_disk_wc_free(struct emi_disk_wc *wc)
+{
+	free(wc->lba);
+	free(wc->data);
+	free(wc->order);
+	free(wc->hash);
+	free(wc->run);
+	free(wc);
+}
+
+// -----------------------------------------------------------------------
+static struct emi_disk_wc * emi_disk_wc_alloc(struct emi *e, uint32_t max_bytes, unsigned max_ms)
+{
+	struct emi_disk_wc *wc = calloc(1, sizeof(struct emi_disk_wc));
+	if (!wc) {
+		return NULL;
+	}
+
+	wc->max = max_bytes / e->block_size;
+	if (!wc->max) {
+		wc->max = 1;
+	}
+	wc->max_ms = max_ms;
+	wc->e = e;
+
+	uint32_t hash_size = 1;
+	while (hash_size < 2 * wc->max) {
+		hash_size <<= 1;
+	}
+	wc->hash_mask = hash_size - 1;
+
+	wc->lba = malloc(wc->max * sizeof(uint32_t));
+	wc->data = malloc((uint64_t) wc->max * e->block_size);
+	wc->order = malloc(wc->max * sizeof(uint64_t));
+	wc->hash = calloc(hash_size, sizeof(uint32_t));
+	wc->run = malloc(EMI_DISK_WC_RUN_MAX > e->block_size ? EMI_DISK_WC_RUN_MAX : e->block_size);
+	if (!wc->lba || !wc->data || !wc->order || !wc->hash || !wc->run) {
+		emi_disk_wc_free(wc);
+		return NULL;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wc->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return wc;
+}
+
+// -----------------------------------------------------------------------
+// Write out held sectors, detach write coalescing from the image
+// and tell the timer to quit (image lock held)
+static int emi_disk_wc_detach(struct emi *e, struct emi_disk_wc *wc)
+{
+	int res = emi_disk_wc_flush(e, wc);
+	if (wc->err) {
+		res = wc->err;
+	}
+	e->wc = NULL;
+	wc->quit = 1;
+	pthread_cond_signal(&wc->cond);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Wait for the timer of detached write coalescing to quit and free it
+// (image lock not held, timer needs it to finish)
+static void emi_disk_wc_destroy(struct emi_disk_wc *wc)
+{
+	pthread_join(wc->timer, NULL);
+	pthread_cond_destroy(&wc->cond);
+	emi_disk_wc_free(wc);
+}
+
+// -----------------------------------------------------------------------
+// Write out held sectors and stop coalescing
+static int emi_disk_wc_stop(struct emi *e)
+{
+	int res = EMI_E_OK;
+
+	emi_lock(e);
+	struct emi_disk_wc *wc = e->wc;
+	if (wc) {
+		res = emi_disk_wc_detach(e, wc);
+	}
+	emi_unlock(e);
+
+	if (wc) {
+		emi_disk_wc_destroy(wc);
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Hold disk writes for at most 'max_ms' milliseconds and at most
+// 'max_bytes' of data, to write them out merged and in order.
+// 'max_bytes' of 0 writes out held data and stops coalescing.
+int emi_disk_coalesce(struct emi *e, uint32_t max_bytes, unsigned max_ms)
+{
+	int res = EMI_E_OK;
+	struct emi_disk_wc *wc = NULL;
+
+	if (e->type != EMI_T_DISK) {
+		return -EMI_E_ACCESS;
+	}
+
+	// old buffer goes away and new one comes in with no writes in between
+	emi_lock(e);
+	struct emi_disk_wc *old = e->wc;
+	if (old) {
+		res = emi_disk_wc_detach(e, old);
+	}
+	if (max_bytes) {
+		wc = emi_disk_wc_alloc(e, max_bytes, max_ms);
+		if (wc && pthread_create(&wc->timer, NULL, emi_disk_wc_timer, wc)) {
+			pthread_cond_destroy(&wc->cond);
+			emi_disk_wc_free(wc);
+			wc = NULL;
+		}
+		if (!wc) {
+			res = -EMI_E_ALLOC;
+		}
+		e->wc = wc;
+	}
+	emi_unlock(e);
+
+	if (old) {
+		emi_disk_wc_destroy(old);
+	}
+
+	return res;
+}
 
 // -----------------------------------------------------------------------
 int emi_disk_open(struct emi *e)
@@ -33,6 +331,30 @@ int emi_disk_open(struct emi *e)
 	return EMI_E_OK;
 }
 
+// -----------------------------------------------------------------------
+void emi_disk_close(struct emi *e)
+{
+	emi_disk_wc_stop(e);
+}
+
+// -----------------------------------------------------------------------
+int emi_disk_sync(struct emi *e)
+{
+	struct emi_disk_wc *wc = e->wc;
+
+	if (!wc) {
+		return EMI_E_OK;
+	}
+
+	int res = emi_disk_wc_flush(e, wc);
+	if (wc->err) {
+		res = wc->err;
+		wc->err = EMI_E_OK;
+	}
+
+	return res;
+}
+
 // -----------------------------------------------------------------------
 struct emi * emi_disk_create(char *img_name, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt)
 {
@@ -45,47 +367,129 @@ struct emi * emi_disk_create(char *img_name, uint16_t block_size, uint16_t cylin
 }
 
 // -----------------------------------------------------------------------
-static int chs2offset(struct emi *e, int cyl, int head, int sect)
+static int __emi_disk_resize(struct emi *e, uint16_t cylinders, int shrink)
 {
-	return e->block_size * (sect + (head * e->spt) + (cyl * e->heads * e->spt));
+	int res;
+
+	// volume members have their own geometry
+	if (e->io == &emi_io_vol) {
+		return -EMI_E_ACCESS;
+	}
+
+	if (e->flags & EMI_WRPROTECT) {
+		return -EMI_E_WRPROTECT;
+	}
+
+	if ((cylinders < e->cylinders) && !shrink) {
+		return -EMI_E_GEOM;
+	}
+
+	// sectors held for coalescing go to the image first
+	res = emi_disk_sync(e);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	int64_t size = e->io->size(e);
+	if (size < 0) {
+		return size;
+	}
+	uint64_t cyl_size = (uint64_t) e->heads * e->spt * e->block_size;
+	uint64_t old_end = e->hsize + e->cylinders * cyl_size;
+	uint64_t new_end = e->hsize + cylinders * cyl_size;
+
+	// data past the new end is dropped, full size image stays full size
+	// (sparse one stays sparse)
+	if ((size > new_end) || ((size >= old_end) && (size < new_end))) {
+		res = e->io->truncate(e, new_end);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+	}
+
+	// journal and checkpoints don't lead back across geometry change
+	emi_journal_reset(e);
+	free(e->ckpt);
+	e->ckpt = NULL;
+
+	e->cylinders = cylinders;
+
+	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-int emi_disk_read(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect)
+// Change the number of disk cylinders in place. Sectors keep their
+// addresses. Disk shrinks only when 'shrink' is set, data past the new
+// disk end is lost then. Other geometry changes need emi_disk_reshape().
+int emi_disk_resize(struct emi *e, uint16_t cylinders, int shrink)
 {
-	int res;
-
 	if (e->type != EMI_T_DISK) {
 		return -EMI_E_ACCESS;
 	}
 
+	if (cylinders <= 0) {
+		return -EMI_E_GEOM;
+	}
+
+	emi_lock(e);
+	int res = __emi_disk_resize(e, cylinders, shrink);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_disk_chs2lba(struct emi *e, unsigned cyl, unsigned head, unsigned sect, uint32_t *lba)
+{
 	if ((cyl >= e->cylinders) || (head >= e->heads) || (sect >= e->spt)) {
 		return -EMI_E_SEEK;
 	}
 
-	res = fseek(e->image, EMI_HEADER_SIZE + chs2offset(e, cyl, head, sect), SEEK_SET);
-	if (res < 0) {
+	*lba = sect + (head * e->spt) + (cyl * e->heads * e->spt);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_disk_read_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count)
+{
+	if (e->type != EMI_T_DISK) {
+		return -EMI_E_ACCESS;
+	}
+
+	if ((count == 0) || ((uint64_t) lba + count > (uint32_t) e->cylinders * e->heads * e->spt)) {
 		return -EMI_E_SEEK;
 	}
 
-	res = fread(buf, 1, e->block_size, e->image);
-	if (res != e->block_size) {
+	uint64_t len = (uint64_t) count * e->block_size;
+
+	int64_t res = e->io->read(e, buf, len, e->hsize + (uint64_t) lba * e->block_size);
+	if (res < 0) {
 		return -EMI_E_READ;
 	}
+	// sparse image may end before the sectors, they hold zeros
+	// (or data held for coalescing)
+	if (res < len) {
+		memset(buf + res, 0, len - res);
+	}
+
+	emi_hot_mark(e, (uint64_t) lba * e->block_size, len);
+
+	if (e->wc) {
+		emi_disk_wc_get(e, e->wc, buf, lba, count);
+	}
 
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-int emi_disk_write(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect)
+static int __emi_disk_write_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count)
 {
-	int res;
-
 	if (e->type != EMI_T_DISK) {
 		return -EMI_E_ACCESS;
 	}
 
-	if ((cyl >= e->cylinders) || (head >= e->heads) || (sect >= e->spt)) {
+	if ((count == 0) || ((uint64_t) lba + count > (uint32_t) e->cylinders * e->heads * e->spt)) {
 		return -EMI_E_SEEK;
 	}
 
@@ -93,17 +497,93 @@ int emi_disk_write(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, uns
 		return -EMI_E_WRPROTECT;
 	}
 
-	res = fseek(e->image, EMI_HEADER_SIZE + chs2offset(e, cyl, head, sect), SEEK_SET);
-	if (res < 0) {
-		return -EMI_E_SEEK;
+	uint64_t offset = (uint64_t) lba * e->block_size;
+	uint64_t len = (uint64_t) count * e->block_size;
+	struct emi_disk_wc *wc = e->wc;
+
+	// keep prior contents (including sectors held for coalescing)
+	if (e->journal) {
+		uint8_t *old = emi_journal_prepare(e, e->hsize + offset, len);
+		if (old) {
+			if (wc) {
+				emi_disk_wc_get(e, wc, old, lba, count);
+			}
+			emi_journal_commit(e);
+		}
+	}
+
+	if (wc) {
+		// make room, large writes go straight to the image
+		if ((wc->count + count > wc->max) && (emi_disk_wc_flush(e, wc) != EMI_E_OK)) {
+			return -EMI_E_WRITE;
+		}
+		if (count > wc->max) {
+			wc = NULL;
+		}
 	}
 
-	res = fwrite(buf, 1, e->block_size, e->image);
-	if (res != e->block_size) {
+	if (wc) {
+		emi_disk_wc_put(e, wc, buf, lba, count);
+	} else if (e->io->write(e, buf, len, e->hsize + offset) != len) {
 		return -EMI_E_WRITE;
 	}
 
+	emi_dirty_mark(e, offset, len);
+
 	return EMI_E_OK;
 }
 
+// -----------------------------------------------------------------------
+int emi_disk_read(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect)
+{
+	uint32_t lba;
+
+	emi_lock(e);
+	int res = emi_disk_chs2lba(e, cyl, head, sect, &lba);
+	if (res == EMI_E_OK) {
+		res = __emi_disk_read_lba(e, buf, lba, 1);
+	}
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_disk_write(struct emi *e, uint8_t *buf, unsigned cyl, unsigned head, unsigned sect)
+{
+	uint32_t lba;
+
+	emi_lock(e);
+	int res = emi_disk_chs2lba(e, cyl, head, sect, &lba);
+	if (res == EMI_E_OK) {
+		res = __emi_disk_write_lba(e, buf, lba, 1);
+	}
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Read 'count' consecutive sectors, starting at linear sector 'lba'
+// (sect + head * spt + cyl * heads * spt), in one transfer
+int emi_disk_read_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count)
+{
+	emi_lock(e);
+	int res = __emi_disk_read_lba(e, buf, lba, count);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Write 'count' consecutive sectors, starting at linear sector 'lba'
+int emi_disk_write_lba(struct emi *e, uint8_t *buf, uint32_t lba, unsigned count)
+{
+	emi_lock(e);
+	int res = __emi_disk_write_lba(e, buf, lba, count);
+	emi_unlock(e);
+
+	return res;
+}
+
 // vim: tabstop=4 shiftwidth=4 autoindent
@@ -15,6 +15,8 @@
 //  Foundation, Inc.,
 //  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+#define _GNU_SOURCE
+
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -22,12 +24,32 @@
 #include <strings.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "emimg.h"
 
 enum long_opts {
 	OPT_PROTECT = 1000,
 	OPT_NOPROTECT,
+	OPT_COMPRESS,
+	OPT_COMPACT,
+	OPT_UPGRADE,
+	OPT_LABEL,
+	OPT_DIFF,
+	OPT_PATCH,
+	OPT_SPARSE,
+	OPT_BATCH,
+	OPT_STRIPE,
+	OPT_MIRROR,
+	OPT_TAPESET,
+	OPT_CLONE,
+	OPT_BUNDLE,
+	OPT_CHECK,
+	OPT_TRUNCATE,
+	OPT_RESIZE,
+	OPT_SHRINK,
+	OPT_RESHAPE,
 	OPT_HELP,
 	OPT_HELP_PRESETS,
 };
@@ -51,11 +73,45 @@ static const struct preset known_presets[] = {
 	{ EMI_T_DISK, "flop5dshd", "Floppy 5.25\" DSHD 1.2MB", 80, 2, 15, 512 },
 	{ EMI_T_MTAPE, "mtape", "Magnetic tape", 0, 0, 0, 0 },
 	{ EMI_T_PTAPE, "ptape", "Punched tape", 0, 0, 0, 0 },
+	{ 0, NULL, NULL, 0, 0, 0, 0 }
+};
+
+// media to be created
+struct media {
+	char *image;
+	int type;
+	int cyls, heads, spt, sector;
+	uint64_t size;
+	int compress;
+	int sparse;
+	char *src;
+	char *label;
+	int vol_mode;
+	char *members;
+	int tapeset;
+};
+
+// batch creation state, shared by all workers
+struct batch {
+	struct media *list;
+	int count;
+	int next;
+	int failed;
+	pthread_mutex_t lock;
 };
 
-static char *image, *src;
-static int type, cyls, heads, spt, sector, size;
+static struct media media;
+static int create;
 static int flags_set, flags_clear;
+static int compact, upgrade;
+static int check, truncate_tape;
+static int resize, shrink;
+static char *diff_image, *patch_file, *clone_image, *reshape_image, *output;
+static char *batch;
+static char *bundle;
+static char **bundle_images;
+static int bundle_count;
+static int jobs;
 
 void emi_close(struct emi *e);
 
@@ -81,6 +137,11 @@ void print_help_presets()
 		p++;
 	}
 	printf("\nYou can modify preset parameters with -c, -h, -s, -l and --size\n");
+	printf("\nBatch manifest (--batch <manifest>) lists one media per line:\n");
+	printf("  <filename> <preset> [cyls=<n>] [heads=<n>] [spt=<n>] [sector=<n>] [size=<megabytes>]\n");
+	printf("                      [src=<filename>] [compress=0|1] [sparse=0|1] [label=<text>]\n");
+	printf("                      [stripe=<filename>,...] [mirror=<filename>,...] [tapeset=0|1]\n");
+	printf("Empty lines and lines starting with '#' are ignored. Values can't contain whitespace.\n");
 }
 
 // -----------------------------------------------------------------------
@@ -99,16 +160,60 @@ void print_help()
 	printf("  --sector, -l <bytes>    : sector length (bytes)\n");
 	printf("  --size, -z <megabytes>  : media size (in MB, only for magnetic tape)\n");
 	printf("  --protect|--no-protect  : set media write-protected/-unprotected\n");
+	printf("  --compress              : store data blocks compressed (only for magnetic tape)\n");
+	printf("  --sparse                : don't preallocate space for new media data\n");
+	printf("  --stripe <f1,f2,...>    : create disk volume striped over given member images (next to the volume)\n");
+	printf("  --mirror <f1,f2,...>    : create disk volume mirrored on given member images (next to the volume)\n");
+	printf("  --tapeset               : create magnetic tape set, --size is the size of each volume\n");
+	printf("  --compact               : drop erased blocks and stale data (only for magnetic tape)\n");
+	printf("  --upgrade               : convert image to the current format version\n");
+	printf("  --check                 : check tape structure, report faults (only for magnetic tape)\n");
+	printf("  --truncate              : cut tape at the first fault found by --check\n");
+	printf("  --label <text>          : set media label\n");
+	printf("  --diff <filename>       : store differences between image and given one (requires -o)\n");
+	printf("  --output, -o <filename> : output file name\n");
+	printf("  --patch <filename>      : apply differences stored with --diff\n");
+	printf("  --clone <filename>      : create a copy of the image, sharing storage if possible\n");
+	printf("  --resize                : change the number of disk cylinders in place (-c or -p)\n");
+	printf("  --shrink                : allow --resize to drop cylinders, along with their data\n");
+	printf("  --reshape <filename>    : copy disk to a new geometry, keeping sectors at their CHS addresses\n");
+	printf("  --bundle <filename>     : pack images given as arguments into a bundle, list it or show a member (-i)\n");
+	printf("  --batch <manifest>      : create all media listed in the manifest (see --help-preset)\n");
+	printf("  --jobs, -j <number>     : number of media created in parallel (default: number of CPUs)\n");
 	printf("\nUsage:\n");
 	printf("  * Show the header of an existing media:\n");
 	printf("      emimg -i <filename>\n");
 	printf("  * Create empty media:\n");
 	printf("      emimg -i <filename> -p disk -c <cylinders> -h <heads> -s <sectors_per_track> -l <bytes>\n");
 	printf("      emimg -i <filename> -p <name> [-c <cylinders>] [-h <heads>] [-s <sectors_per_track>] [-l <bytes>]\n");
-	printf("      emimg -i <filename> -p mtape -z <megabytes>\n");
+	printf("      emimg -i <filename> -p mtape -z <megabytes> [--compress]\n");
 	printf("      emimg -i <filename> -p ptape\n");
+	printf("  * Create disk volume with data striped (or mirrored) over member images:\n");
+	printf("      emimg -i <filename> -p <name> --stripe|--mirror <filename>,<filename>[,...]\n");
+	printf("  * Create magnetic tape set (volumes <filename>.000, <filename>.001, ...):\n");
+	printf("      emimg -i <filename> -p mtape -z <megabytes> --tapeset [--compress]\n");
 	printf("  * Create new disk and import raw image data:\n");
 	printf("      emimg -i <filename> -p disk -r <source> -c <cylinders> -h <heads> -s <sectors> -l <bytes>\n");
+	printf("  * Create all media listed in a manifest:\n");
+	printf("      emimg --batch <manifest> [-j <jobs>] [--sparse]\n");
+	printf("  * Compact magnetic tape image:\n");
+	printf("      emimg -i <filename> --compact\n");
+	printf("  * Check magnetic tape image, optionally cutting it at the first fault:\n");
+	printf("      emimg -i <filename> --check [--truncate]\n");
+	printf("  * Convert image to the current format version:\n");
+	printf("      emimg -i <filename> --upgrade\n");
+	printf("  * Store changes between two images of the same media, apply them to the first one:\n");
+	printf("      emimg -i <filename> --diff <filename> -o <patch>\n");
+	printf("      emimg -i <filename> --patch <patch>\n");
+	printf("  * Clone image (instant on filesystems with shared extents, like btrfs or xfs):\n");
+	printf("      emimg -i <filename> --clone <filename>\n");
+	printf("  * Grow (or shrink) disk in place, copy disk to a different geometry:\n");
+	printf("      emimg -i <filename> --resize -c <cylinders> [--shrink]\n");
+	printf("      emimg -i <filename> --reshape <filename> [-p <name>] [-c <cylinders>] [-h <heads>] [-s <sectors>] [-l <bytes>]\n");
+	printf("  * Pack images into a bundle (\"-\" reads file names from stdin), list it, show member header:\n");
+	printf("      emimg --bundle <bundle> <filename> [<filename> ...]\n");
+	printf("      emimg --bundle <bundle>\n");
+	printf("      emimg --bundle <bundle> -i <member>\n");
 	printf("  * Set/clear write protection:\n");
 	printf("      emimg -i <filename> --protect|--no-protect\n");
 	printf("\n");
@@ -129,10 +234,59 @@ const struct preset * get_preset(char *name)
 	return NULL;
 }
 
+// -----------------------------------------------------------------------
+void media_preset(struct media *m, const struct preset *p)
+{
+	m->type = p->media_type;
+	m->cyls = p->cyls;
+	m->heads = p->heads;
+	m->spt = p->spt;
+	m->sector = p->sector;
+}
+
+// -----------------------------------------------------------------------
+char * media_check(struct media *m)
+{
+	if ((m->type == EMI_T_MTAPE) && (m->size == 0)) {
+		return "Creating magnetic tape image requires --size option";
+	}
+
+	if ((m->type != EMI_T_MTAPE) && (m->size != 0)) {
+		return "You can only set size for magnetic tape images";
+	}
+
+	if ((m->type != EMI_T_MTAPE) && m->compress) {
+		return "Only magnetic tape images can be compressed";
+	}
+
+	if ((m->type != EMI_T_DISK) && (m->cyls || m->heads || m->spt)) {
+		return "Options: --cyls, --heads, --spt can be used only for disk images";
+	}
+
+	if ((m->type != EMI_T_DISK) && (m->src)) {
+		return "Can only import disk image contents";
+	}
+
+	if ((m->type != EMI_T_DISK) && (m->members)) {
+		return "Only disk images can be striped or mirrored";
+	}
+
+	if ((m->type != EMI_T_MTAPE) && m->tapeset) {
+		return "Only magnetic tapes can form a tape set";
+	}
+
+	if (m->label && (strlen(m->label) > 255)) {
+		return "Media label is too long";
+	}
+
+	return NULL;
+}
+
 // -----------------------------------------------------------------------
 void parse_opts(int argc, char **argv)
 {
 	int opt, idx;
+	char *msg;
 	const struct preset *p;
 
 	static struct option opts[] = {
@@ -146,13 +300,33 @@ void parse_opts(int argc, char **argv)
 		{ "size",		1,  0, 'z' },
 		{ "protect",	0,	0, OPT_PROTECT },
 		{ "no-protect",	0,	0, OPT_NOPROTECT },
+		{ "compress",	0,	0, OPT_COMPRESS },
+		{ "compact",	0,	0, OPT_COMPACT },
+		{ "upgrade",	0,	0, OPT_UPGRADE },
+		{ "label",		1,	0, OPT_LABEL },
+		{ "diff",		1,	0, OPT_DIFF },
+		{ "patch",		1,	0, OPT_PATCH },
+		{ "output",		1,	0, 'o' },
+		{ "sparse",		0,	0, OPT_SPARSE },
+		{ "batch",		1,	0, OPT_BATCH },
+		{ "stripe",		1,	0, OPT_STRIPE },
+		{ "mirror",		1,	0, OPT_MIRROR },
+		{ "tapeset",	0,	0, OPT_TAPESET },
+		{ "clone",		1,	0, OPT_CLONE },
+		{ "bundle",		1,	0, OPT_BUNDLE },
+		{ "check",		0,	0, OPT_CHECK },
+		{ "truncate",	0,	0, OPT_TRUNCATE },
+		{ "resize",		0,	0, OPT_RESIZE },
+		{ "shrink",		0,	0, OPT_SHRINK },
+		{ "reshape",	1,	0, OPT_RESHAPE },
+		{ "jobs",		1,	0, 'j' },
 		{ "help",		0,	0, OPT_HELP },
 		{ "help-preset",0,	0, OPT_HELP_PRESETS},
 		{ NULL,			0,	0, 0 }
 	};
 
 	while (1) {
-		opt = getopt_long(argc, argv,"i:p:r:c:h:s:l:z:", opts, &idx);
+		opt = getopt_long(argc, argv,"i:p:r:c:h:s:l:z:o:j:", opts, &idx);
 		if (opt == -1) {
 			break;
 		}
@@ -171,38 +345,100 @@ void parse_opts(int argc, char **argv)
 			case OPT_NOPROTECT:
 				flags_clear = EMI_WRPROTECT;
 				break;
+			case OPT_COMPRESS:
+				media.compress = 1;
+				break;
+			case OPT_COMPACT:
+				compact = 1;
+				break;
+			case OPT_UPGRADE:
+				upgrade = 1;
+				break;
+			case OPT_LABEL:
+				media.label = optarg;
+				break;
+			case OPT_DIFF:
+				diff_image = optarg;
+				break;
+			case OPT_PATCH:
+				patch_file = optarg;
+				break;
+			case OPT_SPARSE:
+				media.sparse = 1;
+				break;
+			case OPT_BATCH:
+				batch = optarg;
+				break;
+			case OPT_STRIPE:
+				media.vol_mode = EMI_VOL_STRIPE;
+				media.members = optarg;
+				break;
+			case OPT_MIRROR:
+				media.vol_mode = EMI_VOL_MIRROR;
+				media.members = optarg;
+				break;
+			case OPT_TAPESET:
+				media.tapeset = 1;
+				break;
+			case OPT_CLONE:
+				clone_image = optarg;
+				break;
+			case OPT_BUNDLE:
+				bundle = optarg;
+				break;
+			case OPT_CHECK:
+				check = 1;
+				break;
+			case OPT_TRUNCATE:
+				truncate_tape = 1;
+				break;
+			case OPT_RESIZE:
+				resize = 1;
+				break;
+			case OPT_SHRINK:
+				shrink = 1;
+				break;
+			case OPT_RESHAPE:
+				reshape_image = optarg;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs <= 0) {
+					error("Number of jobs must be greater than 0");
+				}
+				break;
+			case 'o':
+				output = optarg;
+				break;
 			case 'i':
-				image = optarg;
+				media.image = optarg;
 				break;
 			case 'p':
 				p = get_preset(optarg);
 				if (!p) {
 					error("Media preset '%s' is unknown", optarg);
 				} else {
-					cyls = p->cyls;
-					heads = p->heads;
-					spt = p->spt;
-					sector = p->sector;
-					type = p->media_type;
+					media_preset(&media, p);
+					create = 1;
 				}
 				break;
 			case 'r':
-				src = optarg;
+				media.src = optarg;
 				break;
 			case 'c':
-				cyls = atoi(optarg);
+				media.cyls = atoi(optarg);
 				break;
 			case 'h':
-				heads = atoi(optarg);
+				media.heads = atoi(optarg);
 				break;
 			case 's':
-				spt = atoi(optarg);
+				media.spt = atoi(optarg);
 				break;
 			case 'l':
-				sector = atoi(optarg);
+				media.sector = atoi(optarg);
 				break;
 			case 'z':
-				size = atoi(optarg) * 1024 * 1024;
+				media.size = strtoull(optarg, NULL, 10) * 1024 * 1024;
 				break;
 			default:
 				error("Wrong usage.");
@@ -210,27 +446,207 @@ void parse_opts(int argc, char **argv)
 		}
 	}
 
-	if (!image) {
+	if (batch) {
+		if (media.image || create || media.src || media.label || media.members || media.tapeset || compact || upgrade || diff_image || patch_file || clone_image || reshape_image || resize || flags_set || flags_clear || check || bundle) {
+			error("Only --sparse and --jobs can be used with --batch");
+		}
+		return;
+	}
+
+	if (bundle) {
+		if (create || media.src || media.label || media.members || media.tapeset || compact || upgrade || diff_image || patch_file || clone_image || reshape_image || resize || flags_set || flags_clear || check) {
+			error("Only --image can be used with --bundle");
+		}
+		if (media.image && (optind < argc)) {
+			error("Bundle member can be shown only for an existing bundle");
+		}
+		bundle_images = argv + optind;
+		bundle_count = argc - optind;
+		return;
+	}
+
+	if (!media.image) {
 		error("Image name is required");
 	}
 
-	if ((type == EMI_T_MTAPE) && (size == 0)) {
-		error("Creating magnetic tape image requires --size option");
+	// preset gives the new geometry, doesn't create anything
+	if (resize || reshape_image) {
+		if (create && (media.type != EMI_T_DISK)) {
+			error("Only disk presets can be used with --resize or --reshape");
+		}
+		if (media.src || media.members || media.tapeset || media.size || media.compress) {
+			error("Only geometry can be set with --resize or --reshape");
+		}
+		if (resize && reshape_image) {
+			error("--resize and --reshape can't be used together");
+		}
+		if (!media.cyls && !media.heads && !media.spt && !media.sector) {
+			error("New disk geometry is required for --resize or --reshape");
+		}
+		if (resize && !media.cyls) {
+			error("Number of cylinders is required for --resize");
+		}
+		media.type = EMI_T_DISK;
+		create = 0;
+	}
+
+	msg = media_check(&media);
+	if (msg) {
+		error("%s", msg);
 	}
 
-	if ((type != EMI_T_MTAPE) && (size != 0)) {
-		error("You can only set size for magnetic tape images");
+	if (!create && media.members) {
+		error("Volume members can be set only for new media");
 	}
 
-	if ((type != EMI_T_DISK) && (cyls || heads || spt)) {
-		error("Options: --cyls, --heads, --spt can be used only for disk images");
+	if (!create && media.tapeset) {
+		error("Only new media can be made a tape set");
 	}
 
-	if ((type != EMI_T_DISK) && (src)) {
-		error("Can only import disk image contents");
+	if (create && compact) {
+		error("Only existing images can be compacted");
+	}
+
+	if (create && check) {
+		error("Only existing images can be checked");
+	}
+
+	if (shrink && !resize) {
+		error("--shrink can be used only with --resize");
+	}
+
+	if (truncate_tape && !check) {
+		error("--truncate can be used only with --check");
+	}
+
+	if (create && upgrade) {
+		error("Only existing images can be upgraded");
+	}
+
+	if (create && (diff_image || patch_file)) {
+		error("Only existing images can be compared or patched");
+	}
+
+	if (create && clone_image) {
+		error("Only existing images can be cloned");
+	}
+
+	if (diff_image && !output) {
+		error("Output file name is required for --diff");
 	}
 }
 
+// -----------------------------------------------------------------------
+// Parse one manifest line into 'm'. Returns error message or NULL.
+char * parse_manifest_line(char *line, struct media *m)
+{
+	char *save;
+	const struct preset *p;
+
+	char *name = strtok_r(line, " \t\n", &save);
+	char *preset = strtok_r(NULL, " \t\n", &save);
+	if (!preset) {
+		return "Media preset is missing";
+	}
+	p = get_preset(preset);
+	if (!p) {
+		return "Media preset is unknown";
+	}
+	media_preset(m, p);
+
+	m->image = strdup(name);
+	if (!m->image) {
+		return "Out of memory";
+	}
+
+	char *opt;
+	while ((opt = strtok_r(NULL, " \t\n", &save))) {
+		char *val = strchr(opt, '=');
+		if (!val) {
+			return "Media options need to be given as key=value";
+		}
+		*val++ = '\0';
+		if (!strcmp(opt, "cyls")) {
+			m->cyls = atoi(val);
+		} else if (!strcmp(opt, "heads")) {
+			m->heads = atoi(val);
+		} else if (!strcmp(opt, "spt")) {
+			m->spt = atoi(val);
+		} else if (!strcmp(opt, "sector")) {
+			m->sector = atoi(val);
+		} else if (!strcmp(opt, "size")) {
+			m->size = strtoull(val, NULL, 10) * 1024 * 1024;
+		} else if (!strcmp(opt, "compress")) {
+			m->compress = atoi(val);
+		} else if (!strcmp(opt, "sparse")) {
+			m->sparse = atoi(val);
+		} else if (!strcmp(opt, "src")) {
+			m->src = strdup(val);
+			if (!m->src) return "Out of memory";
+		} else if (!strcmp(opt, "label")) {
+			m->label = strdup(val);
+			if (!m->label) return "Out of memory";
+		} else if (!strcmp(opt, "stripe") || !strcmp(opt, "mirror")) {
+			m->vol_mode = !strcmp(opt, "stripe") ? EMI_VOL_STRIPE : EMI_VOL_MIRROR;
+			free(m->members);
+			m->members = strdup(val);
+			if (!m->members) return "Out of memory";
+		} else if (!strcmp(opt, "tapeset")) {
+			m->tapeset = atoi(val);
+		} else {
+			return "Unknown media option";
+		}
+	}
+
+	return media_check(m);
+}
+
+// -----------------------------------------------------------------------
+// Read all media from the manifest. Exits on any error, before anything
+// gets created.
+int parse_manifest(char *manifest, struct media **list)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	int count = 0;
+	int lineno = 0;
+
+	FILE *f = fopen(manifest, "r");
+	if (!f) {
+		error("Cannot open manifest \"%s\"", manifest);
+	}
+
+	*list = NULL;
+
+	while (getline(&line, &line_size, f) >= 0) {
+		lineno++;
+		char *c = line + strspn(line, " \t\n");
+		if (!*c || (*c == '#')) {
+			continue;
+		}
+
+		struct media *l = realloc(*list, (count+1) * sizeof(struct media));
+		if (!l) {
+			error("Cannot allocate memory for manifest");
+		}
+		*list = l;
+
+		struct media *m = *list + count;
+		memset(m, 0, sizeof(struct media));
+		m->sparse = media.sparse;
+		char *msg = parse_manifest_line(c, m);
+		if (msg) {
+			error("%s:%i: %s", manifest, lineno, msg);
+		}
+		count++;
+	}
+
+	free(line);
+	fclose(f);
+
+	return count;
+}
+
 // -----------------------------------------------------------------------
 int import_raw(struct emi *e, char *src_name)
 {
@@ -293,6 +709,317 @@ fin:
 	return ret;
 }
 
+// -----------------------------------------------------------------------
+struct emi * create_volume(struct media *m)
+{
+	char *members[256];
+	unsigned count = 0;
+	char *save;
+
+	char *list = strdup(m->members);
+	if (!list) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	char *name = strtok_r(list, ",", &save);
+	while (name && (count < 256)) {
+		members[count++] = name;
+		name = strtok_r(NULL, ",", &save);
+	}
+
+	struct emi *e = emi_volume_create(m->image, m->vol_mode, m->sector, m->cyls, m->heads, m->spt, members, count);
+	free(list);
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+// Create tape set with its first volume, return the set catalog
+struct emi * create_tapeset(struct media *m)
+{
+	struct emi_tapeset *ts = emi_tapeset_create(m->image, m->size, m->compress ? EMI_COMPRESSED : 0);
+	if (!ts) {
+		return NULL;
+	}
+	emi_tapeset_close(ts);
+
+	return emi_open(m->image);
+}
+
+// -----------------------------------------------------------------------
+// Create media described by 'm'. On error, returns NULL with the reason
+// in 'err'.
+struct emi * create_image(struct media *m, char *err, size_t err_len)
+{
+	int res;
+	struct emi *e;
+
+	switch (m->type) {
+		case EMI_T_DISK:
+			if (m->members) {
+				e = create_volume(m);
+			} else {
+				e = emi_disk_create(m->image, m->sector, m->cyls, m->heads, m->spt);
+			}
+			break;
+		case EMI_T_MTAPE:
+			if (m->tapeset) {
+				e = create_tapeset(m);
+			} else {
+				e = emi_mtape_create(m->image, m->size, m->compress ? EMI_COMPRESSED : 0);
+			}
+			break;
+		case EMI_T_PTAPE:
+			e = emi_ptape_create(m->image);
+			break;
+		default:
+			snprintf(err, err_len, "Unknown media type: %i", m->type);
+			return NULL;
+	}
+
+	// ok?
+	if (!e) {
+		snprintf(err, err_len, "Could not create image: %s", emi_get_err(emi_err));
+		return NULL;
+	}
+
+	// reserve space so the image stays contiguous as data is written
+	res = emi_preallocate(e, m->sparse);
+	if (res != EMI_E_OK) {
+		snprintf(err, err_len, "Could not preallocate image: %s", emi_get_err(res));
+		goto fail;
+	}
+
+	// source given?
+	if (m->src) {
+		res = import_raw(e, m->src);
+		if (res != EMI_E_OK) {
+			snprintf(err, err_len, "Could not import image contents.");
+			goto fail;
+		}
+	}
+
+	// label media?
+	if (m->label) {
+		res = emi_meta_set(e, EMI_META_LABEL, m->label, strlen(m->label));
+		if (res != EMI_E_OK) {
+			snprintf(err, err_len, "Could not set label: %s", emi_get_err(res));
+			goto fail;
+		}
+	}
+
+	return e;
+
+fail:
+	emi_close(e);
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+void * batch_worker(void *ptr)
+{
+	struct batch *b = ptr;
+	char err[512];
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		int i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->count) {
+			break;
+		}
+
+		struct media *m = b->list + i;
+		struct emi *e = create_image(m, err, sizeof(err));
+		if (e) {
+			emi_close(e);
+		}
+
+		pthread_mutex_lock(&b->lock);
+		if (e) {
+			printf("%s: ready\n", m->image);
+		} else {
+			printf("%s: %s\n", m->image, err);
+			b->failed++;
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Create all media listed in the manifest, 'jobs' at a time
+int batch_create(char *manifest, int jobs)
+{
+	struct batch b = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	b.count = parse_manifest(manifest, &b.list);
+
+	if (jobs <= 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0) jobs = 1;
+	}
+	if (jobs > b.count) {
+		jobs = b.count;
+	}
+
+	pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+	if (jobs && !threads) {
+		error("Cannot allocate memory for workers");
+	}
+
+	int started = 0;
+	while (started < jobs) {
+		if (pthread_create(threads + started, NULL, batch_worker, &b)) {
+			break;
+		}
+		started++;
+	}
+	// couldn't start any worker, do all the work here
+	if (jobs && !started) {
+		batch_worker(&b);
+	}
+	for (int i=0 ; i<started ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	printf("%i media created, %i failed.\n", b.count - b.failed, b.failed);
+
+	for (int i=0 ; i<b.count ; i++) {
+		free(b.list[i].image);
+		free(b.list[i].src);
+		free(b.list[i].label);
+		free(b.list[i].members);
+	}
+	free(b.list);
+
+	return b.failed ? 1 : 0;
+}
+
+// -----------------------------------------------------------------------
+// Pack images into a bundle. Image named "-" stands for a list of image
+// file names read from stdin, one per line.
+int bundle_create(char *bundle_name, char **images, int count)
+{
+	char **list = NULL;
+	int list_count = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+
+	for (int i=0 ; i<count ; i++) {
+		int from_stdin = !strcmp(images[i], "-");
+		while (1) {
+			char *name = images[i];
+			if (from_stdin) {
+				if (getline(&line, &line_size, stdin) < 0) {
+					break;
+				}
+				line[strcspn(line, "\n")] = '\0';
+				if (!*line) {
+					continue;
+				}
+				name = line;
+			}
+			char **l = realloc(list, (list_count+1) * sizeof(char*));
+			if (!l || !(l[list_count] = strdup(name))) {
+				error("Cannot allocate memory for image list");
+			}
+			list = l;
+			list_count++;
+			if (!from_stdin) {
+				break;
+			}
+		}
+	}
+	free(line);
+
+	int res = emi_bundle_create(bundle_name, list, list_count);
+	if (res != EMI_E_OK) {
+		error("Could not create bundle: %s", emi_get_err(res));
+	}
+	printf("%i images bundled.\n", list_count);
+
+	for (int i=0 ; i<list_count ; i++) {
+		free(list[i]);
+	}
+	free(list);
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------
+int bundle_list(char *bundle_name)
+{
+	uint64_t size;
+
+	int count = emi_bundle_count(bundle_name);
+	if (count < 0) {
+		error("Could not open bundle: %s", emi_get_err(count));
+	}
+
+	for (int i=0 ; i<count ; i++) {
+		const char *name = emi_bundle_member(bundle_name, i, &size);
+		if (!name) {
+			error("Could not read bundle index: %s", emi_get_err(emi_err));
+		}
+		printf("%12" PRIu64 "  %s\n", size, name);
+	}
+	printf("%i images in bundle.\n", count);
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------
+// Check tape structure and report. Returns 1 if tape has faults left.
+int check_tape(struct emi *e, int truncate)
+{
+	struct emi_mtape_check c;
+
+	if (e->type != EMI_T_MTAPE) {
+		error("Only magnetic tape images can be checked");
+	}
+
+	int res = emi_mtape_check(e, &c, truncate);
+	if (res != EMI_E_OK) {
+		error("Could not check image: %s", emi_get_err(res));
+	}
+
+	printf("Data blocks  : %" PRIu64 "\n", c.blocks);
+	printf("Tape marks   : %" PRIu64 "\n", c.marks);
+	printf("Erased gaps  : %" PRIu64 "\n", c.erased);
+	if (c.eot) {
+		printf("EOT marker   : at offset %" PRIu64 "\n", c.eot);
+	}
+	if (c.trailing) {
+		printf("Past EOT     : %" PRIu64 " bytes of stale data (use --compact to drop)\n", c.trailing);
+	}
+
+	int shown = c.fault_count < EMI_MTAPE_CHECK_FAULTS ? c.fault_count : EMI_MTAPE_CHECK_FAULTS;
+	for (int i=0 ; i<shown ; i++) {
+		printf("Fault        : at offset %" PRIu64 ": %s\n", c.faults[i].offset, emi_mtape_fault_desc(c.faults[i].fault));
+	}
+	if (c.fault_count > shown) {
+		printf("Fault        : ... and %u more\n", c.fault_count - shown);
+	}
+
+	if (!c.fault_count) {
+		printf("Tape structure is OK.\n");
+		return 0;
+	}
+	if (truncate) {
+		printf("Tape truncated at offset %" PRIu64 ".\n", c.faults[0].offset);
+		return 0;
+	}
+
+	printf("Tape structure is broken.\n");
+	return 1;
+}
+
 // -----------------------------------------------------------------------
 // ---- MAIN -------------------------------------------------------------
 // -----------------------------------------------------------------------
@@ -300,49 +1027,145 @@ int main(int argc, char **argv)
 {
 	struct emi *e = NULL;
 	int res;
+	int check_failed = 0;
+	char err[512];
 
 	parse_opts(argc, argv);
 
-	// create media?
-	if (type != 0) {
-		switch (type) {
-			case EMI_T_DISK:
-				e = emi_disk_create(image, sector, cyls, heads, spt);
-				break;
-			case EMI_T_MTAPE:
-				e = emi_mtape_create(image, size);
-				break;
-			case EMI_T_PTAPE:
-			default:
-				e = emi_ptape_create(image);
-				error("Unknown media type: %i", type);
-				break;
-		}
+	if (batch) {
+		return batch_create(batch, jobs);
+	}
 
-		// ok?
+	if (bundle) {
+		if (bundle_count) {
+			return bundle_create(bundle, bundle_images, bundle_count);
+		}
+		if (!media.image) {
+			return bundle_list(bundle);
+		}
+		e = emi_open_bundle(bundle, media.image);
 		if (!e) {
-			error("Could not create image: %s", emi_get_err(emi_err));
+			error("Could not open bundle member: %s", emi_get_err(emi_err));
 		}
+		emi_header_print(e);
+		emi_close(e);
+		return 0;
+	}
 
-		// source given?
-		if (src) {
-			res = import_raw(e, src);
-			if (res == EMI_E_OK) {
-				printf("Image contents imported.\n");
-			} else {
-				error("Could not import image contents.");
-			}
+	// create media?
+	if (create) {
+		e = create_image(&media, err, sizeof(err));
+		if (!e) {
+			error("%s", err);
+		}
+		if (media.src) {
+			printf("Image contents imported.\n");
 		}
-
 		printf("Image ready.\n");
 
 	} else {
-		e = emi_open(image);
+		// upgrade before use
+		if (upgrade) {
+			res = emi_upgrade(media.image);
+			if (res != EMI_E_OK) {
+				error("Could not upgrade image: %s", emi_get_err(res));
+			}
+			printf("Image upgraded.\n");
+		}
+		e = emi_open(media.image);
 		if (!e) {
 			error("Could not open image: %s", emi_get_err(emi_err));
 		}
 	}
 
+	// check tape?
+	if (check) {
+		res = check_tape(e, truncate_tape);
+		if (res != 0) {
+			check_failed = 1;
+		}
+	}
+
+	// compact tape?
+	if (compact) {
+		res = emi_mtape_compact(e);
+		if (res != EMI_E_OK) {
+			error("Could not compact image: %s", emi_get_err(res));
+		}
+		printf("Image compacted.\n");
+	}
+
+	// store differences?
+	if (diff_image) {
+		struct emi *b = emi_open(diff_image);
+		if (!b) {
+			error("Could not open image: %s", emi_get_err(emi_err));
+		}
+		res = emi_diff(e, b, output);
+		emi_close(b);
+		if (res != EMI_E_OK) {
+			error("Could not compare images: %s", emi_get_err(res));
+		}
+		printf("Differences stored.\n");
+	}
+
+	// apply differences?
+	if (patch_file) {
+		res = emi_patch(e, patch_file);
+		if (res != EMI_E_OK) {
+			error("Could not patch image: %s", emi_get_err(res));
+		}
+		printf("Image patched.\n");
+	}
+
+	// clone image? (changes below apply to the clone)
+	if (clone_image) {
+		struct emi *c = emi_clone(e, clone_image);
+		if (!c) {
+			error("Could not clone image: %s", emi_get_err(emi_err));
+		}
+		emi_close(e);
+		e = c;
+		printf("Image cloned.\n");
+	}
+
+	// change disk geometry? (values not given stay as they are)
+	if (resize || reshape_image) {
+		uint16_t block_size = media.sector ? media.sector : e->block_size;
+		uint16_t cylinders = media.cyls ? media.cyls : e->cylinders;
+		uint8_t heads = media.heads ? media.heads : e->heads;
+		uint8_t spt = media.spt ? media.spt : e->spt;
+		if (resize) {
+			if ((block_size != e->block_size) || (heads != e->heads) || (spt != e->spt)) {
+				error("Only the number of cylinders can be changed with --resize, use --reshape to change other geometry");
+			}
+			if ((cylinders < e->cylinders) && !shrink) {
+				error("Disk would lose cylinders %i-%i, use --shrink to allow it", cylinders, e->cylinders - 1);
+			}
+			res = emi_disk_resize(e, cylinders, shrink);
+			if (res != EMI_E_OK) {
+				error("Could not resize disk: %s", emi_get_err(res));
+			}
+			printf("Disk resized.\n");
+		} else {
+			struct emi *r = emi_disk_reshape(e, reshape_image, block_size, cylinders, heads, spt);
+			if (!r) {
+				error("Could not reshape disk: %s", emi_get_err(emi_err));
+			}
+			emi_close(e);
+			e = r;
+			printf("Disk reshaped.\n");
+		}
+	}
+
+	// label media?
+	if (!create && media.label) {
+		res = emi_meta_set(e, EMI_META_LABEL, media.label, strlen(media.label));
+		if (res != EMI_E_OK) {
+			error("Could not set label: %s", emi_get_err(res));
+		}
+	}
+
 	// any flags to set?
 	if (flags_set) {
 		res = emi_flag_set(e, flags_set);
@@ -358,10 +1181,18 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// header changes would otherwise be lost silently on close
+	if ((!create && media.label) || flags_set || flags_clear) {
+		res = emi_flush(e);
+		if (res != EMI_E_OK) {
+			error("Could not update header: %s", emi_get_err(res));
+		}
+	}
+
 	emi_header_print(e);
 	emi_close(e);
 
-	return 0;
+	return check_failed;
 }
 
 // vim: tabstop=4 shiftwidth=4 autoindent
@@ -20,16 +20,30 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
 
 #include "emimg.h"
+#include "io.h"
 
 #define EMI_MAGIC "E4IM"
 
-int emi_err;
+#define EMI_UPGRADE_SUFFIX ".upgrade"
+#define EMI_COPY_BUF_SIZE (1024 * 1024)
+
+__thread int emi_err;
+
+// images opened in this process, shared between emi_open() users
+static pthread_mutex_t emi_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct emi *emi_registry;
+
+// backend used by emi_open() and emi_*_create()
+// (initially the one named in EMIMG_IO environment variable, if any)
+static unsigned emi_io_default = EMI_IO_STDIO;
+static pthread_once_t emi_io_default_once = PTHREAD_ONCE_INIT;
 
 static const char *emi_error_desc[] = {
 /* EMI_E_OK */				"OK",
@@ -52,45 +66,314 @@ static const char *emi_error_desc[] = {
 /* EMI_E_BOT */				"Beginning Of Tape",
 /* EMI_E_EOT */				"End Of Tape",
 /* EMI_E_EOF */				"End Of File",
+/* EMI_E_BLOCK_SIZE */		"block size too large for media",
+/* EMI_E_IO */				"unknown storage backend",
+/* EMI_E_HEADER_CRC */		"header checksum mismatch",
+/* EMI_E_META */			"metadata entry not found",
+/* EMI_E_META_SIZE */		"metadata area full",
+/* EMI_E_DELTA */			"checkpoint/delta file damaged",
+/* EMI_E_VOLUME */			"volume member missing or mismatched",
 
 /* EMI_E_UNKNOWN */			"unknown error",
 };
 
 typedef int (*emi_open_f)(struct emi *e);
 typedef void (*emi_close_f)(struct emi *e);
+typedef int (*emi_sync_f)(struct emi *e);
 
 struct emi_media_drv {
 	emi_open_f open;
 	emi_close_f close;
+	emi_sync_f sync;
 };
 
 int emi_mtape_open(struct emi *e);
+void emi_mtape_close(struct emi *e);
+int emi_ptape_open(struct emi *e);
 void emi_ptape_close(struct emi *e);
+int emi_ptape_sync(struct emi *e);
 int emi_disk_open(struct emi *e);
+void emi_disk_close(struct emi *e);
+int emi_disk_sync(struct emi *e);
+int emi_mtape_copy(struct emi *src, struct emi *dst);
 
 struct emi_media_drv emi_media_drivers[] = {
-/* EMI_T_DISK */	{emi_disk_open, NULL},
-/* EMI_T_PTAPE */	{NULL, emi_ptape_close},
-/* EMI_T_MTAPE */	{emi_mtape_open, NULL},
+/* EMI_T_DISK */	{emi_disk_open, emi_disk_close, emi_disk_sync},
+/* EMI_T_PTAPE */	{emi_ptape_open, emi_ptape_close, emi_ptape_sync},
+/* EMI_T_MTAPE */	{emi_mtape_open, emi_mtape_close, NULL},
+};
+
+const struct emi_io *emi_io_drivers[] = {
+/* EMI_IO_STDIO */	&emi_io_stdio,
+/* EMI_IO_FD */		&emi_io_fd,
+/* EMI_IO_MMAP */	&emi_io_mmap,
+/* EMI_IO_MEM */	&emi_io_mem,
+/* EMI_IO_REMOTE */	&emi_io_remote,
 };
 
+uint32_t emi_crc32(uint32_t crc, const void *buf, size_t len);
+int emi_vol_attach(struct emi *e, const uint8_t *desc, unsigned len);
+void emi_vol_print(struct emi *e);
+void emi_tapeset_print(struct emi *e);
+int emi_stream_attach(struct emi *e, int fd, unsigned mode);
+int emi_bundle_attach(struct emi *e, char *bundle_name, char *name);
+void emi_writer_drain(struct emi *e);
+int emi_writer_flush(struct emi *e);
+
 static int __emi_header_write(struct emi *e);
+static int __emi_header_sync(struct emi *e);
+static void __emi_registry_del(struct emi *e);
+static void __emi_destroy(struct emi *e);
+void emi_journal_free(struct emi *e);
+int emi_hot_end(struct emi *e);
+
+// -----------------------------------------------------------------------
+void emi_lock(struct emi *e)
+{
+	// background writer has to finish queued writes first
+	if (e->writer) {
+		emi_writer_drain(e);
+	}
+	pthread_mutex_lock(&e->lock);
+}
+
+// -----------------------------------------------------------------------
+void emi_unlock(struct emi *e)
+{
+	pthread_mutex_unlock(&e->lock);
+}
+
+// -----------------------------------------------------------------------
+// Set up media driver for image data already in place (image lock held)
+int emi_media_open(struct emi *e)
+{
+	if ((e->type < EMI_T_MAX) && emi_media_drivers[e->type].open) {
+		return emi_media_drivers[e->type].open(e);
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Push media driver buffers to the storage backend (image lock held)
+int emi_media_sync(struct emi *e)
+{
+	if ((e->type < EMI_T_MAX) && emi_media_drivers[e->type].sync) {
+		return emi_media_drivers[e->type].sync(e);
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Get all data written so far into the image: wait for the background
+// writer, push media driver buffers and changed header to the storage
+// backend. Returns result of a failed write done in the background,
+// if there was one.
+int emi_flush(struct emi *e)
+{
+	int res = emi_writer_flush(e);
+
+	emi_lock(e);
+	int sres = emi_media_sync(e);
+	if (sres == EMI_E_OK) {
+		sres = __emi_header_sync(e);
+	}
+	emi_unlock(e);
+
+	return res != EMI_E_OK ? res : sres;
+}
+
+// -----------------------------------------------------------------------
+// Mark image data range as changed since the last checkpoint
+// (offset is relative to image data start, image lock held)
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len)
+{
+	if (!len) {
+		return;
+	}
+
+	uint32_t unit = EMI_DIRTY_UNIT(e);
+	uint64_t first = offset / unit;
+	uint64_t last = (offset + len - 1) / unit;
+
+	if (last >= e->dirty_size) {
+		uint64_t size = e->dirty_size * 2;
+		if (size <= last) {
+			size = last + 1;
+		}
+		size = (size + 63) & ~(uint64_t) 63;
+		uint64_t *dirty = realloc(e->dirty, size / 8);
+		if (!dirty) {
+			// can't track changes, next checkpoint has to be a full one
+			free(e->ckpt);
+			e->ckpt = NULL;
+			return;
+		}
+		memset(dirty + e->dirty_size / 64, 0, (size - e->dirty_size) / 8);
+		e->dirty = dirty;
+		e->dirty_size = size;
+	}
+
+	for (uint64_t i=first ; i<=last ; i++) {
+		e->dirty[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+
+	if (!e->dirty_hi || (first < e->dirty_lo)) {
+		e->dirty_lo = first;
+	}
+	if (last + 1 > e->dirty_hi) {
+		e->dirty_hi = last + 1;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Resolve 'name' stored in image 'base' relative to the directory of 'base'
+// (absolute names are used as they are)
+char * emi_path_rel(const char *base, const char *name)
+{
+	const char *slash = base ? strrchr(base, '/') : NULL;
+	size_t dlen = ((name[0] != '/') && slash) ? slash - base + 1 : 0;
+
+	char *path = malloc(dlen + strlen(name) + 1);
+	if (!path) {
+		return NULL;
+	}
+	if (dlen) {
+		memcpy(path, base, dlen);
+	}
+	strcpy(path + dlen, name);
+
+	return path;
+}
+
+// -----------------------------------------------------------------------
+static struct emi * __emi_alloc(void)
+{
+	struct emi *e = calloc(1, sizeof(struct emi));
+	if (!e) {
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&e->lock, NULL)) {
+		free(e);
+		return NULL;
+	}
+	e->refs = 1;
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+// Registry functions below need emi_registry_lock held
+static struct emi * __emi_registry_get(dev_t dev, ino_t ino)
+{
+	struct emi *e = emi_registry;
+
+	while (e) {
+		if ((e->dev == dev) && (e->ino == ino)) {
+			return e;
+		}
+		e = e->reg_next;
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static void __emi_registry_add(struct emi *e, char *img_name)
+{
+	struct stat st;
+
+	// in-memory images may have no file (yet)
+	if (!img_name || stat(img_name, &st)) {
+		return;
+	}
+
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->reg_next = emi_registry;
+	emi_registry = e;
+	e->registered = 1;
+}
+
+// -----------------------------------------------------------------------
+static void __emi_registry_del(struct emi *e)
+{
+	struct emi **p = &emi_registry;
+
+	while (*p) {
+		if (*p == e) {
+			*p = e->reg_next;
+			break;
+		}
+		p = &(*p)->reg_next;
+	}
+
+	e->registered = 0;
+}
+
+// -----------------------------------------------------------------------
+// Replace image file with 'new_name' and move the registry entry to the new file
+int emi_registry_rename(struct emi *e, char *new_name)
+{
+	int res = EMI_E_OK;
+
+	pthread_mutex_lock(&emi_registry_lock);
+	if (rename(new_name, e->img_name)) {
+		res = -EMI_E_WRITE;
+	} else if (e->registered) {
+		__emi_registry_del(e);
+		__emi_registry_add(e, e->img_name);
+	}
+	pthread_mutex_unlock(&emi_registry_lock);
+
+	return res;
+}
 
 // -----------------------------------------------------------------------
 void emi_close(struct emi *e)
 {
 	if (!e) return;
 
+	// last user closes the image
+	pthread_mutex_lock(&emi_registry_lock);
+	if (e->refs > 1) {
+		e->refs--;
+		pthread_mutex_unlock(&emi_registry_lock);
+		return;
+	}
+	if (e->registered) {
+		__emi_registry_del(e);
+	}
+	pthread_mutex_unlock(&emi_registry_lock);
+
+	__emi_destroy(e);
+}
+
+// -----------------------------------------------------------------------
+static void __emi_destroy(struct emi *e)
+{
+	emi_writer_stop(e);
+
 	if ((e->type >= 0) && (e->type < EMI_T_MAX) && emi_media_drivers[e->type].close) {
 		emi_media_drivers[e->type].close(e);
 	}
 
-	if (e->image) {
-		__emi_header_write(e);
-		fclose(e->image);
+	// hot set is stored when recording ends
+	emi_hot_end(e);
+
+	if (e->io) {
+		__emi_header_sync(e);
+		e->io->close(e);
 	}
 
 	if (e->img_name) free(e->img_name);
+	free(e->meta);
+	free(e->dirty);
+	free(e->ckpt);
+	emi_journal_free(e);
+	pthread_mutex_destroy(&e->lock);
 	free(e);
 }
 
@@ -125,34 +408,70 @@ const char * emi_get_media_type_name(unsigned i)
 // -----------------------------------------------------------------------
 void emi_header_print(struct emi *e)
 {
-	printf("Image name   : %s\n", e->img_name);
-	printf("Header len   : %u\n", EMI_HEADER_SIZE);
+	printf("Image name   : %s\n", e->img_name ? e->img_name : "(in memory)");
+	printf("Header len   : %u\n", e->hsize);
 	printf("Magic        : %c%c%c%c\n", e->magic[0], e->magic[1], e->magic[2], e->magic[3]);
 	printf("Image ver.   : %u.%u\n", e->v_major, e->v_minor);
+	if (e->meta) {
+		char label[256];
+		int len = emi_meta_get(e, EMI_META_LABEL, label, sizeof(label));
+		if (len >= 0) {
+			printf("Label        : %.*s\n", len < sizeof(label) ? len : (int) sizeof(label), label);
+		}
+		printf("Metadata     : %u bytes\n", e->meta_len);
+	}
 	printf("Library ver. : %u.%u.%u\n", e->lib_v_major, e->lib_v_minor, e->lib_v_patch);
 	printf("Media type   : %u (%s)\n", e->type, emi_get_media_type_name(e->type));
-	printf("Flags        : %s%s%s\n",
+	printf("Flags        : %s%s%s%s\n",
 		e->flags & EMI_WRPROTECT ? "wrprotect " : "",
 		e->flags & EMI_WORM ? "worm " : "",
-		e->flags & EMI_USED ? "used " : ""
+		e->flags & EMI_USED ? "used " : "",
+		e->flags & EMI_COMPRESSED ? "compressed " : ""
 	);
 	if (e->type == EMI_T_MTAPE) {
-		printf("Total length : %u bytes (approximate)\n", e->len);
+		printf("Total length : %"PRIu64" bytes (approximate)\n", e->len);
+		if (e->meta) {
+			emi_tapeset_print(e);
+		}
 	}
 	if (e->type == EMI_T_DISK) {
 		printf("CHS geometry : %u / %u / %u\n", e->cylinders, e->heads, e->spt);
 		printf("Block size   : %u bytes\n", e->block_size);
 	}
+	if (e->io == &emi_io_vol) {
+		emi_vol_print(e);
+	}
+}
+
+// -----------------------------------------------------------------------
+static uint64_t __emi_get64(uint8_t *pos)
+{
+	return ((uint64_t) ntohl(*(uint32_t*)pos) << 32) | ntohl(*(uint32_t*)(pos+4));
+}
+
+// -----------------------------------------------------------------------
+static void __emi_put64(uint8_t *pos, uint64_t v)
+{
+	*(uint32_t*)pos = htonl(v >> 32);
+	*(uint32_t*)(pos+4) = htonl(v & 0xffffffff);
+}
+
+// -----------------------------------------------------------------------
+static uint32_t __emi_header_crc(struct emi *e, const uint8_t *hbuf)
+{
+	// checksum field (last in fixed header) is not covered
+	uint32_t crc = emi_crc32(0, hbuf, EMI_HEADER_SIZE - 4);
+	return emi_crc32(crc, e->meta, e->meta_len);
 }
 
 // -----------------------------------------------------------------------
 static int __emi_header_read(struct emi *e)
 {
-	// read data
-	if (fseek(e->image, 0, SEEK_SET)) {
-		return -EMI_E_HEADER_READ;
-	}
-	if (fread(e->hbuf, 1, EMI_HEADER_SIZE, e->image) != EMI_HEADER_SIZE) {
+	int64_t hlen;
+
+	// read data (older images may be shorter than the current header)
+	hlen = e->io->read(e, e->hbuf, EMI_HEADER_SIZE, 0);
+	if (hlen < EMI_HEADER_SIZE_V20) {
 		return -EMI_E_HEADER_READ;
 	}
 
@@ -170,16 +489,55 @@ static int __emi_header_read(struct emi *e)
 	e->heads = *pos; pos += 1;
 	e->spt = *pos; pos += 1;
 	e->block_size = ntohs(*(uint16_t*)pos); pos += 2;
-	e->len = ntohl(*(uint32_t*)pos); pos += 4;
+
+	// v2.0 has 32-bit length, v2.1 extends it to 64 bits
+	if ((e->v_major == 2) && (e->v_minor == 0)) {
+		e->len = ntohl(*(uint32_t*)pos); pos += 4;
+		e->hsize = EMI_HEADER_SIZE_V20;
+		return EMI_E_OK;
+	}
+	if (hlen < EMI_HEADER_SIZE_V21) {
+		return -EMI_E_HEADER_READ;
+	}
+	e->len = __emi_get64(pos); pos += 8;
+	if (e->v_major == 2) {
+		e->hsize = EMI_HEADER_SIZE_V21;
+		return EMI_E_OK;
+	}
+
+	// v3 adds data offset and checksummed metadata area
+	if (hlen < EMI_HEADER_SIZE) {
+		return -EMI_E_HEADER_READ;
+	}
+	e->data_offset = ntohl(*(uint32_t*)pos); pos += 4;
+	e->meta_len = ntohl(*(uint32_t*)pos); pos += 4;
+	e->crc = ntohl(*(uint32_t*)pos); pos += 4;
+
+	if ((e->meta_len > EMI_META_MAX) || (e->data_offset < EMI_HEADER_SIZE + e->meta_len)) {
+		return -EMI_E_HEADER_READ;
+	}
+
+	e->meta = malloc(EMI_META_MAX);
+	if (!e->meta) {
+		return -EMI_E_ALLOC;
+	}
+	if (e->io->read(e, e->meta, e->meta_len, EMI_HEADER_SIZE) != e->meta_len) {
+		return -EMI_E_HEADER_READ;
+	}
+	if (__emi_header_crc(e, e->hbuf) != e->crc) {
+		return -EMI_E_HEADER_CRC;
+	}
+
+	e->hsize = e->data_offset;
 
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-static int __emi_header_write(struct emi *e)
+// Pack header into 'buf', return its length
+static unsigned __emi_header_pack(struct emi *e, uint8_t *buf)
 {
-	// pack data
-	uint8_t *pos = e->hbuf;
+	uint8_t *pos = buf;
 	memcpy(pos, e->magic, 4); pos += 4;
 	*pos = e->v_major; pos += 1;
 	*pos = e->v_minor; pos += 1;
@@ -192,21 +550,174 @@ static int __emi_header_write(struct emi *e)
 	*pos = e->heads; pos += 1;
 	*pos = e->spt; pos += 1;
 	*(uint16_t*)pos = htons(e->block_size); pos += 2;
-	*(uint32_t*)pos = htonl(e->len); pos += 4;
+	if ((e->v_major == 2) && (e->v_minor == 0)) {
+		*(uint32_t*)pos = htonl(e->len); pos += 4;
+		return EMI_HEADER_SIZE_V20;
+	} else if (e->v_major == 2) {
+		__emi_put64(pos, e->len); pos += 8;
+		return EMI_HEADER_SIZE_V21;
+	} else {
+		__emi_put64(pos, e->len); pos += 8;
+		*(uint32_t*)pos = htonl(e->data_offset); pos += 4;
+		*(uint32_t*)pos = htonl(e->meta_len); pos += 4;
+		*(uint32_t*)pos = htonl(__emi_header_crc(e, buf)); pos += 4;
+		return EMI_HEADER_SIZE;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Checksum of the whole header state, to tell if it changed
+static uint32_t __emi_header_sum(struct emi *e, const uint8_t *buf, unsigned hlen)
+{
+	uint32_t sum = emi_crc32(0, buf, hlen);
+	return emi_crc32(sum, e->meta, e->meta_len);
+}
+
+// -----------------------------------------------------------------------
+// Take current header state as the one stored in the image
+static void __emi_header_clean(struct emi *e)
+{
+	uint8_t buf[EMI_HEADER_SIZE];
+	unsigned hlen = __emi_header_pack(e, buf);
+
+	e->hsum = __emi_header_sum(e, buf, hlen);
+}
+
+// -----------------------------------------------------------------------
+static int __emi_header_write(struct emi *e)
+{
+	unsigned hlen = __emi_header_pack(e, e->hbuf);
+	if (hlen == EMI_HEADER_SIZE) {
+		e->crc = ntohl(*(uint32_t*)(e->hbuf + EMI_HEADER_SIZE - 4));
+	}
 
 	// write data
-	if (fseek(e->image, 0, SEEK_SET)) {
+	if (e->io->write(e, e->hbuf, hlen, 0) != hlen) {
 		return -EMI_E_HEADER_WRITE;
 	}
-	if (fwrite(e->hbuf, 1, EMI_HEADER_SIZE, e->image) != EMI_HEADER_SIZE) {
+	if (e->meta_len && (e->io->write(e, e->meta, e->meta_len, EMI_HEADER_SIZE) != e->meta_len)) {
 		return -EMI_E_HEADER_WRITE;
 	}
 
+	e->hsum = __emi_header_sum(e, e->hbuf, hlen);
+
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-int emi_flag_set(struct emi *e, uint32_t flag)
+// Write header back if it changed since it was last read or written.
+// Header goes back only to images that were opened in full (failed
+// open must not touch the file). Stream can't go back to the header,
+// bundle members are read-only.
+static int __emi_header_sync(struct emi *e)
+{
+	if (!e->hvalid || (e->io == &emi_io_stream) || (e->io == &emi_io_bundle)) {
+		return EMI_E_OK;
+	}
+
+	uint8_t buf[EMI_HEADER_SIZE];
+	unsigned hlen = __emi_header_pack(e, buf);
+
+	if (__emi_header_sum(e, buf, hlen) == e->hsum) {
+		return EMI_E_OK;
+	}
+
+	return __emi_header_write(e);
+}
+
+// -----------------------------------------------------------------------
+// Find metadata entry, return its offset in metadata area or -1
+static int __emi_meta_find(struct emi *e, uint16_t tag)
+{
+	uint32_t off = 0;
+
+	while (off + 4 <= e->meta_len) {
+		uint16_t t = ntohs(*(uint16_t*)(e->meta + off));
+		uint16_t l = ntohs(*(uint16_t*)(e->meta + off + 2));
+		if (t == tag) {
+			return off;
+		}
+		off += 4 + l;
+	}
+
+	return -1;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_meta_set(struct emi *e, uint16_t tag, const void *data, uint16_t len)
+{
+	if (!e->meta) {
+		return -EMI_E_FORMAT_V_MAJOR;
+	}
+
+	// drop old entry
+	int off = __emi_meta_find(e, tag);
+	if (off >= 0) {
+		uint32_t elen = 4 + ntohs(*(uint16_t*)(e->meta + off + 2));
+		memmove(e->meta + off, e->meta + off + elen, e->meta_len - off - elen);
+		e->meta_len -= elen;
+	}
+
+	if (!data) {
+		return EMI_E_OK;
+	}
+
+	if (e->meta_len + 4 + len > EMI_META_MAX) {
+		return -EMI_E_META_SIZE;
+	}
+
+	uint8_t *pos = e->meta + e->meta_len;
+	*(uint16_t*)pos = htons(tag); pos += 2;
+	*(uint16_t*)pos = htons(len); pos += 2;
+	memcpy(pos, data, len);
+	e->meta_len += 4 + len;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Set metadata entry (replacing existing one), NULL data removes the entry
+int emi_meta_set(struct emi *e, uint16_t tag, const void *data, uint16_t len)
+{
+	emi_lock(e);
+	int res = __emi_meta_set(e, tag, data, len);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_meta_get(struct emi *e, uint16_t tag, void *buf, uint16_t len)
+{
+	if (!e->meta) {
+		return -EMI_E_META;
+	}
+
+	int off = __emi_meta_find(e, tag);
+	if (off < 0) {
+		return -EMI_E_META;
+	}
+
+	uint16_t elen = ntohs(*(uint16_t*)(e->meta + off + 2));
+	memcpy(buf, e->meta + off + 4, elen < len ? elen : len);
+
+	return elen;
+}
+
+// -----------------------------------------------------------------------
+// Copy up to 'len' bytes of metadata entry value into 'buf'.
+// Returns full value length, which may be larger than 'len'.
+int emi_meta_get(struct emi *e, uint16_t tag, void *buf, uint16_t len)
+{
+	emi_lock(e);
+	int res = __emi_meta_get(e, tag, buf, len);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_flag_set(struct emi *e, uint32_t flag)
 {
 	if (flag & !EMI_FLAGS_SETTABLE) {
 		return -EMI_E_FLAGS;
@@ -216,7 +727,17 @@ int emi_flag_set(struct emi *e, uint32_t flag)
 }
 
 // -----------------------------------------------------------------------
-int emi_flag_clear(struct emi *e, uint32_t flag)
+int emi_flag_set(struct emi *e, uint32_t flag)
+{
+	emi_lock(e);
+	int res = __emi_flag_set(e, flag);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_flag_clear(struct emi *e, uint32_t flag)
 {
 	if (flag & !EMI_FLAGS_SETTABLE) {
 		return -EMI_E_FLAGS;
@@ -225,6 +746,16 @@ int emi_flag_clear(struct emi *e, uint32_t flag)
 	return EMI_E_OK;
 }
 
+// -----------------------------------------------------------------------
+int emi_flag_clear(struct emi *e, uint32_t flag)
+{
+	emi_lock(e);
+	int res = __emi_flag_clear(e, flag);
+	emi_unlock(e);
+
+	return res;
+}
+
 // -----------------------------------------------------------------------
 static int __emi_header_check(struct emi *e)
 {
@@ -232,12 +763,15 @@ static int __emi_header_check(struct emi *e)
 	if (strncmp(e->magic, EMI_MAGIC, 4) != 0) {
 		return -EMI_E_MAGIC;
 	}
-	// incompatibile major version
-	if (e->v_major != EMI_FORMAT_V_MAJOR) {
+	// incompatibile major version (v2 images are still handled)
+	if ((e->v_major != EMI_FORMAT_V_MAJOR) && (e->v_major != 2)) {
 		return -EMI_E_FORMAT_V_MAJOR;
 	}
 	// incompatibile minor version (old software, newer image version)
-	if (e->v_minor > EMI_FORMAT_V_MINOR) {
+	if ((e->v_major == 2) && (e->v_minor > 1)) {
+		return -EMI_E_FORMAT_V_MINOR;
+	}
+	if ((e->v_major == EMI_FORMAT_V_MAJOR) && (e->v_minor > EMI_FORMAT_V_MINOR)) {
 		return -EMI_E_FORMAT_V_MINOR;
 	}
 	// unknown flags set
@@ -249,21 +783,170 @@ static int __emi_header_check(struct emi *e)
 }
 
 // -----------------------------------------------------------------------
-struct emi * emi_open(char *img_name)
+static int __emi_preallocate(struct emi *e, int sparse)
+{
+	int res;
+	uint64_t size;
+
+	switch (e->type) {
+		case EMI_T_DISK:
+			size = (uint64_t) e->cylinders * e->heads * e->spt * e->block_size;
+			break;
+		case EMI_T_MTAPE:
+			size = e->len;
+			break;
+		default:
+			// punched tape has no set length
+			return EMI_E_OK;
+	}
+
+	if (!sparse && size) {
+		res = e->io->allocate(e, e->hsize, size);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+	}
+
+	// disk image gets its full size, tape still ends at EOT
+	if ((e->type == EMI_T_DISK) && (e->io->size(e) < e->hsize + size)) {
+		return e->io->truncate(e, e->hsize + size);
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Reserve image file space for all media data, so the file doesn't get
+// fragmented as it's written. With 'sparse' only disk image size is set.
+int emi_preallocate(struct emi *e, int sparse)
+{
+	emi_lock(e);
+	int res = __emi_preallocate(e, sparse);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static void __emi_io_default_init()
+{
+	char *name = getenv("EMIMG_IO");
+	if (!name) {
+		return;
+	}
+
+	for (unsigned i=0 ; i<EMI_IO_MAX ; i++) {
+		if (!strcmp(name, emi_io_drivers[i]->name)) {
+			emi_io_default = i;
+			break;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+static unsigned __emi_io_get_default()
+{
+	pthread_once(&emi_io_default_once, __emi_io_default_init);
+
+	return emi_io_default;
+}
+
+// -----------------------------------------------------------------------
+int emi_set_io(unsigned io)
+{
+	if ((io & EMI_IO_TYPE_MASK) >= EMI_IO_MAX) {
+		return -EMI_E_IO;
+	}
+
+	pthread_once(&emi_io_default_once, __emi_io_default_init);
+	emi_io_default = io;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_io_open(struct emi *e, char *img_name, unsigned io, int create)
 {
 	int res;
+
+	if ((io & EMI_IO_TYPE_MASK) >= EMI_IO_MAX) {
+		return -EMI_E_IO;
+	}
+
+	const struct emi_io *io_drv = emi_io_drivers[io & EMI_IO_TYPE_MASK];
+	e->io_flags = io;
+
+	res = io_drv->open(e, img_name, create);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	e->io = io_drv;
+
+	return EMI_E_OK;
+}
+
+static struct emi * __emi_open_io(char *img_name, unsigned io);
+
+// -----------------------------------------------------------------------
+struct emi * emi_open(char *img_name)
+{
+	return emi_open_io(img_name, __emi_io_get_default());
+}
+
+// -----------------------------------------------------------------------
+struct emi * emi_open_mem(char *img_name, unsigned flags)
+{
+	return emi_open_io(img_name, EMI_IO_MEM | (flags & ~EMI_IO_TYPE_MASK));
+}
+
+// -----------------------------------------------------------------------
+struct emi * emi_open_io(char *img_name, unsigned io)
+{
+	struct stat st;
+	struct emi *e;
+
 	emi_err = EMI_E_OK;
 
-	struct emi *e = calloc(1, sizeof(struct emi));
+	pthread_mutex_lock(&emi_registry_lock);
+
+	// image already open, share it
+	if (img_name && !stat(img_name, &st) && (e = __emi_registry_get(st.st_dev, st.st_ino))) {
+		e->refs++;
+		pthread_mutex_unlock(&emi_registry_lock);
+		return e;
+	}
+
+	e = __emi_open_io(img_name, io);
+	if (e) {
+		__emi_registry_add(e, img_name);
+	}
+
+	pthread_mutex_unlock(&emi_registry_lock);
+
+	// warm start: data read after the last recorded open is read ahead
+	if (e) {
+		emi_hot_prefetch(e);
+	}
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+static struct emi * __emi_open_io(char *img_name, unsigned io)
+{
+	int res;
+
+	struct emi *e = __emi_alloc();
 	if (!e) {
 		emi_err = -EMI_E_ALLOC;
 		return NULL;
 	}
 	// open image
-	e->image = fopen(img_name, "r+");
-	if (!e->image) {
-		emi_err = -EMI_E_OPEN;
-		emi_close(e);
+	res = __emi_io_open(e, img_name, io, 0);
+	if (res != EMI_E_OK) {
+		emi_err = res;
+		__emi_destroy(e);
 		return NULL;
 	}
 
@@ -271,7 +954,7 @@ struct emi * emi_open(char *img_name)
 	res = __emi_header_read(e);
 	if (res != EMI_E_OK) {
 		emi_err = res;
-		emi_close(e);
+		__emi_destroy(e);
 		return NULL;
 	}
 
@@ -279,40 +962,56 @@ struct emi * emi_open(char *img_name)
 	res = __emi_header_check(e);
 	if (res != EMI_E_OK) {
 		emi_err = res;
-		emi_close(e);
+		__emi_destroy(e);
 		return NULL;
 	}
+	__emi_header_clean(e);
 
 	e->img_name = strdup(img_name);
 
 	if ((e->type >= 0) && (e->type < EMI_T_MAX) && emi_media_drivers[e->type].open) {
-		emi_media_drivers[e->type].open(e);
+		res = emi_media_drivers[e->type].open(e);
+		if (res != EMI_E_OK) {
+			emi_err = res;
+			__emi_destroy(e);
+			return NULL;
+		}
 	}
 
+	// volume data lives in member images
+	int off = e->meta ? __emi_meta_find(e, EMI_META_VOLUME) : -1;
+	if (off >= 0) {
+		res = emi_vol_attach(e, e->meta + off + 4, ntohs(*(uint16_t*)(e->meta + off + 2)));
+		if (res != EMI_E_OK) {
+			emi_err = res;
+			__emi_destroy(e);
+			return NULL;
+		}
+	}
+
+	e->hvalid = 1;
+
 	return e;
 }
 
 // -----------------------------------------------------------------------
-struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint32_t len, uint32_t flags)
+// Open image outside of the open image registry (for images owned by
+// other images, like volume members)
+struct emi * emi_open_private(char *img_name, unsigned io)
 {
-	int res;
-
-	emi_err = EMI_E_OK;
-
-	// we don't destroy images
-	struct stat st;
-	if (stat(img_name, &st) == 0) {
-		emi_err = -EMI_E_EXISTS;
-		return NULL;
-	}
+	return __emi_open_io(img_name, io);
+}
 
-	struct emi *e = calloc(1, sizeof(struct emi));
-	if (!e) {
-		emi_err = -EMI_E_ALLOC;
-		return NULL;
-	}
+// -----------------------------------------------------------------------
+void emi_close_private(struct emi *e)
+{
+	__emi_destroy(e);
+}
 
-	// fill header data
+// -----------------------------------------------------------------------
+// Fill in header of a new image
+static int __emi_header_init(struct emi *e, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags)
+{
 	strncpy(e->magic, EMI_MAGIC, 4);
 	e->v_major = EMI_FORMAT_V_MAJOR;
 	e->v_minor = EMI_FORMAT_V_MINOR;
@@ -326,25 +1025,275 @@ struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint
 	e->spt = spt;
 	e->block_size = block_size;
 	e->len = len;
-	e->img_name = strdup(img_name);
+	e->data_offset = EMI_DATA_ALIGN;
+	e->hsize = e->data_offset;
+
+	e->meta = calloc(1, EMI_META_MAX);
+	if (!e->meta) {
+		return -EMI_E_ALLOC;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags)
+{
+	int res;
+
+	emi_err = EMI_E_OK;
+
+	// we don't destroy images (NULL name is an anonymous in-memory image)
+	struct stat st;
+	if (img_name && (stat(img_name, &st) == 0)) {
+		emi_err = -EMI_E_EXISTS;
+		return NULL;
+	}
+
+	struct emi *e = __emi_alloc();
+	if (!e) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	res = __emi_header_init(e, type, block_size, cylinders, heads, spt, len, flags);
+	if (res != EMI_E_OK) {
+		__emi_destroy(e);
+		emi_err = res;
+		return NULL;
+	}
+	e->img_name = img_name ? strdup(img_name) : NULL;
 
 	// create image file
-	e->image = fopen(img_name, "w+");
-	if (!e->image) {
-		free(e);
-		emi_err = -EMI_E_OPEN;
+	res = __emi_io_open(e, img_name, __emi_io_get_default(), 1);
+	if (res != EMI_E_OK) {
+		__emi_destroy(e);
+		emi_err = res;
 		return NULL;
 	}
 
-	// write header
+	// write header, image data starts past the header area
 	res = __emi_header_write(e);
+	if (res == EMI_E_OK) {
+		res = e->io->truncate(e, e->hsize);
+	}
 	if (res != EMI_E_OK) {
-		emi_close(e);
+		__emi_destroy(e);
 		emi_err = res;
 		return NULL;
 	}
 
+	e->hvalid = 1;
+
+	pthread_mutex_lock(&emi_registry_lock);
+	__emi_registry_add(e, img_name);
+	pthread_mutex_unlock(&emi_registry_lock);
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+// Open image on a non-seekable descriptor, for reading (EMI_RO) or writing
+// (EMI_WO) only. 'raw' stream has just the media data. Otherwise image
+// being read may or may not start with a header, image being written gets
+// one, with length of 0 (data is there until the end of stream).
+struct emi * emi_open_stream(int fd, unsigned mode, uint16_t type, int raw)
+{
+	int res;
+	char magic[4];
+
+	emi_err = EMI_E_OK;
+
+	struct emi *e = __emi_alloc();
+	if (!e) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	res = emi_stream_attach(e, fd, mode);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	if ((mode == EMI_RO) && !raw && (e->io->read(e, magic, 4, 0) == 4) && !strncmp(magic, EMI_MAGIC, 4)) {
+		res = __emi_header_read(e);
+		if (res == EMI_E_OK) {
+			res = __emi_header_check(e);
+		}
+		if (res != EMI_E_OK) {
+			goto fail;
+		}
+		return e;
+	}
+
+	res = __emi_header_init(e, type, 0, 0, 0, 0, 0, 0);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	if (raw || (mode == EMI_RO)) {
+		e->data_offset = 0;
+		e->hsize = 0;
+	} else {
+		res = __emi_header_write(e);
+		if (res == EMI_E_OK) {
+			res = e->io->truncate(e, e->hsize);
+		}
+		if (res != EMI_E_OK) {
+			goto fail;
+		}
+	}
+
+	return e;
+
+fail:
+	__emi_destroy(e);
+	emi_err = res;
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Open member 'name' of image bundle 'bundle_name'. Member is read-only
+// and not shared with other users (each call gives a new image).
+struct emi * emi_open_bundle(char *bundle_name, char *name)
+{
+	int res;
+
+	emi_err = EMI_E_OK;
+
+	struct emi *e = __emi_alloc();
+	if (!e) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	res = emi_bundle_attach(e, bundle_name, name);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	res = __emi_header_read(e);
+	if (res == EMI_E_OK) {
+		res = __emi_header_check(e);
+	}
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	e->flags |= EMI_WRPROTECT;
+
+	e->img_name = malloc(strlen(bundle_name) + strlen(name) + 2);
+	if (!e->img_name) {
+		res = -EMI_E_ALLOC;
+		goto fail;
+	}
+	sprintf(e->img_name, "%s:%s", bundle_name, name);
+
+	res = emi_media_open(e);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
 	return e;
+
+fail:
+	__emi_destroy(e);
+	emi_err = res;
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Copy image data area as-is
+static int __emi_copy_data(struct emi *src, struct emi *dst)
+{
+	int res = EMI_E_OK;
+	uint64_t offset = 0;
+
+	int64_t size = src->io->size(src);
+	if (size < 0) {
+		return size;
+	}
+
+	uint8_t *buf = malloc(EMI_COPY_BUF_SIZE);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+
+	while (src->hsize + offset < size) {
+		int64_t len = src->io->read(src, buf, EMI_COPY_BUF_SIZE, src->hsize + offset);
+		if (len <= 0) {
+			res = -EMI_E_READ;
+			break;
+		}
+		if (dst->io->write(dst, buf, len, dst->hsize + offset) != len) {
+			res = -EMI_E_WRITE;
+			break;
+		}
+		offset += len;
+	}
+
+	free(buf);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Convert image to current format version. Image is rewritten into
+// a temporary file, which then replaces the original one.
+int emi_upgrade(char *img_name)
+{
+	int res;
+
+	struct emi *src = emi_open(img_name);
+	if (!src) {
+		return emi_err;
+	}
+
+	// nothing to do
+	if (src->v_major == EMI_FORMAT_V_MAJOR) {
+		emi_close(src);
+		return EMI_E_OK;
+	}
+
+	// image can't change under other users
+	if (src->refs > 1) {
+		emi_close(src);
+		return -EMI_E_OPEN;
+	}
+
+	char *tmp_name = malloc(strlen(img_name) + sizeof(EMI_UPGRADE_SUFFIX));
+	if (!tmp_name) {
+		emi_close(src);
+		return -EMI_E_ALLOC;
+	}
+	sprintf(tmp_name, "%s%s", img_name, EMI_UPGRADE_SUFFIX);
+
+	struct emi *dst = emi_create(tmp_name, src->type, src->block_size, src->cylinders, src->heads, src->spt, src->len, src->flags);
+	if (!dst) {
+		res = emi_err;
+		emi_close(src);
+		free(tmp_name);
+		return res;
+	}
+
+	if (src->type == EMI_T_MTAPE) {
+		res = emi_mtape_copy(src, dst);
+	} else {
+		res = __emi_copy_data(src, dst);
+	}
+
+	emi_close(dst);
+	emi_close(src);
+
+	if ((res == EMI_E_OK) && rename(tmp_name, img_name)) {
+		res = -EMI_E_WRITE;
+	}
+	if (res != EMI_E_OK) {
+		unlink(tmp_name);
+	}
+	free(tmp_name);
+
+	return res;
 }
 
 // vim: tabstop=4 shiftwidth=4 autoindent
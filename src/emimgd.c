@@ -0,0 +1,653 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// emimgd - serves image files to local processes using EMI_IO_REMOTE.
+//
+// Each image file is opened once, with the daemon's storage backend,
+// no matter how many clients use it, so all of them share one cache
+// (page cache with mmap, image memory with mem). Operations on a file
+// are serialized. See remote.h for the protocol.
+//
+// Daemon opens files with its own privileges, so it listens in a directory
+// private to its user, talks only to processes of the same user and serves
+// only files within its root directory (after resolving symlinks).
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emimg.h"
+#include "io.h"
+#include "remote.h"
+
+// image file shared by all clients
+struct file {
+	char *path;
+	dev_t dev;				// file identity, as path may point to another file by now
+	ino_t ino;				// (0 if file is not there yet, mem backend writes it on sync)
+	struct emi ctx;			// storage backend context
+	const struct emi_io *io;
+	pthread_mutex_t lock;	// serializes operations on the file
+	struct client *writer;	// client holding the write lease, if any
+	uint64_t gen;			// bumped each time a writer lets go of the file
+	unsigned refs;
+	struct file *next;
+};
+
+struct client {
+	int sock;
+	uint8_t *shm;
+	struct file *f;
+	uint64_t gen;			// file generation seen at open
+};
+
+static const struct {
+	char *name;
+	unsigned io;
+} backends[] = {
+	{ "stdio", EMI_IO_STDIO },
+	{ "fd", EMI_IO_FD },
+	{ "mmap", EMI_IO_MMAP },
+	{ "mem", EMI_IO_MEM | EMI_IO_PERSIST },
+	{ NULL, 0 }
+};
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file *files;
+
+static char *sock_name;
+static char sock_buf[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static char *root;
+static size_t root_len;
+static unsigned io = EMI_IO_MMAP;
+static volatile sig_atomic_t quit;
+
+int emi_remote_send(int fd, const void *buf, size_t len);
+int emi_remote_recv(int fd, void *buf, size_t len);
+int emi_remote_socket(char *buf, size_t len);
+
+// -----------------------------------------------------------------------
+void error(char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	printf("Error: ");
+	vprintf(format, ap);
+	printf("\nUse --help for help\n");
+	va_end(ap);
+	exit(1);
+}
+
+// -----------------------------------------------------------------------
+void print_help()
+{
+	printf("emimgd %i.%i.%i - media image server\n", EMIMG_VERSION_MAJOR, EMIMG_VERSION_MINOR, EMIMG_VERSION_PATCH);
+	printf("\nOptions:\n");
+	printf("  --help                  : print help\n");
+	printf("  --socket, -s <path>     : listen on given socket (default: $%s, $XDG_RUNTIME_DIR/%s or " EMI_REMOTE_SOCKET_DIR "/%s)\n", EMI_REMOTE_SOCKET_ENV, EMI_REMOTE_SOCKET, (unsigned) getuid(), EMI_REMOTE_SOCKET);
+	printf("  --root, -r <dir>        : serve only files within given directory (default: current directory)\n");
+	printf("  --backend, -b <name>    : storage backend: stdio, fd, mmap (default), mem\n");
+	printf("\nClients open images with EMI_IO_REMOTE storage backend.\n");
+	printf("Only processes of the user running the daemon are served.\n");
+	printf("\n");
+}
+
+// -----------------------------------------------------------------------
+void parse_opts(int argc, char **argv)
+{
+	int opt, idx;
+
+	static struct option opts[] = {
+		{ "socket",		1,	0, 's' },
+		{ "backend",	1,	0, 'b' },
+		{ "root",		1,	0, 'r' },
+		{ "help",		0,	0, 'H' },
+		{ NULL,			0,	0, 0 }
+	};
+
+	char *root_dir = ".";
+
+	while (1) {
+		opt = getopt_long(argc, argv,"s:b:r:", opts, &idx);
+		if (opt == -1) {
+			break;
+		}
+		switch (opt) {
+			case 'H':
+				print_help();
+				exit(0);
+				break;
+			case 's':
+				sock_name = optarg;
+				break;
+			case 'r':
+				root_dir = optarg;
+				break;
+			case 'b':
+				for (idx=0 ; backends[idx].name ; idx++) {
+					if (!strcasecmp(optarg, backends[idx].name)) break;
+				}
+				if (!backends[idx].name) {
+					error("Storage backend '%s' is unknown", optarg);
+				}
+				io = backends[idx].io;
+				break;
+			default:
+				error("Wrong usage.");
+				break;
+		}
+	}
+
+	if (!sock_name) {
+		if (emi_remote_socket(sock_buf, sizeof(sock_buf)) != EMI_E_OK) {
+			error("Socket name is too long");
+		}
+		sock_name = sock_buf;
+	}
+
+	root = realpath(root_dir, NULL);
+	if (!root) {
+		error("Cannot use \"%s\" as root directory: %s", root_dir, strerror(errno));
+	}
+	root_len = strlen(root);
+}
+
+// -----------------------------------------------------------------------
+// Resolve image path sent by client, only files within the root
+// directory are served
+char * path_resolve(char *path, int create, int *res)
+{
+	char *real = realpath(path, NULL);
+
+	// new file: its directory has to exist
+	if (!real && create && (errno == ENOENT)) {
+		char *name = strrchr(path, '/');
+		if (!name || !name[1] || !strcmp(name + 1, ".") || !strcmp(name + 1, "..")) {
+			*res = -EMI_E_OPEN;
+			return NULL;
+		}
+		char *dir = name == path ? strdup("/") : strndup(path, name - path);
+		char *real_dir = dir ? realpath(dir, NULL) : NULL;
+		if (real_dir && (asprintf(&real, "%s/%s", real_dir, name + 1) < 0)) {
+			real = NULL;
+		}
+		free(real_dir);
+		free(dir);
+	}
+
+	if (!real) {
+		*res = -EMI_E_OPEN;
+		return NULL;
+	}
+
+	if (strncmp(real, root, root_len) || ((root_len > 1) && (real[root_len] != '/'))) {
+		free(real);
+		*res = -EMI_E_ACCESS;
+		return NULL;
+	}
+
+	return real;
+}
+
+// -----------------------------------------------------------------------
+// Get file (opened by another client or opened now)
+struct file * file_get(char *client_path, int create, int *res)
+{
+	struct file *f;
+	struct stat st;
+
+	char *path = path_resolve(client_path, create, res);
+	if (!path) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&files_lock);
+
+	int found = !stat(path, &st);
+
+	for (f=files ; f ; f=f->next) {
+		if ((f->ino && found && (f->dev == st.st_dev) && (f->ino == st.st_ino)) || (!f->ino && !strcmp(f->path, path))) {
+			if (create) {
+				f = NULL;
+				*res = -EMI_E_EXISTS;
+				goto fin;
+			}
+			f->refs++;
+			goto fin;
+		}
+	}
+
+	// new file, but never one that's already there
+	if (create) {
+		int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			*res = errno == EEXIST ? -EMI_E_EXISTS : -EMI_E_OPEN;
+			goto fin;
+		}
+		close(fd);
+	}
+
+	f = calloc(1, sizeof(struct file));
+	if (!f) {
+		*res = -EMI_E_ALLOC;
+		if (create) unlink(path);
+		goto fin;
+	}
+	f->path = path;
+	path = NULL;
+
+	f->io = io == EMI_IO_STDIO ? &emi_io_stdio : io == EMI_IO_FD ? &emi_io_fd : io == EMI_IO_MMAP ? &emi_io_mmap : &emi_io_mem;
+	f->ctx.io_flags = io;
+	*res = f->io->open(&f->ctx, f->path, create);
+	if (*res != EMI_E_OK) {
+		if (create) unlink(f->path);
+		free(f->path);
+		free(f);
+		f = NULL;
+		goto fin;
+	}
+	if (!stat(f->path, &st)) {
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	f->refs = 1;
+	f->next = files;
+	files = f;
+
+fin:
+	pthread_mutex_unlock(&files_lock);
+	free(path);
+	return f;
+}
+
+// -----------------------------------------------------------------------
+// Drop file, last user closes it
+void file_put(struct file *f)
+{
+	pthread_mutex_lock(&files_lock);
+
+	if (--f->refs) {
+		pthread_mutex_unlock(&files_lock);
+		return;
+	}
+
+	struct file **p = &files;
+	while (*p != f) {
+		p = &(*p)->next;
+	}
+	*p = f->next;
+
+	// close before anyone can open the file again: closing may still
+	// change the file (mmap backend trims the growth slack)
+	f->io->close(&f->ctx);
+
+	pthread_mutex_unlock(&files_lock);
+
+	pthread_mutex_destroy(&f->lock);
+	free(f->path);
+	free(f);
+}
+
+// -----------------------------------------------------------------------
+int req_modifies(struct emi_remote_req *req)
+{
+	switch (req->op) {
+		case EMI_REMOTE_WRITE:
+		case EMI_REMOTE_TRUNCATE:
+		case EMI_REMOTE_DISCARD:
+		case EMI_REMOTE_ALLOCATE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Grant the write lease (file lock held). Every client keeps its own copy
+// of the image header, so only one of them may change the file at a time,
+// and only one that opened the file after the last writer was done with it.
+int lease(struct client *c)
+{
+	struct file *f = c->f;
+
+	if (f->writer == c) {
+		return 1;
+	}
+	if (f->writer || (f->gen != c->gen)) {
+		return 0;
+	}
+	f->writer = c;
+
+	return 1;
+}
+
+// -----------------------------------------------------------------------
+// Drop the write lease, if held, so that a client opening the file
+// from now on may write it
+void unlease(struct client *c)
+{
+	struct file *f = c->f;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->writer == c) {
+		f->writer = NULL;
+		f->gen++;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+// -----------------------------------------------------------------------
+int64_t handle(struct client *c, struct emi_remote_req *req)
+{
+	int64_t res;
+	struct file *f = c->f;
+
+	if (req->op == EMI_REMOTE_OPEN) {
+		if (f || (req->len >= EMI_REMOTE_SHM_SIZE)) {
+			return -EMI_E_OPEN;
+		}
+		char *path = strndup((char *) c->shm, req->len);
+		if (!path) {
+			return -EMI_E_ALLOC;
+		}
+		int open_res;
+		c->f = file_get(path, req->flags, &open_res);
+		free(path);
+		if (!c->f) {
+			return open_res;
+		}
+		pthread_mutex_lock(&c->f->lock);
+		c->gen = c->f->gen;
+		pthread_mutex_unlock(&c->f->lock);
+		return EMI_E_OK;
+	}
+
+	if (!f) {
+		return -EMI_E_IO;
+	}
+	if (((req->op == EMI_REMOTE_READ) || (req->op == EMI_REMOTE_WRITE)) && (req->len > EMI_REMOTE_SHM_SIZE)) {
+		return -EMI_E_IO;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	if (req_modifies(req) && !lease(c)) {
+		pthread_mutex_unlock(&f->lock);
+		return -EMI_E_WRPROTECT;
+	}
+	switch (req->op) {
+		case EMI_REMOTE_READ: {
+			// backends with direct access skip the bounce
+			void *p = f->io->map(&f->ctx, req->offset, req->len);
+			if (p) {
+				memcpy(c->shm, p, req->len);
+				res = req->len;
+			} else {
+				res = f->io->read(&f->ctx, c->shm, req->len, req->offset);
+			}
+			break;
+		}
+		case EMI_REMOTE_WRITE:
+			res = f->io->write(&f->ctx, c->shm, req->len, req->offset);
+			break;
+		case EMI_REMOTE_SYNC:
+			res = f->io->sync(&f->ctx);
+			break;
+		case EMI_REMOTE_SIZE:
+			res = f->io->size(&f->ctx);
+			break;
+		case EMI_REMOTE_TRUNCATE:
+			res = f->io->truncate(&f->ctx, req->offset);
+			break;
+		case EMI_REMOTE_DISCARD:
+			res = f->io->discard(&f->ctx, req->offset, req->len);
+			break;
+		case EMI_REMOTE_ALLOCATE:
+			res = f->io->allocate(&f->ctx, req->offset, req->len);
+			break;
+		default:
+			res = -EMI_E_IO;
+			break;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Send hello along with the shared buffer
+int hello(struct client *c)
+{
+	struct emi_remote_resp resp = { EMI_REMOTE_MAGIC, EMI_REMOTE_SHM_SIZE, EMI_E_OK };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &resp, sizeof(resp) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	int shm_fd = memfd_create("emimgd", MFD_CLOEXEC);
+	if (shm_fd < 0) {
+		return -1;
+	}
+	if (ftruncate(shm_fd, EMI_REMOTE_SHM_SIZE)) {
+		close(shm_fd);
+		return -1;
+	}
+	c->shm = mmap(NULL, EMI_REMOTE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (c->shm == MAP_FAILED) {
+		c->shm = NULL;
+		close(shm_fd);
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+
+	ssize_t res = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+	close(shm_fd);
+
+	return res == sizeof(resp) ? 0 : -1;
+}
+
+// -----------------------------------------------------------------------
+void * client_thread(void *ptr)
+{
+	struct client *c = ptr;
+	struct emi_remote_req req;
+	struct emi_remote_resp resp = { EMI_REMOTE_MAGIC, 0, 0 };
+
+	if (hello(c)) {
+		goto fin;
+	}
+
+	while (emi_remote_recv(c->sock, &req, sizeof(req)) == EMI_E_OK) {
+		resp.res = handle(c, &req);
+		if (emi_remote_send(c->sock, &resp, sizeof(resp)) != EMI_E_OK) {
+			break;
+		}
+	}
+
+fin:
+	if (c->f) {
+		unlease(c);
+		file_put(c->f);
+	}
+	if (c->shm) munmap(c->shm, EMI_REMOTE_SHM_SIZE);
+	close(c->sock);
+	free(c);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Only processes of the daemon's user are served
+int peer_allowed(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		return 0;
+	}
+
+	return cred.uid == getuid();
+}
+
+// -----------------------------------------------------------------------
+// Make sure socket directory is there and private to the user
+void socket_dir(char *sock_name)
+{
+	struct stat st;
+	char *dir = strdup(sock_name);
+	if (!dir) {
+		error("Out of memory");
+	}
+
+	char *slash = strrchr(dir, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		slash[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+
+	if (mkdir(dir, 0700) && (errno != EEXIST)) {
+		error("Cannot create socket directory \"%s\": %s", dir, strerror(errno));
+	}
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		error("Socket directory \"%s\" is not a directory", dir);
+	}
+	if ((st.st_uid != getuid()) || (st.st_mode & 077)) {
+		error("Socket directory \"%s\" has to be accessible only to its owner (mode 0700)", dir);
+	}
+
+	free(dir);
+}
+
+// -----------------------------------------------------------------------
+void sig_quit(int sig)
+{
+	quit = 1;
+}
+
+// -----------------------------------------------------------------------
+// ---- MAIN -------------------------------------------------------------
+// -----------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = sig_quit };
+
+	parse_opts(argc, argv);
+
+	if (strlen(sock_name) >= sizeof(addr.sun_path)) {
+		error("Socket name is too long");
+	}
+	strcpy(addr.sun_path, sock_name);
+
+	// let accept() be interrupted
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		error("Cannot create socket: %s", strerror(errno));
+	}
+
+	socket_dir(sock_name);
+
+	// remove only what's left after a previous daemon
+	struct stat st;
+	if (!lstat(sock_name, &st)) {
+		if (!S_ISSOCK(st.st_mode) || (st.st_uid != getuid())) {
+			error("\"%s\" exists and is not a socket of a previous daemon", sock_name);
+		}
+		unlink(sock_name);
+	}
+
+	mode_t mask = umask(077);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, 64)) {
+		error("Cannot listen on \"%s\": %s", sock_name, strerror(errno));
+	}
+	umask(mask);
+
+	printf("Serving images within %s on %s\n", root, sock_name);
+	fflush(stdout);
+
+	while (!quit) {
+		int csock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (csock < 0) {
+			continue;
+		}
+		if (!peer_allowed(csock)) {
+			close(csock);
+			continue;
+		}
+		struct client *c = calloc(1, sizeof(struct client));
+		pthread_t thread;
+		if (!c) {
+			close(csock);
+			continue;
+		}
+		c->sock = csock;
+		if (pthread_create(&thread, NULL, client_thread, c)) {
+			close(csock);
+			free(c);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(sock);
+	unlink(sock_name);
+
+	// write back files still in use
+	pthread_mutex_lock(&files_lock);
+	for (struct file *f=files ; f ; f=f->next) {
+		pthread_mutex_lock(&f->lock);
+		f->io->sync(&f->ctx);
+		f->io->close(&f->ctx);
+	}
+
+	return 0;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,391 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Hot set: image data read shortly after the image is opened (disk
+// sectors and tape blocks an emulated machine needs to boot).
+//
+// While recording, data units read are marked in a bitmap. When the
+// recording time is up (or the image is closed), marked units are stored
+// as a list of data ranges in <image>.hot. Ranges close to each other
+// are merged, reading a bit more costs less than a separate request.
+//
+// Opening an image with a hot set asks the kernel to read it ahead
+// (posix_fadvise() for image files, madvise() for mapped data), so it is
+// already in page cache when the emulator asks for it. Nothing waits for
+// the prefetch to finish.
+//
+// Hot set file:
+//  * magic "E4IH", version (1 byte), reserved (3 bytes),
+//  * number of ranges (4 bytes), crc32 of the ranges (4 bytes),
+//  * ranges: image data offset (8 bytes), length (8 bytes)
+// All numbers big-endian. Hot set is only a hint: if it is missing,
+// broken or outdated, image works as usual.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_HOT_MAGIC "E4IH"
+#define EMI_HOT_VERSION 1
+#define EMI_HOT_SUFFIX ".hot"
+#define EMI_HOT_TMP_SUFFIX ".hot.tmp"
+#define EMI_HOT_HDR_SIZE 16
+#define EMI_HOT_RANGE_SIZE 16
+// ranges closer than that are read as one
+#define EMI_HOT_GAP (64 * 1024)
+
+struct emi_hot {
+	struct timespec end;	// recording ends (CLOCK_MONOTONIC)
+	uint32_t unit;			// bitmap unit (data bytes)
+	uint64_t *map;			// bitmap of data units read
+	uint64_t size;			// bitmap size (units)
+	uint64_t lo;			// marked units range
+	uint64_t hi;
+};
+
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+uint32_t emi_crc32(uint32_t crc, const void *buf, size_t len);
+
+// -----------------------------------------------------------------------
+static uint64_t emi_hot_get64(const uint8_t *pos)
+{
+	return ((uint64_t) ntohl(*(uint32_t*)pos) << 32) | ntohl(*(uint32_t*)(pos+4));
+}
+
+// -----------------------------------------------------------------------
+static void emi_hot_put64(uint8_t *pos, uint64_t v)
+{
+	*(uint32_t*)pos = htonl(v >> 32);
+	*(uint32_t*)(pos+4) = htonl(v & 0xffffffff);
+}
+
+// -----------------------------------------------------------------------
+static char * emi_hot_path(struct emi *e, const char *suffix)
+{
+	char *path = malloc(strlen(e->img_name) + strlen(suffix) + 1);
+	if (path) {
+		sprintf(path, "%s%s", e->img_name, suffix);
+	}
+
+	return path;
+}
+
+// -----------------------------------------------------------------------
+static int emi_hot_test(struct emi_hot *h, uint64_t i)
+{
+	return (h->map[i / 64] >> (i % 64)) & 1;
+}
+
+// -----------------------------------------------------------------------
+// Turn marked units into merged ranges, returns number of ranges
+// ('buf' == NULL: just count them)
+static uint32_t emi_hot_ranges(struct emi_hot *h, uint8_t *buf)
+{
+	uint32_t count = 0;
+	uint64_t gap = EMI_HOT_GAP / h->unit;
+	uint64_t i = h->lo;
+
+	while (i < h->hi) {
+		if (!emi_hot_test(h, i)) {
+			i++;
+			continue;
+		}
+		uint64_t first = i;
+		uint64_t last = i;
+		while (++i < h->hi) {
+			if (emi_hot_test(h, i)) {
+				last = i;
+			} else if (i - last > gap) {
+				break;
+			}
+		}
+		if (buf) {
+			emi_hot_put64(buf + count * EMI_HOT_RANGE_SIZE, first * h->unit);
+			emi_hot_put64(buf + count * EMI_HOT_RANGE_SIZE + 8, (last - first + 1) * h->unit);
+		}
+		count++;
+	}
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_hot_save(struct emi *e, struct emi_hot *h)
+{
+	int res = EMI_E_OK;
+
+	uint32_t count = emi_hot_ranges(h, NULL);
+	size_t len = EMI_HOT_HDR_SIZE + (size_t) count * EMI_HOT_RANGE_SIZE;
+	uint8_t *buf = calloc(1, len);
+	char *path = emi_hot_path(e, EMI_HOT_SUFFIX);
+	char *tmp_path = emi_hot_path(e, EMI_HOT_TMP_SUFFIX);
+
+	if (!buf || !path || !tmp_path) {
+		res = -EMI_E_ALLOC;
+		goto cleanup;
+	}
+
+	emi_hot_ranges(h, buf + EMI_HOT_HDR_SIZE);
+	memcpy(buf, EMI_HOT_MAGIC, 4);
+	buf[4] = EMI_HOT_VERSION;
+	*(uint32_t*)(buf + 8) = htonl(count);
+	*(uint32_t*)(buf + 12) = htonl(emi_crc32(0, buf + EMI_HOT_HDR_SIZE, len - EMI_HOT_HDR_SIZE));
+
+	// no fsync(): hot set lost in a crash costs only a cold start
+	FILE *f = fopen(tmp_path, "w");
+	if (!f) {
+		res = -EMI_E_OPEN;
+		goto cleanup;
+	}
+	if (fwrite(buf, 1, len, f) != len) {
+		res = -EMI_E_WRITE;
+	}
+	if (fclose(f) && (res == EMI_E_OK)) {
+		res = -EMI_E_WRITE;
+	}
+	if ((res == EMI_E_OK) && rename(tmp_path, path)) {
+		res = -EMI_E_WRITE;
+	}
+	if (res != EMI_E_OK) {
+		unlink(tmp_path);
+	}
+
+cleanup:
+	free(tmp_path);
+	free(path);
+	free(buf);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Stop recording, store the hot set (image lock held)
+int emi_hot_end(struct emi *e)
+{
+	struct emi_hot *h = e->hot;
+
+	if (!h) {
+		return EMI_E_OK;
+	}
+
+	e->hot = NULL;
+	int res = emi_hot_save(e, h);
+	free(h->map);
+	free(h);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Mark image data range as read (offset is relative to image data start,
+// image lock held)
+void emi_hot_mark(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_hot *h = e->hot;
+	struct timespec now;
+
+	if (!h || !len) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec > h->end.tv_sec) || ((now.tv_sec == h->end.tv_sec) && (now.tv_nsec >= h->end.tv_nsec))) {
+		emi_hot_end(e);
+		return;
+	}
+
+	uint64_t first = offset / h->unit;
+	uint64_t last = (offset + len - 1) / h->unit;
+
+	if (last >= h->size) {
+		uint64_t size = h->size * 2;
+		if (size <= last) {
+			size = last + 1;
+		}
+		size = (size + 63) & ~(uint64_t) 63;
+		uint64_t *map = realloc(h->map, size / 8);
+		if (!map) {
+			// keep what's been recorded so far
+			emi_hot_end(e);
+			return;
+		}
+		memset(map + h->size / 64, 0, (size - h->size) / 8);
+		h->map = map;
+		h->size = size;
+	}
+
+	for (uint64_t i=first ; i<=last ; i++) {
+		h->map[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+
+	if (!h->hi || (first < h->lo)) {
+		h->lo = first;
+	}
+	if (last + 1 > h->hi) {
+		h->hi = last + 1;
+	}
+}
+
+// -----------------------------------------------------------------------
+static int __emi_hot_record(struct emi *e, unsigned seconds)
+{
+	int res = emi_hot_end(e);
+
+	if (!seconds) {
+		return res;
+	}
+
+	if ((e->type != EMI_T_DISK) && (e->type != EMI_T_MTAPE)) {
+		return -EMI_E_ACCESS;
+	}
+	// hot set lives next to the image file
+	if (!e->img_name || (e->io == &emi_io_stream) || (e->io == &emi_io_bundle)) {
+		return -EMI_E_ACCESS;
+	}
+
+	struct emi_hot *h = calloc(1, sizeof(struct emi_hot));
+	if (!h) {
+		return -EMI_E_ALLOC;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &h->end);
+	h->end.tv_sec += seconds;
+	h->unit = EMI_DIRTY_UNIT(e);
+	e->hot = h;
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Record data read during the next 'seconds' as the image hot set,
+// prefetched by later opens ('seconds' of 0 stops recording and stores
+// the hot set right away)
+int emi_hot_record(struct emi *e, unsigned seconds)
+{
+	emi_lock(e);
+	int res = __emi_hot_record(e, seconds);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static void emi_hot_fetch(struct emi *e, int fd, uint64_t offset, uint64_t len)
+{
+	if (fd >= 0) {
+		posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	uint8_t *data = e->io->map ? e->io->map(e, offset, len) : NULL;
+	if (data) {
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t) data & ~(page - 1);
+		madvise((void *) start, (uintptr_t) data + len - start, MADV_WILLNEED);
+	}
+}
+
+// -----------------------------------------------------------------------
+static int __emi_hot_prefetch(struct emi *e)
+{
+	int res = EMI_E_OK;
+	uint8_t hdr[EMI_HOT_HDR_SIZE];
+	uint8_t *buf = NULL;
+
+	if (!e->img_name || !e->io || (e->io == &emi_io_stream)) {
+		return EMI_E_OK;
+	}
+
+	char *path = emi_hot_path(e, EMI_HOT_SUFFIX);
+	if (!path) {
+		return -EMI_E_ALLOC;
+	}
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (!f) {
+		// no hot set recorded
+		return EMI_E_OK;
+	}
+
+	if ((fread(hdr, 1, EMI_HOT_HDR_SIZE, f) != EMI_HOT_HDR_SIZE) || memcmp(hdr, EMI_HOT_MAGIC, 4) || (hdr[4] != EMI_HOT_VERSION)) {
+		res = -EMI_E_MAGIC;
+		goto cleanup;
+	}
+
+	uint32_t count = ntohl(*(uint32_t*)(hdr + 8));
+	size_t len = (size_t) count * EMI_HOT_RANGE_SIZE;
+	buf = malloc(len ? len : 1);
+	if (!buf) {
+		res = -EMI_E_ALLOC;
+		goto cleanup;
+	}
+	if ((fread(buf, 1, len, f) != len) || (emi_crc32(0, buf, len) != ntohl(*(uint32_t*)(hdr + 12)))) {
+		res = -EMI_E_READ;
+		goto cleanup;
+	}
+
+	int64_t size = e->io->size(e);
+	if (size < 0) {
+		res = size;
+		goto cleanup;
+	}
+	uint64_t data_len = size > e->hsize ? size - e->hsize : 0;
+	int fd = e->io->fd(e);
+
+	for (uint32_t i=0 ; i<count ; i++) {
+		uint64_t offset = emi_hot_get64(buf + i * EMI_HOT_RANGE_SIZE);
+		uint64_t rlen = emi_hot_get64(buf + i * EMI_HOT_RANGE_SIZE + 8);
+		// image may have shrunk since the hot set was recorded
+		if (offset >= data_len) {
+			continue;
+		}
+		if (rlen > data_len - offset) {
+			rlen = data_len - offset;
+		}
+		emi_hot_fetch(e, fd, e->hsize + offset, rlen);
+	}
+
+cleanup:
+	free(buf);
+	fclose(f);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Ask for the image hot set to be read ahead (doesn't wait for the data)
+int emi_hot_prefetch(struct emi *e)
+{
+	emi_lock(e);
+	int res = __emi_hot_prefetch(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,356 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "emimg.h"
+#include "io.h"
+
+// O_DIRECT transfers are aligned to this (covers 512B and 4KB devices)
+#define EMI_IO_FD_ALIGN 4096
+#define EMI_IO_FD_ALIGN_MASK ((uint64_t) EMI_IO_FD_ALIGN - 1)
+// size of the bounce buffer used for unaligned O_DIRECT transfers
+#define EMI_IO_FD_BOUNCE_SIZE (1024 * 1024)
+
+struct emi_io_fd {
+	int fd;
+	int direct;
+	uint64_t size;		// image size (file may be longer with O_DIRECT)
+	uint8_t *bounce;	// aligned bounce buffer for O_DIRECT
+};
+
+// -----------------------------------------------------------------------
+static ssize_t emi_io_fd_pread_all(int fd, void *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t res = pread(fd, (uint8_t*) buf + done, count - done, offset + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		// end of image
+		if (res == 0) {
+			break;
+		}
+		done += res;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static ssize_t emi_io_fd_pwrite_all(int fd, const void *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t res = pwrite(fd, (const uint8_t*) buf + done, count - done, offset + done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += res;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_open(struct emi *e, char *img_name, int create)
+{
+	struct stat st;
+	int flags = create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+
+	struct emi_io_fd *f = calloc(1, sizeof(struct emi_io_fd));
+	if (!f) {
+		return -EMI_E_ALLOC;
+	}
+
+	if (e->io_flags & EMI_IO_DIRECT) {
+		f->fd = open(img_name, flags | O_DIRECT, 0666);
+		// filesystem may not support O_DIRECT, use regular I/O then
+		if (f->fd >= 0) {
+			f->direct = 1;
+		} else if (errno == EINVAL) {
+			f->fd = open(img_name, flags, 0666);
+		}
+	} else {
+		f->fd = open(img_name, flags, 0666);
+	}
+	if (f->fd < 0) {
+		free(f);
+		return -EMI_E_OPEN;
+	}
+
+	if (fstat(f->fd, &st)) {
+		close(f->fd);
+		free(f);
+		return -EMI_E_OPEN;
+	}
+	f->size = st.st_size;
+
+	if (f->direct && posix_memalign((void **) &f->bounce, EMI_IO_FD_ALIGN, EMI_IO_FD_BOUNCE_SIZE)) {
+		close(f->fd);
+		free(f);
+		return -EMI_E_ALLOC;
+	}
+
+	e->io_data = f;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_fd_close(struct emi *e)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	// aligned writes may have extended the file past image end
+	if (f->direct) {
+		ftruncate(f->fd, f->size);
+	}
+
+	close(f->fd);
+	free(f->bounce);
+	free(f);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_fd_read_direct(struct emi_io_fd *f, uint8_t *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	if (offset >= f->size) {
+		return 0;
+	}
+	if (count > f->size - offset) {
+		count = f->size - offset;
+	}
+
+	// already aligned: no bounce needed
+	if (!(((uintptr_t) buf | offset | count) & EMI_IO_FD_ALIGN_MASK)) {
+		ssize_t res = emi_io_fd_pread_all(f->fd, buf, count, offset);
+		return res < 0 ? -EMI_E_READ : res;
+	}
+
+	while (done < count) {
+		uint64_t head = offset & EMI_IO_FD_ALIGN_MASK;
+		uint64_t start = offset - head;
+		size_t chunk = count - done;
+		if (chunk > EMI_IO_FD_BOUNCE_SIZE - head) {
+			chunk = EMI_IO_FD_BOUNCE_SIZE - head;
+		}
+		size_t span = (head + chunk + EMI_IO_FD_ALIGN_MASK) & ~EMI_IO_FD_ALIGN_MASK;
+
+		ssize_t res = emi_io_fd_pread_all(f->fd, f->bounce, span, start);
+		if (res < 0) {
+			return -EMI_E_READ;
+		}
+		if (res < head + chunk) {
+			chunk = res > head ? res - head : 0;
+		}
+		memcpy(buf + done, f->bounce + head, chunk);
+		done += chunk;
+		offset += chunk;
+		// end of file
+		if (res < span) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_fd_write_direct(struct emi_io_fd *f, const uint8_t *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		uint64_t head = offset & EMI_IO_FD_ALIGN_MASK;
+		uint64_t start = offset - head;
+		size_t chunk = count - done;
+		if (chunk > EMI_IO_FD_BOUNCE_SIZE - head) {
+			chunk = EMI_IO_FD_BOUNCE_SIZE - head;
+		}
+		size_t span = (head + chunk + EMI_IO_FD_ALIGN_MASK) & ~EMI_IO_FD_ALIGN_MASK;
+		uint64_t tail = start + span - (offset + chunk);
+
+		// partial first and last blocks keep their surrounding data
+		if (head) {
+			ssize_t res = emi_io_fd_pread_all(f->fd, f->bounce, EMI_IO_FD_ALIGN, start);
+			if (res < 0) {
+				return -EMI_E_WRITE;
+			}
+			memset(f->bounce + res, 0, EMI_IO_FD_ALIGN - res);
+		}
+		if (tail && ((span > EMI_IO_FD_ALIGN) || !head)) {
+			uint8_t *last = f->bounce + span - EMI_IO_FD_ALIGN;
+			ssize_t res = emi_io_fd_pread_all(f->fd, last, EMI_IO_FD_ALIGN, start + span - EMI_IO_FD_ALIGN);
+			if (res < 0) {
+				return -EMI_E_WRITE;
+			}
+			memset(last + res, 0, EMI_IO_FD_ALIGN - res);
+		}
+
+		memcpy(f->bounce + head, buf + done, chunk);
+		if (emi_io_fd_pwrite_all(f->fd, f->bounce, span, start) != span) {
+			return -EMI_E_WRITE;
+		}
+
+		done += chunk;
+		offset += chunk;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_fd_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	if (f->direct) {
+		return emi_io_fd_read_direct(f, buf, count, offset);
+	}
+
+	ssize_t res = emi_io_fd_pread_all(f->fd, buf, count, offset);
+	if (res < 0) {
+		return -EMI_E_READ;
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_fd_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	int64_t res;
+	struct emi_io_fd *f = e->io_data;
+
+	if (f->direct) {
+		res = emi_io_fd_write_direct(f, buf, count, offset);
+	} else {
+		res = emi_io_fd_pwrite_all(f->fd, buf, count, offset);
+		if (res < 0) {
+			res = -EMI_E_WRITE;
+		}
+	}
+
+	if ((res > 0) && (offset + res > f->size)) {
+		f->size = offset + res;
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_sync(struct emi *e)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	if (fdatasync(f->fd)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_fd_size(struct emi *e)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	return f->size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_truncate(struct emi *e, uint64_t size)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	if (ftruncate(f->fd, size)) {
+		return -EMI_E_WRITE;
+	}
+
+	f->size = size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_fd_map(struct emi *e, uint64_t offset, size_t len)
+{
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	// not all filesystems can punch holes, that's fine
+	fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, offset, len) && (errno != EOPNOTSUPP)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_fd_fd(struct emi *e)
+{
+	struct emi_io_fd *f = e->io_data;
+
+	return f->fd;
+}
+
+const struct emi_io emi_io_fd = {
+	"fd",
+	emi_io_fd_open,
+	emi_io_fd_close,
+	emi_io_fd_read,
+	emi_io_fd_write,
+	emi_io_fd_sync,
+	emi_io_fd_size,
+	emi_io_fd_truncate,
+	emi_io_fd_map,
+	emi_io_fd_discard,
+	emi_io_fd_allocate,
+	emi_io_fd_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,371 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "emimg.h"
+#include "io.h"
+
+// buffer grows in at least 1MB steps
+#define EMI_IO_MEM_GROW (1024 * 1024)
+// huge page mappings are sized in multiples of 2MB
+#define EMI_IO_MEM_HUGE_SIZE (2 * 1024 * 1024)
+
+#define EMI_IO_MEM_TMP_SUFFIX ".tmp"
+
+struct emi_io_mem {
+	char *img_name;		// NULL for anonymous images
+	uint8_t *buf;
+	uint64_t size;		// image size
+	uint64_t buf_size;	// allocated buffer size
+	int dirty;
+	unsigned flags;
+};
+
+// -----------------------------------------------------------------------
+static uint8_t * emi_io_mem_alloc(uint64_t size, unsigned flags)
+{
+	uint8_t *buf = MAP_FAILED;
+
+	if (flags & EMI_IO_HUGEPAGES) {
+		// explicit huge pages first, transparent ones if none are reserved
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED) {
+			buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buf != MAP_FAILED) {
+				madvise(buf, size, MADV_HUGEPAGE);
+			}
+		}
+	} else {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (buf == MAP_FAILED) {
+		return NULL;
+	}
+
+	return buf;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_grow(struct emi_io_mem *m, uint64_t size)
+{
+	uint64_t buf_size = m->buf_size * 2;
+	if (buf_size < size + EMI_IO_MEM_GROW) {
+		buf_size = size + EMI_IO_MEM_GROW;
+	}
+	if (m->flags & EMI_IO_HUGEPAGES) {
+		buf_size = (buf_size + EMI_IO_MEM_HUGE_SIZE - 1) & ~((uint64_t) EMI_IO_MEM_HUGE_SIZE - 1);
+	}
+
+	// fresh anonymous memory is zeroed
+	uint8_t *buf = emi_io_mem_alloc(buf_size, m->flags);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+	if (m->buf) {
+		memcpy(buf, m->buf, m->size);
+		munmap(m->buf, m->buf_size);
+	}
+
+	m->buf = buf;
+	m->buf_size = buf_size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_load(struct emi_io_mem *m)
+{
+	int res = -EMI_E_READ;
+	FILE *f = fopen(m->img_name, "r");
+	if (!f) {
+		return -EMI_E_OPEN;
+	}
+
+	if (fseeko(f, 0, SEEK_END)) {
+		goto fin;
+	}
+	off_t size = ftello(f);
+	if (size < 0) {
+		goto fin;
+	}
+	if (fseeko(f, 0, SEEK_SET)) {
+		goto fin;
+	}
+
+	res = emi_io_mem_grow(m, size);
+	if (res != EMI_E_OK) {
+		goto fin;
+	}
+	if (fread(m->buf, 1, size, f) != size) {
+		res = -EMI_E_READ;
+		goto fin;
+	}
+	m->size = size;
+
+	res = EMI_E_OK;
+
+fin:
+	fclose(f);
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Write image atomically: to a temporary file first, then rename it over
+static int emi_io_mem_store(struct emi_io_mem *m)
+{
+	int res = -EMI_E_WRITE;
+	size_t done = 0;
+
+	char *tmp_name = malloc(strlen(m->img_name) + sizeof(EMI_IO_MEM_TMP_SUFFIX));
+	if (!tmp_name) {
+		return -EMI_E_ALLOC;
+	}
+	sprintf(tmp_name, "%s%s", m->img_name, EMI_IO_MEM_TMP_SUFFIX);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		free(tmp_name);
+		return -EMI_E_OPEN;
+	}
+
+	while (done < m->size) {
+		ssize_t w = write(fd, m->buf + done, m->size - done);
+		if (w <= 0) {
+			goto fin;
+		}
+		done += w;
+	}
+	if (fsync(fd)) {
+		goto fin;
+	}
+	if (close(fd)) {
+		fd = -1;
+		goto fin;
+	}
+	fd = -1;
+	if (rename(tmp_name, m->img_name)) {
+		goto fin;
+	}
+
+	m->dirty = 0;
+	res = EMI_E_OK;
+
+fin:
+	if (res != EMI_E_OK) {
+		if (fd >= 0) close(fd);
+		unlink(tmp_name);
+	}
+	free(tmp_name);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_open(struct emi *e, char *img_name, int create)
+{
+	int res;
+
+	struct emi_io_mem *m = calloc(1, sizeof(struct emi_io_mem));
+	if (!m) {
+		return -EMI_E_ALLOC;
+	}
+	m->flags = e->io_flags;
+
+	// anonymous images live only in memory
+	if (!img_name) {
+		if (!create || (m->flags & EMI_IO_PERSIST)) {
+			free(m);
+			return -EMI_E_OPEN;
+		}
+	} else {
+		m->img_name = strdup(img_name);
+		if (!m->img_name) {
+			free(m);
+			return -EMI_E_ALLOC;
+		}
+	}
+
+	if (create) {
+		m->dirty = 1;
+	} else {
+		res = emi_io_mem_load(m);
+		if (res != EMI_E_OK) {
+			if (m->buf) munmap(m->buf, m->buf_size);
+			free(m->img_name);
+			free(m);
+			return res;
+		}
+	}
+
+	e->io_data = m;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_mem_close(struct emi *e)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if (m->dirty && (m->flags & EMI_IO_PERSIST)) {
+		emi_io_mem_store(m);
+	}
+
+	if (m->buf) {
+		munmap(m->buf, m->buf_size);
+	}
+	free(m->img_name);
+	free(m);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mem_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if (offset >= m->size) {
+		return 0;
+	}
+	if (count > m->size - offset) {
+		count = m->size - offset;
+	}
+
+	memcpy(buf, m->buf + offset, count);
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mem_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_mem *m = e->io_data;
+	uint64_t end = offset + count;
+
+	if ((end > m->buf_size) && (emi_io_mem_grow(m, end) != EMI_E_OK)) {
+		return -EMI_E_WRITE;
+	}
+
+	memcpy(m->buf + offset, buf, count);
+	if (end > m->size) {
+		m->size = end;
+	}
+	m->dirty = 1;
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_sync(struct emi *e)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if (!m->dirty || !(m->flags & EMI_IO_PERSIST)) {
+		return EMI_E_OK;
+	}
+
+	return emi_io_mem_store(m);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mem_size(struct emi *e)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	return m->size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_truncate(struct emi *e, uint64_t size)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if ((size > m->buf_size) && (emi_io_mem_grow(m, size) != EMI_E_OK)) {
+		return -EMI_E_WRITE;
+	}
+
+	// keep the area past image end zeroed
+	if (size < m->size) {
+		memset(m->buf + size, 0, m->size - size);
+	}
+
+	m->size = size;
+	m->dirty = 1;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_mem_map(struct emi *e, uint64_t offset, size_t len)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if (offset + len > m->size) {
+		return NULL;
+	}
+
+	return m->buf + offset;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_io_mem *m = e->io_data;
+
+	if ((offset + len > m->buf_size) && (emi_io_mem_grow(m, offset + len) != EMI_E_OK)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mem_fd(struct emi *e)
+{
+	return -1;
+}
+
+const struct emi_io emi_io_mem = {
+	"mem",
+	emi_io_mem_open,
+	emi_io_mem_close,
+	emi_io_mem_read,
+	emi_io_mem_write,
+	emi_io_mem_sync,
+	emi_io_mem_size,
+	emi_io_mem_truncate,
+	emi_io_mem_map,
+	emi_io_mem_discard,
+	emi_io_mem_allocate,
+	emi_io_mem_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
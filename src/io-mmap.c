@@ -0,0 +1,263 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "emimg.h"
+#include "io.h"
+
+// file grows in at least 1MB steps while mapped
+#define EMI_IO_MMAP_GROW (1024 * 1024)
+
+struct emi_io_mmap {
+	int fd;
+	uint8_t *map;
+	uint64_t size;		// image size
+	uint64_t map_size;	// file and mapping size (>= image size)
+};
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_remap(struct emi_io_mmap *m, uint64_t map_size)
+{
+	uint8_t *map;
+
+	if (ftruncate(m->fd, map_size)) {
+		return -EMI_E_WRITE;
+	}
+
+	if (m->map) {
+		map = mremap(m->map, m->map_size, map_size, MREMAP_MAYMOVE);
+	} else {
+		map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+	}
+	if (map == MAP_FAILED) {
+		return -EMI_E_ALLOC;
+	}
+
+	m->map = map;
+	m->map_size = map_size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_open(struct emi *e, char *img_name, int create)
+{
+	int res;
+	struct stat st;
+
+	struct emi_io_mmap *m = calloc(1, sizeof(struct emi_io_mmap));
+	if (!m) {
+		return -EMI_E_ALLOC;
+	}
+
+	m->fd = open(img_name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666);
+	if (m->fd < 0) {
+		free(m);
+		return -EMI_E_OPEN;
+	}
+
+	if (fstat(m->fd, &st)) {
+		res = -EMI_E_OPEN;
+		goto fail;
+	}
+
+	m->size = st.st_size;
+	if (m->size) {
+		res = emi_io_mmap_remap(m, m->size);
+		if (res != EMI_E_OK) {
+			goto fail;
+		}
+	}
+
+	e->io_data = m;
+
+	return EMI_E_OK;
+
+fail:
+	close(m->fd);
+	free(m);
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_mmap_close(struct emi *e)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (m->map) {
+		munmap(m->map, m->map_size);
+	}
+	// drop the growth slack
+	if (m->map_size != m->size) {
+		ftruncate(m->fd, m->size);
+	}
+	close(m->fd);
+	free(m);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mmap_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (offset >= m->size) {
+		return 0;
+	}
+	if (count > m->size - offset) {
+		count = m->size - offset;
+	}
+
+	memcpy(buf, m->map + offset, count);
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mmap_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	int res;
+	struct emi_io_mmap *m = e->io_data;
+	uint64_t end = offset + count;
+
+	if (end > m->map_size) {
+		uint64_t map_size = m->map_size * 2;
+		if (map_size < end + EMI_IO_MMAP_GROW) {
+			map_size = end + EMI_IO_MMAP_GROW;
+		}
+		res = emi_io_mmap_remap(m, map_size);
+		if (res != EMI_E_OK) {
+			return -EMI_E_WRITE;
+		}
+	}
+
+	memcpy(m->map + offset, buf, count);
+	if (end > m->size) {
+		m->size = end;
+	}
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_sync(struct emi *e)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (m->map && msync(m->map, m->map_size, MS_SYNC)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_mmap_size(struct emi *e)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	return m->size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_truncate(struct emi *e, uint64_t size)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (size > m->map_size) {
+		int res = emi_io_mmap_remap(m, size);
+		if (res != EMI_E_OK) {
+			return -EMI_E_WRITE;
+		}
+	} else if (size < m->size) {
+		// let the kernel drop (and zero) the tail, keep the mapping
+		if (ftruncate(m->fd, size) || ftruncate(m->fd, m->map_size)) {
+			return -EMI_E_WRITE;
+		}
+	}
+
+	m->size = size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_mmap_map(struct emi *e, uint64_t offset, size_t len)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (offset + len > m->size) {
+		return NULL;
+	}
+
+	return m->map + offset;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	if (fallocate(m->fd, FALLOC_FL_KEEP_SIZE, offset, len) && (errno != EOPNOTSUPP)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_mmap_fd(struct emi *e)
+{
+	struct emi_io_mmap *m = e->io_data;
+
+	return m->fd;
+}
+
+const struct emi_io emi_io_mmap = {
+	"mmap",
+	emi_io_mmap_open,
+	emi_io_mmap_close,
+	emi_io_mmap_read,
+	emi_io_mmap_write,
+	emi_io_mmap_sync,
+	emi_io_mmap_size,
+	emi_io_mmap_truncate,
+	emi_io_mmap_map,
+	emi_io_mmap_discard,
+	emi_io_mmap_allocate,
+	emi_io_mmap_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
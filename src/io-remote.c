@@ -0,0 +1,357 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Storage backend talking to emimgd, which owns the image file
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include "emimg.h"
+#include "io.h"
+#include "remote.h"
+
+struct emi_io_remote {
+	int sock;
+	uint8_t *shm;
+	uint32_t shm_size;
+};
+
+// -----------------------------------------------------------------------
+int emi_remote_send(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t res = send(fd, (const uint8_t*) buf + done, len - done, MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_IO;
+		}
+		done += res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_remote_recv(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t res = recv(fd, (uint8_t*) buf + done, len - done, 0);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_IO;
+		}
+		// peer gone
+		if (res == 0) {
+			return -EMI_E_IO;
+		}
+		done += res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_remote_call(struct emi_io_remote *r, uint32_t op, uint32_t flags, uint64_t offset, uint64_t len)
+{
+	struct emi_remote_req req = { op, flags, offset, len };
+	struct emi_remote_resp resp;
+
+	if ((emi_remote_send(r->sock, &req, sizeof(req)) != EMI_E_OK) || (emi_remote_recv(r->sock, &resp, sizeof(resp)) != EMI_E_OK)) {
+		return -EMI_E_IO;
+	}
+
+	return resp.res;
+}
+
+// -----------------------------------------------------------------------
+// Receive hello and the shared buffer
+static int emi_io_remote_hello(struct emi_io_remote *r)
+{
+	struct emi_remote_resp resp;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &resp, sizeof(resp) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	ssize_t res;
+	do {
+		res = recvmsg(r->sock, &msg, MSG_WAITALL);
+	} while ((res < 0) && (errno == EINTR));
+	if ((res != sizeof(resp)) || (resp.magic != EMI_REMOTE_MAGIC) || (resp.res != EMI_E_OK)) {
+		return -EMI_E_OPEN;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+		return -EMI_E_OPEN;
+	}
+	int shm_fd;
+	memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	r->shm = mmap(NULL, resp.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (r->shm == MAP_FAILED) {
+		r->shm = NULL;
+		return -EMI_E_ALLOC;
+	}
+	r->shm_size = resp.shm_size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Get daemon socket name
+int emi_remote_socket(char *buf, size_t len)
+{
+	int res;
+	char *sock_name = getenv(EMI_REMOTE_SOCKET_ENV);
+	char *run_dir = getenv("XDG_RUNTIME_DIR");
+
+	if (sock_name) {
+		res = snprintf(buf, len, "%s", sock_name);
+	} else if (run_dir && *run_dir) {
+		res = snprintf(buf, len, "%s/%s", run_dir, EMI_REMOTE_SOCKET);
+	} else {
+		res = snprintf(buf, len, EMI_REMOTE_SOCKET_DIR "/%s", (unsigned) getuid(), EMI_REMOTE_SOCKET);
+	}
+
+	if ((res < 0) || (res >= len)) {
+		return -EMI_E_OPEN;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Daemon works in its own directory, it needs absolute image path
+static char * emi_io_remote_path(char *img_name)
+{
+	char cwd[PATH_MAX];
+	char *path;
+
+	if (img_name[0] == '/') {
+		return strdup(img_name);
+	}
+	if (!getcwd(cwd, sizeof(cwd))) {
+		return NULL;
+	}
+	if (asprintf(&path, "%s/%s", cwd, img_name) < 0) {
+		return NULL;
+	}
+
+	return path;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_open(struct emi *e, char *img_name, int create)
+{
+	int res;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char *path = NULL;
+
+	// daemon serves named files only
+	if (!img_name) {
+		return -EMI_E_OPEN;
+	}
+
+	struct emi_io_remote *r = calloc(1, sizeof(struct emi_io_remote));
+	if (!r) {
+		return -EMI_E_ALLOC;
+	}
+
+	if (emi_remote_socket(addr.sun_path, sizeof(addr.sun_path)) != EMI_E_OK) {
+		free(r);
+		return -EMI_E_OPEN;
+	}
+
+	r->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (r->sock < 0) {
+		free(r);
+		return -EMI_E_OPEN;
+	}
+	if (connect(r->sock, (struct sockaddr *) &addr, sizeof(addr))) {
+		res = -EMI_E_OPEN;
+		goto fail;
+	}
+
+	res = emi_io_remote_hello(r);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	path = emi_io_remote_path(img_name);
+	if (!path) {
+		res = -EMI_E_ALLOC;
+		goto fail;
+	}
+	size_t len = strlen(path);
+	if (len >= r->shm_size) {
+		res = -EMI_E_OPEN;
+		goto fail;
+	}
+	memcpy(r->shm, path, len);
+
+	res = emi_io_remote_call(r, EMI_REMOTE_OPEN, create, 0, len);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	free(path);
+	e->io_data = r;
+
+	return EMI_E_OK;
+
+fail:
+	free(path);
+	if (r->shm) munmap(r->shm, r->shm_size);
+	close(r->sock);
+	free(r);
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_remote_close(struct emi *e)
+{
+	struct emi_io_remote *r = e->io_data;
+
+	// daemon drops the image when connection is closed
+	munmap(r->shm, r->shm_size);
+	close(r->sock);
+	free(r);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_remote_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_remote *r = e->io_data;
+	size_t done = 0;
+
+	while (done < count) {
+		size_t chunk = count - done < r->shm_size ? count - done : r->shm_size;
+		int64_t res = emi_io_remote_call(r, EMI_REMOTE_READ, 0, offset + done, chunk);
+		if (res < 0) {
+			return res;
+		}
+		memcpy((uint8_t*) buf + done, r->shm, res);
+		done += res;
+		// end of image
+		if (res < chunk) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_remote_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_remote *r = e->io_data;
+	size_t done = 0;
+
+	while (done < count) {
+		size_t chunk = count - done < r->shm_size ? count - done : r->shm_size;
+		memcpy(r->shm, (const uint8_t*) buf + done, chunk);
+		int64_t res = emi_io_remote_call(r, EMI_REMOTE_WRITE, 0, offset + done, chunk);
+		if (res < 0) {
+			return res;
+		}
+		if (res != chunk) {
+			return -EMI_E_WRITE;
+		}
+		done += chunk;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_sync(struct emi *e)
+{
+	return emi_io_remote_call(e->io_data, EMI_REMOTE_SYNC, 0, 0, 0);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_remote_size(struct emi *e)
+{
+	return emi_io_remote_call(e->io_data, EMI_REMOTE_SIZE, 0, 0, 0);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_truncate(struct emi *e, uint64_t size)
+{
+	return emi_io_remote_call(e->io_data, EMI_REMOTE_TRUNCATE, 0, size, 0);
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_remote_map(struct emi *e, uint64_t offset, size_t len)
+{
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return emi_io_remote_call(e->io_data, EMI_REMOTE_DISCARD, 0, offset, len);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return emi_io_remote_call(e->io_data, EMI_REMOTE_ALLOCATE, 0, offset, len);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_remote_fd(struct emi *e)
+{
+	// image file belongs to the daemon
+	return -1;
+}
+
+const struct emi_io emi_io_remote = {
+	"remote",
+	emi_io_remote_open,
+	emi_io_remote_close,
+	emi_io_remote_read,
+	emi_io_remote_write,
+	emi_io_remote_sync,
+	emi_io_remote_size,
+	emi_io_remote_truncate,
+	emi_io_remote_map,
+	emi_io_remote_discard,
+	emi_io_remote_allocate,
+	emi_io_remote_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
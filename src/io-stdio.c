@@ -0,0 +1,174 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "emimg.h"
+#include "io.h"
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_open(struct emi *e, char *img_name, int create)
+{
+	FILE *f = fopen(img_name, create ? "w+" : "r+");
+	if (!f) {
+		return -EMI_E_OPEN;
+	}
+
+	e->io_data = f;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_stdio_close(struct emi *e)
+{
+	fclose(e->io_data);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stdio_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	FILE *f = e->io_data;
+
+	if (fseeko(f, offset, SEEK_SET)) {
+		return -EMI_E_SEEK;
+	}
+
+	size_t res = fread(buf, 1, count, f);
+	if ((res != count) && ferror(f)) {
+		clearerr(f);
+		return -EMI_E_READ;
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stdio_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	FILE *f = e->io_data;
+
+	if (fseeko(f, offset, SEEK_SET)) {
+		return -EMI_E_SEEK;
+	}
+
+	if (fwrite(buf, 1, count, f) != count) {
+		clearerr(f);
+		return -EMI_E_WRITE;
+	}
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_sync(struct emi *e)
+{
+	FILE *f = e->io_data;
+
+	if (fflush(f) || fsync(fileno(f))) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stdio_size(struct emi *e)
+{
+	FILE *f = e->io_data;
+
+	if (fseeko(f, 0, SEEK_END)) {
+		return -EMI_E_SEEK;
+	}
+
+	return ftello(f);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_truncate(struct emi *e, uint64_t size)
+{
+	FILE *f = e->io_data;
+
+	if (fflush(f) || ftruncate(fileno(f), size)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_stdio_map(struct emi *e, uint64_t offset, size_t len)
+{
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	FILE *f = e->io_data;
+
+	if (fflush(f)) {
+		return -EMI_E_WRITE;
+	}
+
+	if (fallocate(fileno(f), FALLOC_FL_KEEP_SIZE, offset, len) && (errno != EOPNOTSUPP)) {
+		return -EMI_E_WRITE;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stdio_fd(struct emi *e)
+{
+	FILE *f = e->io_data;
+
+	if (fflush(f)) {
+		return -1;
+	}
+
+	return fileno(f);
+}
+
+const struct emi_io emi_io_stdio = {
+	"stdio",
+	emi_io_stdio_open,
+	emi_io_stdio_close,
+	emi_io_stdio_read,
+	emi_io_stdio_write,
+	emi_io_stdio_sync,
+	emi_io_stdio_size,
+	emi_io_stdio_truncate,
+	emi_io_stdio_map,
+	emi_io_stdio_discard,
+	emi_io_stdio_allocate,
+	emi_io_stdio_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
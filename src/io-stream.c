@@ -0,0 +1,376 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Storage backend for images on pipes, FIFOs and other non-seekable
+// descriptors. Image can only be read or only be written, front to back.
+//
+// Reading: a thread keeps reading ahead into a ring buffer, so the writer
+// on the other end doesn't stall while the image is consumed. Data before
+// the offset of the latest read is dropped, so a read may go back only
+// as far as the previous read started (enough to peek at the header).
+//
+// Writing: data is buffered and written out when the buffer fills up and
+// on close. Writes can't go back, a gap before the write offset is
+// filled with zeros.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_IO_STREAM_BUF_SIZE (1024 * 1024)
+
+struct emi_io_stream {
+	int fd;
+	unsigned mode;		// EMI_RO or EMI_WO
+	uint8_t *buf;		// read: ring buffer, write: output buffer
+	uint64_t base;		// stream offset of the first byte in buffer
+	size_t head;		// buffer index of the first byte (read)
+	size_t len;			// bytes in buffer
+	int eof;
+	int err;
+
+	pthread_t reader;
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// -----------------------------------------------------------------------
+static void * emi_io_stream_reader(void *ptr)
+{
+	struct emi_io_stream *s = ptr;
+
+	// can be cancelled only while waiting for data
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->quit && !s->eof && !s->err) {
+		if (s->len == EMI_IO_STREAM_BUF_SIZE) {
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		// space past the buffered data is only touched by this thread
+		size_t tail = (s->head + s->len) % EMI_IO_STREAM_BUF_SIZE;
+		size_t space = EMI_IO_STREAM_BUF_SIZE - s->len;
+		if (space > EMI_IO_STREAM_BUF_SIZE - tail) {
+			space = EMI_IO_STREAM_BUF_SIZE - tail;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ssize_t res = read(s->fd, s->buf + tail, space);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&s->lock);
+		if (res > 0) {
+			s->len += res;
+		} else if (res == 0) {
+			s->eof = 1;
+		} else if (errno != EINTR) {
+			s->err = 1;
+		}
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_flush(struct emi_io_stream *s)
+{
+	size_t done = 0;
+
+	while (done < s->len) {
+		ssize_t res = write(s->fd, s->buf + done, s->len - done);
+		if (res < 0) {
+			if (errno == EINTR) continue;
+			return -EMI_E_WRITE;
+		}
+		done += res;
+	}
+
+	s->base += s->len;
+	s->len = 0;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Set up image 'e' on descriptor 'fd', open for reading (EMI_RO) or
+// writing (EMI_WO). Descriptor stays owned by the caller.
+int emi_stream_attach(struct emi *e, int fd, unsigned mode)
+{
+	if ((mode != EMI_RO) && (mode != EMI_WO)) {
+		return -EMI_E_OPEN;
+	}
+
+	struct emi_io_stream *s = calloc(1, sizeof(struct emi_io_stream));
+	if (!s) {
+		return -EMI_E_ALLOC;
+	}
+	s->fd = fd;
+	s->mode = mode;
+
+	s->buf = malloc(EMI_IO_STREAM_BUF_SIZE);
+	if (!s->buf) {
+		free(s);
+		return -EMI_E_ALLOC;
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	if ((mode == EMI_RO) && pthread_create(&s->reader, NULL, emi_io_stream_reader, s)) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(s->buf);
+		free(s);
+		return -EMI_E_ALLOC;
+	}
+
+	e->io = &emi_io_stream;
+	e->io_data = s;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_open(struct emi *e, char *img_name, int create)
+{
+	// streams are set up with emi_stream_attach()
+	return -EMI_E_IO;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_stream_close(struct emi *e)
+{
+	struct emi_io_stream *s = e->io_data;
+
+	if (s->mode == EMI_RO) {
+		pthread_mutex_lock(&s->lock);
+		s->quit = 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		// reader may be blocked in read(), there is no telling when
+		// the other end sends more data or goes away
+		pthread_cancel(s->reader);
+		pthread_join(s->reader, NULL);
+	} else {
+		emi_io_stream_flush(s);
+	}
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->buf);
+	free(s);
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_stream_drop(struct emi_io_stream *s, size_t count)
+{
+	s->head = (s->head + count) % EMI_IO_STREAM_BUF_SIZE;
+	s->base += count;
+	s->len -= count;
+	pthread_cond_broadcast(&s->cond);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stream_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_io_stream *s = e->io_data;
+	size_t done = 0;
+
+	if (s->mode != EMI_RO) {
+		return -EMI_E_READ;
+	}
+
+	pthread_mutex_lock(&s->lock);
+
+	if (offset < s->base) {
+		pthread_mutex_unlock(&s->lock);
+		return -EMI_E_SEEK;
+	}
+
+	while (done < count) {
+		uint64_t pos = offset + done;
+
+		// data before current position is not needed anymore
+		if (pos > s->base) {
+			emi_io_stream_drop(s, pos - s->base < s->len ? pos - s->base : s->len);
+		}
+		if ((pos > s->base) || !s->len) {
+			if (s->eof || s->err) {
+				break;
+			}
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		size_t chunk = count - done < s->len ? count - done : s->len;
+		if (chunk > EMI_IO_STREAM_BUF_SIZE - s->head) {
+			chunk = EMI_IO_STREAM_BUF_SIZE - s->head;
+		}
+		memcpy((uint8_t*) buf + done, s->buf + s->head, chunk);
+		done += chunk;
+	}
+
+	int err = s->err;
+	pthread_mutex_unlock(&s->lock);
+
+	if (!done && err) {
+		return -EMI_E_READ;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stream_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	int res;
+	struct emi_io_stream *s = e->io_data;
+	size_t done = 0;
+
+	if (s->mode != EMI_WO) {
+		return -EMI_E_WRITE;
+	}
+
+	if (offset < s->base + s->len) {
+		return -EMI_E_SEEK;
+	}
+
+	while (s->base + s->len < offset + count) {
+		if (s->len == EMI_IO_STREAM_BUF_SIZE) {
+			res = emi_io_stream_flush(s);
+			if (res != EMI_E_OK) {
+				return res;
+			}
+		}
+
+		uint64_t pos = s->base + s->len;
+		size_t space = EMI_IO_STREAM_BUF_SIZE - s->len;
+
+		// fill the gap
+		if (pos < offset) {
+			size_t gap = offset - pos < space ? offset - pos : space;
+			memset(s->buf + s->len, 0, gap);
+			s->len += gap;
+			continue;
+		}
+
+		size_t chunk = count - done < space ? count - done : space;
+		memcpy(s->buf + s->len, (const uint8_t*) buf + done, chunk);
+		s->len += chunk;
+		done += chunk;
+	}
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_sync(struct emi *e)
+{
+	struct emi_io_stream *s = e->io_data;
+
+	if (s->mode == EMI_WO) {
+		return emi_io_stream_flush(s);
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_stream_size(struct emi *e)
+{
+	struct emi_io_stream *s = e->io_data;
+
+	// stream data seen so far
+	pthread_mutex_lock(&s->lock);
+	int64_t size = s->base + s->len;
+	pthread_mutex_unlock(&s->lock);
+
+	return size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_truncate(struct emi *e, uint64_t size)
+{
+	struct emi_io_stream *s = e->io_data;
+
+	if (s->mode != EMI_WO) {
+		return -EMI_E_WRITE;
+	}
+	if (size < s->base + s->len) {
+		return -EMI_E_SEEK;
+	}
+
+	// stream can only grow
+	int64_t res = emi_io_stream_write(e, NULL, 0, size);
+	if (res < 0) {
+		return res;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_stream_map(struct emi *e, uint64_t offset, size_t len)
+{
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_stream_fd(struct emi *e)
+{
+	return -1;
+}
+
+const struct emi_io emi_io_stream = {
+	"stream",
+	emi_io_stream_open,
+	emi_io_stream_close,
+	emi_io_stream_read,
+	emi_io_stream_write,
+	emi_io_stream_sync,
+	emi_io_stream_size,
+	emi_io_stream_truncate,
+	emi_io_stream_map,
+	emi_io_stream_discard,
+	emi_io_stream_allocate,
+	emi_io_stream_fd,
+};
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,739 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Volumes: disk images with data kept in several member disk images.
+//
+// Volume image itself holds only the header. Its EMI_META_VOLUME entry
+// lists members: mode (1), member count (1), NUL-terminated member
+// image names (relative to the volume image directory). Striped volumes
+// put consecutive tracks on consecutive members (track t is track
+// t/count of member t%count), mirrored volumes keep full copy of the
+// data on each member.
+//
+// When a volume is opened, this backend replaces the one the volume
+// image was opened with and passes data access on to member images.
+// Transfers spanning several members are done in parallel, one worker
+// thread per member.
+
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_VOL_MEMBERS_MAX 32
+
+enum emi_vol_ops {
+	EMI_VOL_NONE,
+	EMI_VOL_READ,
+	EMI_VOL_WRITE,
+	EMI_VOL_DISCARD,
+	EMI_VOL_ALLOCATE,
+};
+
+struct emi_vol;
+
+struct emi_vol_member {
+	struct emi *e;
+	struct emi_vol *v;
+	unsigned idx;
+	// job for the worker thread
+	int op;
+	uint8_t *buf;
+	uint64_t offset;
+	uint64_t len;
+	int split;
+	int res;
+};
+
+struct emi_vol {
+	struct emi desc;		// storage context of the volume image itself
+	const struct emi_io *io;	// storage backend of the volume image itself
+	unsigned mode;
+	unsigned count;
+	uint64_t track;			// track size (stripe unit)
+	uint64_t size;			// volume data size
+	unsigned next_read;		// mirror member to read from next
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	unsigned pending;
+	int quit;
+	unsigned threads;
+	pthread_t thread[EMI_VOL_MEMBERS_MAX];
+	struct emi_vol_member m[EMI_VOL_MEMBERS_MAX];
+};
+
+struct emi * emi_open_private(char *img_name, unsigned io);
+char * emi_path_rel(const char *base, const char *name);
+void emi_close_private(struct emi *e);
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+int emi_vol_attach(struct emi *e, const uint8_t *desc, unsigned len);
+
+// -----------------------------------------------------------------------
+static const char * emi_vol_mode_name(unsigned mode)
+{
+	return mode == EMI_VOL_STRIPE ? "stripe" : "mirror";
+}
+
+// -----------------------------------------------------------------------
+// Member image size needed to hold 'count' tracks
+static uint16_t emi_vol_member_cyls(unsigned mode, unsigned count, uint16_t cylinders, uint8_t heads)
+{
+	if (mode == EMI_VOL_MIRROR) {
+		return cylinders;
+	}
+
+	uint32_t tracks = ((uint32_t) cylinders * heads + count - 1) / count;
+	return (tracks + heads - 1) / heads;
+}
+
+// -----------------------------------------------------------------------
+// Member data length for volume data length 'len'
+static uint64_t emi_vol_member_len(struct emi_vol *v, unsigned idx, uint64_t len)
+{
+	if (v->mode == EMI_VOL_MIRROR) {
+		return len;
+	}
+
+	uint64_t tracks = len / v->track;
+	uint64_t rem = len % v->track;
+	uint64_t mlen = (tracks / v->count + (idx < tracks % v->count ? 1 : 0)) * v->track;
+	if (idx == tracks % v->count) {
+		mlen += rem;
+	}
+
+	return mlen;
+}
+
+// -----------------------------------------------------------------------
+// Volume data length covered by member data length 'mlen'
+static uint64_t emi_vol_len(struct emi_vol *v, unsigned idx, uint64_t mlen)
+{
+	if (v->mode == EMI_VOL_MIRROR) {
+		return mlen;
+	}
+
+	uint64_t tracks = mlen / v->track;
+	uint64_t rem = mlen % v->track;
+	if (rem) {
+		return (tracks * v->count + idx) * v->track + rem;
+	} else if (tracks) {
+		return ((tracks - 1) * v->count + idx + 1) * v->track;
+	}
+
+	return 0;
+}
+
+// -----------------------------------------------------------------------
+// Transfer 'len' bytes at member data 'offset'
+static int emi_vol_member_op(struct emi *me, int op, uint8_t *buf, uint64_t offset, uint64_t len)
+{
+	int res = EMI_E_OK;
+	int64_t done;
+
+	emi_lock(me);
+	switch (op) {
+		case EMI_VOL_READ:
+			done = me->io->read(me, buf, len, me->hsize + offset);
+			if (done < 0) {
+				res = done;
+			} else if (done < len) {
+				// not written yet
+				memset(buf + done, 0, len - done);
+			}
+			break;
+		case EMI_VOL_WRITE:
+			if (me->io->write(me, buf, len, me->hsize + offset) != len) {
+				res = -EMI_E_WRITE;
+			}
+			break;
+		case EMI_VOL_DISCARD:
+			res = me->io->discard(me, me->hsize + offset, len);
+			break;
+		case EMI_VOL_ALLOCATE:
+			res = me->io->allocate(me, me->hsize + offset, len);
+			break;
+	}
+	emi_unlock(me);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Do member's part of the volume data transfer. 'split' makes mirror
+// members share the work the same way stripes do.
+static int emi_vol_member_io(struct emi_vol_member *m, int op, uint8_t *buf, uint64_t offset, uint64_t len, int split)
+{
+	struct emi_vol *v = m->v;
+	uint64_t end = offset + len;
+
+	// mirror member gets the whole transfer
+	if ((v->mode == EMI_VOL_MIRROR) && !split) {
+		return emi_vol_member_op(m->e, op, buf, offset, len);
+	}
+
+	// first track of this member within the transfer
+	uint64_t t = offset / v->track;
+	t += (m->idx + v->count - t % v->count) % v->count;
+
+	for ( ; t * v->track < end ; t += v->count) {
+		uint64_t start = t * v->track > offset ? t * v->track : offset;
+		uint64_t stop = (t + 1) * v->track < end ? (t + 1) * v->track : end;
+		uint64_t moffset = v->mode == EMI_VOL_MIRROR ? start : (t / v->count) * v->track + start - t * v->track;
+		int res = emi_vol_member_op(m->e, op, buf ? buf + (start - offset) : NULL, moffset, stop - start);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_vol_worker(void *ptr)
+{
+	struct emi_vol_member *m = ptr;
+	struct emi_vol *v = m->v;
+
+	pthread_mutex_lock(&v->lock);
+	while (1) {
+		while ((m->op == EMI_VOL_NONE) && !v->quit) {
+			pthread_cond_wait(&v->job_cond, &v->lock);
+		}
+		if (m->op == EMI_VOL_NONE) {
+			break;
+		}
+		pthread_mutex_unlock(&v->lock);
+
+		int res = emi_vol_member_io(m, m->op, m->buf, m->offset, m->len, m->split);
+
+		pthread_mutex_lock(&v->lock);
+		m->res = res;
+		m->op = EMI_VOL_NONE;
+		if (--v->pending == 0) {
+			pthread_cond_signal(&v->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Volume data transfer (offset relative to volume data start)
+static int emi_vol_data_io(struct emi_vol *v, int op, uint8_t *buf, uint64_t offset, uint64_t len)
+{
+	unsigned first = 0;
+	unsigned count = v->count;
+	int split = 0;
+	int res = EMI_E_OK;
+
+	if (!len) {
+		return EMI_E_OK;
+	}
+
+	uint64_t tracks = (offset + len - 1) / v->track - offset / v->track + 1;
+
+	// mirror updates go to all members, anything else to members
+	// holding the tracks (mirror reads are split like stripes)
+	if ((v->mode == EMI_VOL_STRIPE) || (op == EMI_VOL_READ)) {
+		if ((v->mode == EMI_VOL_MIRROR) && (tracks == 1)) {
+			first = v->next_read++ % v->count;
+			count = 1;
+		} else if (tracks < v->count) {
+			first = (offset / v->track) % v->count;
+			count = tracks;
+		}
+		split = (v->mode == EMI_VOL_MIRROR) && (count > 1);
+	}
+
+	// run all but the first member's part in worker threads, if there are any
+	unsigned posted = 0;
+	if (v->threads && (count > 1)) {
+		pthread_mutex_lock(&v->lock);
+		for (unsigned i=1 ; i<count ; i++) {
+			struct emi_vol_member *m = v->m + (first + i) % v->count;
+			m->op = op;
+			m->buf = buf;
+			m->offset = offset;
+			m->len = len;
+			m->split = split;
+			m->res = EMI_E_OK;
+			posted++;
+		}
+		v->pending = posted;
+		pthread_cond_broadcast(&v->job_cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	for (unsigned i=0 ; i<count-posted ; i++) {
+		int r = emi_vol_member_io(v->m + (first + i) % v->count, op, buf, offset, len, split);
+		if (r != EMI_E_OK) {
+			res = r;
+		}
+	}
+
+	if (posted) {
+		pthread_mutex_lock(&v->lock);
+		while (v->pending) {
+			pthread_cond_wait(&v->done_cond, &v->lock);
+		}
+		for (unsigned i=1 ; i<count ; i++) {
+			struct emi_vol_member *m = v->m + (first + i) % v->count;
+			if (m->res != EMI_E_OK) {
+				res = m->res;
+			}
+		}
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_open(struct emi *e, char *img_name, int create)
+{
+	// volumes are set up with emi_vol_attach()
+	return -EMI_E_IO;
+}
+
+// -----------------------------------------------------------------------
+static void emi_io_vol_close(struct emi *e)
+{
+	struct emi_vol *v = e->io_data;
+
+	if (v->threads) {
+		pthread_mutex_lock(&v->lock);
+		v->quit = 1;
+		pthread_cond_broadcast(&v->job_cond);
+		pthread_mutex_unlock(&v->lock);
+		for (unsigned i=0 ; i<v->threads ; i++) {
+			pthread_join(v->thread[i], NULL);
+		}
+	}
+
+	for (unsigned i=0 ; i<v->count ; i++) {
+		if (v->m[i].e) {
+			emi_close_private(v->m[i].e);
+		}
+	}
+
+	v->io->close(&v->desc);
+
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->job_cond);
+	pthread_cond_destroy(&v->done_cond);
+	free(v);
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_vol_read(struct emi *e, void *buf, size_t count, uint64_t offset)
+{
+	struct emi_vol *v = e->io_data;
+	size_t done = 0;
+
+	// volume image header
+	if (offset < e->hsize) {
+		size_t hcount = count < e->hsize - offset ? count : e->hsize - offset;
+		int64_t res = v->io->read(&v->desc, buf, hcount, offset);
+		if ((res < 0) || (res < hcount)) {
+			return res;
+		}
+		done = hcount;
+	}
+
+	// member data
+	uint64_t doffset = offset + done - e->hsize;
+	if (doffset >= v->size) {
+		return done;
+	}
+	size_t dcount = count - done;
+	if (dcount > v->size - doffset) {
+		dcount = v->size - doffset;
+	}
+
+	int res = emi_vol_data_io(v, EMI_VOL_READ, (uint8_t*) buf + done, doffset, dcount);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	return done + dcount;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_vol_write(struct emi *e, const void *buf, size_t count, uint64_t offset)
+{
+	struct emi_vol *v = e->io_data;
+	size_t done = 0;
+
+	if (offset < e->hsize) {
+		size_t hcount = count < e->hsize - offset ? count : e->hsize - offset;
+		int64_t res = v->io->write(&v->desc, buf, hcount, offset);
+		if (res != hcount) {
+			return res < 0 ? res : -EMI_E_WRITE;
+		}
+		done = hcount;
+	}
+
+	if (done < count) {
+		uint64_t doffset = offset + done - e->hsize;
+		int res = emi_vol_data_io(v, EMI_VOL_WRITE, (uint8_t*) buf + done, doffset, count - done);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		if (doffset + count - done > v->size) {
+			v->size = doffset + count - done;
+		}
+	}
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_sync(struct emi *e)
+{
+	struct emi_vol *v = e->io_data;
+	int res = v->io->sync(&v->desc);
+
+	for (unsigned i=0 ; i<v->count ; i++) {
+		struct emi *me = v->m[i].e;
+		emi_lock(me);
+		int r = me->io->sync(me);
+		emi_unlock(me);
+		if (r != EMI_E_OK) {
+			res = r;
+		}
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int64_t emi_io_vol_size(struct emi *e)
+{
+	struct emi_vol *v = e->io_data;
+
+	return e->hsize + v->size;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_truncate(struct emi *e, uint64_t size)
+{
+	int res;
+	struct emi_vol *v = e->io_data;
+
+	if (size <= e->hsize) {
+		res = v->io->truncate(&v->desc, size);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		size = e->hsize;
+	}
+
+	uint64_t len = size - e->hsize;
+
+	// member images follow (dropped data reads back as zeros)
+	for (unsigned i=0 ; i<v->count ; i++) {
+		struct emi *me = v->m[i].e;
+		emi_lock(me);
+		res = me->io->truncate(me, me->hsize + emi_vol_member_len(v, i, len));
+		emi_unlock(me);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+	}
+
+	v->size = len;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_io_vol_map(struct emi *e, uint64_t offset, size_t len)
+{
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_discard(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_vol *v = e->io_data;
+
+	if (offset < e->hsize) {
+		if (offset + len <= e->hsize) {
+			return EMI_E_OK;
+		}
+		len -= e->hsize - offset;
+		offset = e->hsize;
+	}
+
+	return emi_vol_data_io(v, EMI_VOL_DISCARD, NULL, offset - e->hsize, len);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_allocate(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_vol *v = e->io_data;
+
+	if (offset < e->hsize) {
+		if (offset + len <= e->hsize) {
+			return EMI_E_OK;
+		}
+		len -= e->hsize - offset;
+		offset = e->hsize;
+	}
+
+	return emi_vol_data_io(v, EMI_VOL_ALLOCATE, NULL, offset - e->hsize, len);
+}
+
+// -----------------------------------------------------------------------
+static int emi_io_vol_fd(struct emi *e)
+{
+	// data is spread over member images
+	return -1;
+}
+
+const struct emi_io emi_io_vol = {
+	"volume",
+	emi_io_vol_open,
+	emi_io_vol_close,
+	emi_io_vol_read,
+	emi_io_vol_write,
+	emi_io_vol_sync,
+	emi_io_vol_size,
+	emi_io_vol_truncate,
+	emi_io_vol_map,
+	emi_io_vol_discard,
+	emi_io_vol_allocate,
+	emi_io_vol_fd,
+};
+
+// -----------------------------------------------------------------------
+// Open volume members and switch the volume image over to the volume
+// backend (image lock held, or image not yet visible to others)
+int emi_vol_attach(struct emi *e, const uint8_t *desc, unsigned len)
+{
+	int res = -EMI_E_VOLUME;
+
+	if ((e->type != EMI_T_DISK) || (len < 2)) {
+		return -EMI_E_VOLUME;
+	}
+
+	unsigned mode = desc[0];
+	unsigned count = desc[1];
+	if (((mode != EMI_VOL_STRIPE) && (mode != EMI_VOL_MIRROR)) || (count < 1) || (count > EMI_VOL_MEMBERS_MAX)) {
+		return -EMI_E_VOLUME;
+	}
+
+	struct emi_vol *v = calloc(1, sizeof(struct emi_vol));
+	if (!v) {
+		return -EMI_E_ALLOC;
+	}
+	v->mode = mode;
+	v->count = count;
+	v->track = (uint64_t) e->spt * e->block_size;
+	v->io = e->io;
+	v->desc.io_data = e->io_data;
+	v->desc.io_flags = e->io_flags;
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->job_cond, NULL);
+	pthread_cond_init(&v->done_cond, NULL);
+
+	uint16_t mcyls = emi_vol_member_cyls(mode, count, e->cylinders, e->heads);
+
+	const uint8_t *name = desc + 2;
+	for (unsigned i=0 ; i<count ; i++) {
+		const uint8_t *nul = memchr(name, '\0', desc + len - name);
+		if (!nul || (nul == name)) {
+			goto fail;
+		}
+		// member names are relative to the volume image
+		char *path = emi_path_rel(e->img_name, (char *) name);
+		if (!path) {
+			res = -EMI_E_ALLOC;
+			goto fail;
+		}
+		struct emi *me = emi_open_private(path, e->io_flags);
+		free(path);
+		if (!me) {
+			goto fail;
+		}
+		v->m[i].e = me;
+		v->m[i].v = v;
+		v->m[i].idx = i;
+		// members are plain disk images of matching geometry
+		if ((me->io == &emi_io_vol) || (me->type != EMI_T_DISK) || (me->cylinders != mcyls) || (me->heads != e->heads) || (me->spt != e->spt) || (me->block_size != e->block_size)) {
+			goto fail;
+		}
+		uint64_t dlen = emi_vol_len(v, i, me->io->size(me) - me->hsize);
+		if (dlen > v->size) {
+			v->size = dlen;
+		}
+		name = nul + 1;
+	}
+
+	if (count > 1) {
+		for (unsigned i=0 ; i<count ; i++) {
+			if (pthread_create(v->thread + i, NULL, emi_vol_worker, v->m + i)) {
+				break;
+			}
+			v->threads++;
+		}
+		// workers are all or nothing
+		if (v->threads < count) {
+			pthread_mutex_lock(&v->lock);
+			v->quit = 1;
+			pthread_cond_broadcast(&v->job_cond);
+			pthread_mutex_unlock(&v->lock);
+			for (unsigned i=0 ; i<v->threads ; i++) {
+				pthread_join(v->thread[i], NULL);
+			}
+			v->threads = 0;
+			v->quit = 0;
+		}
+	}
+
+	e->io = &emi_io_vol;
+	e->io_data = v;
+
+	return EMI_E_OK;
+
+fail:
+	for (unsigned i=0 ; i<count ; i++) {
+		if (v->m[i].e) {
+			emi_close_private(v->m[i].e);
+		}
+	}
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->job_cond);
+	pthread_cond_destroy(&v->done_cond);
+	free(v);
+	return res;
+}
+
+// -----------------------------------------------------------------------
+void emi_vol_print(struct emi *e)
+{
+	struct emi_vol *v = e->io_data;
+
+	printf("Volume       : %s, %u member(s)\n", emi_vol_mode_name(v->mode), v->count);
+	for (unsigned i=0 ; i<v->count ; i++) {
+		printf("  member %-3u : %s\n", i, v->m[i].e->img_name);
+	}
+}
+
+// -----------------------------------------------------------------------
+// Create volume 'img_name' of given disk geometry, along with its
+// 'count' member images, named as given in 'members' (relative to the
+// volume image directory)
+struct emi * emi_volume_create(char *img_name, unsigned mode, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, char **members, unsigned count)
+{
+	int res;
+	unsigned created = 0;
+	struct emi *e = NULL;
+	uint8_t desc[EMI_META_MAX];
+	unsigned len = 2;
+	char *paths[EMI_VOL_MEMBERS_MAX] = { NULL };
+
+	if (((mode != EMI_VOL_STRIPE) && (mode != EMI_VOL_MIRROR)) || (count < 1) || (count > EMI_VOL_MEMBERS_MAX)) {
+		emi_err = -EMI_E_VOLUME;
+		return NULL;
+	}
+	if ((cylinders <= 0) || (heads <= 0) || (spt <= 0) || (block_size <= 0)) {
+		emi_err = -EMI_E_GEOM;
+		return NULL;
+	}
+
+	desc[0] = mode;
+	desc[1] = count;
+	for (unsigned i=0 ; i<count ; i++) {
+		size_t nlen = strlen(members[i]) + 1;
+		if ((nlen == 1) || (len + nlen > sizeof(desc))) {
+			emi_err = -EMI_E_META_SIZE;
+			return NULL;
+		}
+		memcpy(desc + len, members[i], nlen);
+		len += nlen;
+	}
+
+	// members are created next to the volume image
+	for (unsigned i=0 ; i<count ; i++) {
+		paths[i] = emi_path_rel(img_name, members[i]);
+		if (!paths[i]) {
+			res = -EMI_E_ALLOC;
+			goto fail;
+		}
+	}
+
+	uint16_t mcyls = emi_vol_member_cyls(mode, count, cylinders, heads);
+
+	for ( ; created<count ; created++) {
+		struct emi *me = emi_disk_create(paths[created], block_size, mcyls, heads, spt);
+		if (!me) {
+			res = emi_err;
+			goto fail;
+		}
+		emi_close(me);
+	}
+
+	e = emi_disk_create(img_name, block_size, cylinders, heads, spt);
+	if (!e) {
+		res = emi_err;
+		goto fail;
+	}
+
+	res = emi_meta_set(e, EMI_META_VOLUME, desc, len);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	emi_lock(e);
+	res = emi_vol_attach(e, desc, len);
+	emi_unlock(e);
+	if (res != EMI_E_OK) {
+		goto fail;
+	}
+
+	for (unsigned i=0 ; i<count ; i++) {
+		free(paths[i]);
+	}
+
+	return e;
+
+fail:
+	if (e) {
+		emi_close(e);
+		unlink(img_name);
+	}
+	for (unsigned i=0 ; i<created ; i++) {
+		unlink(paths[i]);
+	}
+	for (unsigned i=0 ; i<count ; i++) {
+		free(paths[i]);
+	}
+	emi_err = res;
+	return NULL;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,85 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#ifndef EMI_IO_H
+#define EMI_IO_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "emimg.h"
+
+// Storage backend operations.
+// All offsets are absolute image file offsets.
+//
+//  open     : open existing (create == 0) or create new image file
+//  close    : release all backend resources (e->io_data)
+//  read     : read up to 'count' bytes, returns number of bytes read
+//             (short only at the end of image) or negative error
+//  write    : write 'count' bytes, returns 'count' or negative error
+//  sync     : push written data to stable storage
+//  size     : current image size
+//  truncate : set image size
+//  map      : pointer to image contents at 'offset', or NULL if the backend
+//             can't provide direct access to 'len' bytes there
+//  discard  : tell the backend that data in the range is no longer needed
+//             (contents undefined afterwards, best effort)
+//  allocate : reserve storage for the range, image size doesn't change
+//             (best effort if the filesystem can't do it)
+//  fd       : descriptor of the image file, with all data written so far
+//             there, for file level operations (cloning, copying),
+//             or -1 if image is not kept in a plain file
+
+typedef int (*emi_io_open_f)(struct emi *e, char *img_name, int create);
+typedef void (*emi_io_close_f)(struct emi *e);
+typedef int64_t (*emi_io_read_f)(struct emi *e, void *buf, size_t count, uint64_t offset);
+typedef int64_t (*emi_io_write_f)(struct emi *e, const void *buf, size_t count, uint64_t offset);
+typedef int (*emi_io_sync_f)(struct emi *e);
+typedef int64_t (*emi_io_size_f)(struct emi *e);
+typedef int (*emi_io_truncate_f)(struct emi *e, uint64_t size);
+typedef void * (*emi_io_map_f)(struct emi *e, uint64_t offset, size_t len);
+typedef int (*emi_io_discard_f)(struct emi *e, uint64_t offset, uint64_t len);
+typedef int (*emi_io_allocate_f)(struct emi *e, uint64_t offset, uint64_t len);
+typedef int (*emi_io_fd_f)(struct emi *e);
+
+struct emi_io {
+	const char *name;
+	emi_io_open_f open;
+	emi_io_close_f close;
+	emi_io_read_f read;
+	emi_io_write_f write;
+	emi_io_sync_f sync;
+	emi_io_size_f size;
+	emi_io_truncate_f truncate;
+	emi_io_map_f map;
+	emi_io_discard_f discard;
+	emi_io_allocate_f allocate;
+	emi_io_fd_f fd;
+};
+
+extern const struct emi_io emi_io_stdio;
+extern const struct emi_io emi_io_fd;
+extern const struct emi_io emi_io_mmap;
+extern const struct emi_io emi_io_mem;
+extern const struct emi_io emi_io_vol;
+extern const struct emi_io emi_io_remote;
+extern const struct emi_io emi_io_stream;
+extern const struct emi_io emi_io_bundle;
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,436 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Write journal: image contents from before each disk or magnetic tape
+// write, kept so the image can be stepped back in time.
+//
+// Each journaled write gets the next number. Point N is the image state
+// after write N (point 0: state when the journal was started). Records
+// live in a ring buffer of the size given as the journal budget, the
+// oldest ones are dropped to make room for new ones. Prior contents are
+// stored compressed when it pays off, all-zero contents take no space.
+// After a few blocks that don't compress, compression is not tried for
+// a while, so incompressible data costs no more than a copy.
+//
+// Operations that change the image other way (tape compaction, restoring
+// a checkpoint, applying a patch) drop the journal history.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "emimg.h"
+#include "io.h"
+
+#define EMI_JOURNAL_BUDGET_MIN (64 * 1024)
+// data shorter than that is not worth compressing
+#define EMI_JOURNAL_LZ_MIN 64
+// blocks to skip compressing after one that didn't compress
+#define EMI_JOURNAL_LZ_BACKOFF 16
+
+#define EMI_JOURNAL_ALIGN(x) (((x) + 7) & ~(uint64_t) 7)
+
+enum emi_journal_rec_types {
+	EMI_JOURNAL_PAD,		// skip to the ring start
+	EMI_JOURNAL_RAW,
+	EMI_JOURNAL_LZ,
+	EMI_JOURNAL_ZERO,
+};
+
+struct emi_journal_rec {
+	uint64_t seq;			// write number
+	uint64_t offset;		// image file offset of the data
+	uint64_t pos;			// tape position before the write
+	uint32_t len;			// data length
+	uint32_t size;			// stored data size (data follows the record)
+	uint32_t type;
+};
+
+struct emi_journal {
+	uint8_t *ring;
+	uint64_t ring_size;
+	uint64_t head;			// ring position past the newest record
+	uint64_t tail;			// ring position of the oldest record
+	uint64_t seq;			// newest point
+	uint64_t base;			// oldest point (when there are no records)
+
+	uint8_t *buf;			// prior contents of the write in progress
+	uint8_t *cbuf;			// compression buffer
+	uint32_t buf_size;
+	uint64_t offset;
+	uint32_t len;
+	uint64_t pos;
+	unsigned lz_skip;
+};
+
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+int emi_media_sync(struct emi *e);
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len);
+size_t emi_lz_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+size_t emi_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+
+// -----------------------------------------------------------------------
+// Ring position of the record at or after 'pos' (skipping padding)
+static uint64_t emi_journal_next(struct emi_journal *j, uint64_t pos)
+{
+	uint64_t left = j->ring_size - pos % j->ring_size;
+
+	if ((left < sizeof(struct emi_journal_rec)) || (((struct emi_journal_rec*) (j->ring + pos % j->ring_size))->type == EMI_JOURNAL_PAD)) {
+		pos += left;
+	}
+
+	return pos;
+}
+
+// -----------------------------------------------------------------------
+static struct emi_journal_rec * emi_journal_rec(struct emi_journal *j, uint64_t pos)
+{
+	return (struct emi_journal_rec*) (j->ring + pos % j->ring_size);
+}
+
+// -----------------------------------------------------------------------
+static uint64_t emi_journal_rec_len(struct emi_journal_rec *rec)
+{
+	return sizeof(struct emi_journal_rec) + EMI_JOURNAL_ALIGN(rec->size);
+}
+
+// -----------------------------------------------------------------------
+static void emi_journal_evict(struct emi_journal *j)
+{
+	j->tail = emi_journal_next(j, j->tail);
+	struct emi_journal_rec *rec = emi_journal_rec(j, j->tail);
+	j->base = rec->seq;
+	j->tail += emi_journal_rec_len(rec);
+}
+
+// -----------------------------------------------------------------------
+// Forget all history, image state as it is now is the oldest point
+void emi_journal_reset(struct emi *e)
+{
+	struct emi_journal *j = e->journal;
+
+	if (!j) {
+		return;
+	}
+
+	j->head = j->tail = 0;
+	j->base = j->seq;
+}
+
+// -----------------------------------------------------------------------
+// Get buffer with current image contents at 'offset' (image lock held).
+// Caller may update the contents, then calls emi_journal_commit() before
+// writing 'len' bytes there. Returns NULL if the write can't be
+// journaled (history is lost then).
+uint8_t * emi_journal_prepare(struct emi *e, uint64_t offset, uint64_t len)
+{
+	struct emi_journal *j = e->journal;
+
+	if (len > UINT32_MAX) {
+		goto lost;
+	}
+
+	if (len > j->buf_size) {
+		uint8_t *buf = realloc(j->buf, len);
+		if (buf) j->buf = buf;
+		uint8_t *cbuf = realloc(j->cbuf, len);
+		if (cbuf) j->cbuf = cbuf;
+		if (!buf || !cbuf) {
+			goto lost;
+		}
+		j->buf_size = len;
+	}
+
+	// past the image end there are zeros
+	int64_t res = e->io->read(e, j->buf, len, offset);
+	if (res < 0) {
+		goto lost;
+	}
+	memset(j->buf + res, 0, len - res);
+
+	j->offset = offset;
+	j->len = len;
+	j->pos = e->pos;
+
+	return j->buf;
+
+lost:
+	// the write goes on, history ends with it
+	j->seq++;
+	emi_journal_reset(e);
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+static int emi_journal_zero(uint8_t *buf, uint32_t len)
+{
+	for (uint32_t i=0 ; i<len ; i++) {
+		if (buf[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// -----------------------------------------------------------------------
+// Store prior contents obtained with emi_journal_prepare()
+void emi_journal_commit(struct emi *e)
+{
+	struct emi_journal *j = e->journal;
+	uint32_t type = EMI_JOURNAL_RAW;
+	uint8_t *data = j->buf;
+	uint32_t size = j->len;
+
+	j->seq++;
+
+	if (emi_journal_zero(j->buf, j->len)) {
+		type = EMI_JOURNAL_ZERO;
+		size = 0;
+	} else if (j->lz_skip) {
+		j->lz_skip--;
+	} else if (j->len >= EMI_JOURNAL_LZ_MIN) {
+		size_t clen = emi_lz_compress(j->buf, j->len, j->cbuf, j->len - 1);
+		if (clen) {
+			type = EMI_JOURNAL_LZ;
+			data = j->cbuf;
+			size = clen;
+		} else {
+			j->lz_skip = EMI_JOURNAL_LZ_BACKOFF;
+		}
+	}
+
+	uint64_t len = sizeof(struct emi_journal_rec) + EMI_JOURNAL_ALIGN(size);
+
+	// record that would push out most of the history: history ends here
+	if (len > j->ring_size / 4) {
+		emi_journal_reset(e);
+		return;
+	}
+
+	// record doesn't fit before the ring end, pad up to it
+	uint64_t pad = j->ring_size - j->head % j->ring_size;
+	if (pad >= len) {
+		pad = 0;
+	}
+
+	while (j->head + pad + len - j->tail > j->ring_size) {
+		emi_journal_evict(j);
+	}
+
+	if (pad >= sizeof(struct emi_journal_rec)) {
+		emi_journal_rec(j, j->head)->type = EMI_JOURNAL_PAD;
+	}
+	j->head += pad;
+
+	struct emi_journal_rec *rec = emi_journal_rec(j, j->head);
+	rec->seq = j->seq;
+	rec->offset = j->offset;
+	rec->pos = j->pos;
+	rec->len = j->len;
+	rec->size = size;
+	rec->type = type;
+	memcpy(rec + 1, data, size);
+
+	j->head += len;
+}
+
+// -----------------------------------------------------------------------
+void emi_journal_free(struct emi *e)
+{
+	struct emi_journal *j = e->journal;
+
+	if (!j) {
+		return;
+	}
+
+	free(j->ring);
+	free(j->buf);
+	free(j->cbuf);
+	free(j);
+	e->journal = NULL;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_journal_start(struct emi *e, uint64_t budget)
+{
+	if ((e->type != EMI_T_DISK) && (e->type != EMI_T_MTAPE)) {
+		return -EMI_E_ACCESS;
+	}
+	if (e->journal) {
+		return EMI_E_OK;
+	}
+	if (budget < EMI_JOURNAL_BUDGET_MIN) {
+		budget = EMI_JOURNAL_BUDGET_MIN;
+	}
+
+	struct emi_journal *j = calloc(1, sizeof(struct emi_journal));
+	if (!j) {
+		return -EMI_E_ALLOC;
+	}
+	j->ring_size = EMI_JOURNAL_ALIGN(budget);
+	j->ring = malloc(j->ring_size);
+	if (!j->ring) {
+		free(j);
+		return -EMI_E_ALLOC;
+	}
+
+	e->journal = j;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Start journaling image writes, keeping up to 'budget' bytes of history
+int emi_journal_start(struct emi *e, uint64_t budget)
+{
+	emi_lock(e);
+	int res = __emi_journal_start(e, budget);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Stop journaling, drop the history
+int emi_journal_stop(struct emi *e)
+{
+	emi_lock(e);
+	emi_journal_free(e);
+	emi_unlock(e);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Get the oldest point image can be rewound to and the current one
+int emi_journal_range(struct emi *e, uint64_t *oldest, uint64_t *newest)
+{
+	emi_lock(e);
+
+	struct emi_journal *j = e->journal;
+	if (!j) {
+		emi_unlock(e);
+		return -EMI_E_ACCESS;
+	}
+
+	if (oldest) *oldest = j->base;
+	if (newest) *newest = j->seq;
+
+	emi_unlock(e);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_journal_undo(struct emi *e, struct emi_journal_rec *rec, uint8_t *buf)
+{
+	uint8_t *data = (uint8_t*) (rec + 1);
+
+	switch (rec->type) {
+		case EMI_JOURNAL_ZERO:
+			memset(buf, 0, rec->len);
+			data = buf;
+			break;
+		case EMI_JOURNAL_LZ:
+			if (emi_lz_decompress(data, rec->size, buf, rec->len) != rec->len) {
+				return -EMI_E_READ;
+			}
+			data = buf;
+			break;
+	}
+
+	if (e->io->write(e, data, rec->len, rec->offset) != rec->len) {
+		return -EMI_E_WRITE;
+	}
+	emi_dirty_mark(e, rec->offset - e->hsize, rec->len);
+
+	if (e->type == EMI_T_MTAPE) {
+		e->pos = rec->pos;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_journal_rewind(struct emi *e, uint64_t point)
+{
+	int res = EMI_E_OK;
+	struct emi_journal *j = e->journal;
+
+	if (!j) {
+		return -EMI_E_ACCESS;
+	}
+	if ((point < j->base) || (point > j->seq)) {
+		return -EMI_E_SEEK;
+	}
+	if (point == j->seq) {
+		return EMI_E_OK;
+	}
+
+	// coalesced disk writes go to the image before they get undone
+	res = emi_media_sync(e);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	// ring positions of records to undo
+	uint64_t count = j->seq - point;
+	uint64_t *recs = malloc(count * sizeof(uint64_t));
+	if (!recs) {
+		return -EMI_E_ALLOC;
+	}
+	uint64_t n = 0;
+	for (uint64_t pos = j->tail ; pos < j->head ; ) {
+		pos = emi_journal_next(j, pos);
+		struct emi_journal_rec *rec = emi_journal_rec(j, pos);
+		if (rec->seq > point) {
+			recs[n++] = pos;
+		}
+		pos += emi_journal_rec_len(rec);
+	}
+
+	// newest first
+	while (n > 0) {
+		struct emi_journal_rec *rec = emi_journal_rec(j, recs[n-1]);
+		res = emi_journal_undo(e, rec, j->buf);
+		if (res != EMI_E_OK) {
+			break;
+		}
+		j->head = recs[n-1];
+		j->seq = rec->seq - 1;
+		n--;
+	}
+
+	free(recs);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Bring image back to the state it was in at journal 'point'.
+// Points past it are gone, following writes continue from there.
+int emi_journal_rewind(struct emi *e, uint64_t point)
+{
+	emi_lock(e);
+	int res = __emi_journal_rewind(e, point);
+	emi_unlock(e);
+
+	return res;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
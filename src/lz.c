@@ -0,0 +1,172 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Simple LZ77 block compressor (LZF-style stream format):
+//
+//  000nnnnn                     : literal run of n+1 bytes follows
+//  lllooooo oooooooo            : back reference, length l+2 (l = 1..6)
+//  111ooooo llllllll oooooooo   : back reference, length l+9
+//
+// Offset is stored as (distance - 1), so references reach 8KB back.
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_HLOG		14
+#define LZ_HSIZE	(1 << LZ_HLOG)
+#define LZ_MAX_OFF	(1 << 13)
+#define LZ_MAX_REF	((1 << 8) + (1 << 3))
+#define LZ_MAX_LIT	(1 << 5)
+
+#define LZ_HASH(p) ((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761u) >> (32 - LZ_HLOG))
+
+// -----------------------------------------------------------------------
+// Compress in_len bytes from 'in' into 'out'.
+// Returns compressed length, or 0 if data doesn't fit in out_len bytes.
+size_t emi_lz_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+	uint32_t htab[LZ_HSIZE];
+	size_t ip = 0;
+	size_t op = 1; // room for the first literal run control byte
+	unsigned lit = 0;
+
+	if ((in_len == 0) || (out_len < 2)) {
+		return 0;
+	}
+
+	memset(htab, 0, sizeof(htab));
+
+	while (ip < in_len) {
+		if (ip + 2 < in_len) {
+			uint32_t h = LZ_HASH(in + ip);
+			size_t ref = htab[h];
+			htab[h] = ip + 1;
+
+			// positions are stored +1, 0 means empty slot
+			if (ref && (ip - ref < LZ_MAX_OFF) && !memcmp(in + ref - 1, in + ip, 3)) {
+				ref--;
+				size_t off = ip - ref - 1;
+				size_t maxlen = in_len - ip;
+				size_t len = 3;
+
+				if (maxlen > LZ_MAX_REF) {
+					maxlen = LZ_MAX_REF;
+				}
+				while ((len < maxlen) && (in[ref + len] == in[ip + len])) {
+					len++;
+				}
+
+				if (op + 4 > out_len) {
+					return 0;
+				}
+
+				// close current literal run (or drop its unused control byte)
+				if (lit) {
+					out[op - lit - 1] = lit - 1;
+					lit = 0;
+				} else {
+					op--;
+				}
+
+				len -= 2;
+				if (len < 7) {
+					out[op++] = (off >> 8) + (len << 5);
+				} else {
+					out[op++] = (off >> 8) + (7 << 5);
+					out[op++] = len - 7;
+				}
+				out[op++] = off & 0xff;
+
+				// reserve control byte for the next literal run
+				op++;
+				ip += len + 2;
+				continue;
+			}
+		}
+
+		// literal
+		if (op + 2 > out_len) {
+			return 0;
+		}
+		out[op++] = in[ip++];
+		lit++;
+		if (lit == LZ_MAX_LIT) {
+			out[op - lit - 1] = lit - 1;
+			lit = 0;
+			op++;
+		}
+	}
+
+	if (lit) {
+		out[op - lit - 1] = lit - 1;
+	} else {
+		op--;
+	}
+
+	return op;
+}
+
+// -----------------------------------------------------------------------
+// Decompress in_len bytes from 'in' into 'out'.
+// Returns decompressed length, or 0 on malformed input or output overflow.
+size_t emi_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+	size_t ip = 0;
+	size_t op = 0;
+
+	while (ip < in_len) {
+		unsigned c = in[ip++];
+
+		if (c < LZ_MAX_LIT) {
+			// literal run
+			size_t n = c + 1;
+			if ((ip + n > in_len) || (op + n > out_len)) {
+				return 0;
+			}
+			memcpy(out + op, in + ip, n);
+			ip += n;
+			op += n;
+		} else {
+			// back reference
+			size_t len = c >> 5;
+			if (len == 7) {
+				if (ip >= in_len) {
+					return 0;
+				}
+				len += in[ip++];
+			}
+			if (ip >= in_len) {
+				return 0;
+			}
+			size_t off = ((c & 0x1f) << 8) + in[ip++] + 1;
+			len += 2;
+			if ((off > op) || (op + len > out_len)) {
+				return 0;
+			}
+			// regions may overlap, copy byte by byte
+			uint8_t *ref = out + op - off;
+			while (len--) {
+				out[op++] = *ref++;
+			}
+		}
+	}
+
+	return op;
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -15,12 +15,19 @@
 //  Foundation, Inc.,
 //  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "emimg.h"
+#include "io.h"
 
 enum emi_mtape_block_types {
 	EMI_MT_DATA,
@@ -28,63 +35,194 @@ enum emi_mtape_block_types {
 	EMI_MT_EOT,
 	EMI_MT_EOF,
 	EMI_MT_ERASED,
+	EMI_MT_CDATA,
 	EMI_MT_MAX
 };
 
 struct emi_mtape_header {
 	uint8_t type;
-	uint16_t size;
+	uint32_t size;
 };
 
-#define EM_MT_HDR_SIZE sizeof(struct emi_mtape_header)
+// v2.0 block header: type (1), size (2), unused (1)
+#define EMI_MT_HDR_SIZE_V20 4
+#define EMI_MT_BLOCK_MAX_V20 0xffff
+// v2.1 and v3 block header: type (1), reserved (3), size (4)
+#define EMI_MT_HDR_SIZE_V21 8
+#define EMI_MT_BLOCK_MAX_V21 0x7fffffff
+
+#define EMI_MT_HDR_WIDE(e) (((e)->v_major > 2) || (e)->v_minor)
+#define EMI_MT_HDR_SIZE(e) (EMI_MT_HDR_WIDE(e) ? EMI_MT_HDR_SIZE_V21 : EMI_MT_HDR_SIZE_V20)
+#define EMI_MT_BLOCK_MAX(e) (EMI_MT_HDR_WIDE(e) ? EMI_MT_BLOCK_MAX_V21 : EMI_MT_BLOCK_MAX_V20)
+
+// compressed block payload: original size (4), compressed data
+#define EMI_MT_CDATA_HDR_SIZE 4
+
+#define EMI_MT_COPY_BUF_SIZE (1024 * 1024)
+#define EMI_MT_COMPACT_SUFFIX ".compact"
+
+// tape check: window for reading block headers, compressed blocks
+// waiting for verification, verifying threads
+#define EMI_MT_CHECK_WINDOW (256 * 1024)
+#define EMI_MT_CHECK_QUEUE 1024
+#define EMI_MT_CHECK_THREADS_MAX 8
+
+struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags);
+void emi_lock(struct emi *e);
+uint8_t * emi_journal_prepare(struct emi *e, uint64_t offset, uint64_t len);
+void emi_journal_commit(struct emi *e);
+void emi_journal_reset(struct emi *e);
+int emi_registry_rename(struct emi *e, char *new_name);
+void emi_unlock(struct emi *e);
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len);
+void emi_hot_mark(struct emi *e, uint64_t offset, uint64_t len);
+int emi_writer_active(struct emi *e);
+int emi_writer_mtape_write(struct emi *e, const uint8_t *buf, unsigned size);
+int emi_writer_mtape_write_eof(struct emi *e);
+size_t emi_lz_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+size_t emi_lz_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+
+static int __emi_mtape_bot(struct emi *e);
 
-struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint32_t len, uint32_t flags);
+// -----------------------------------------------------------------------
+static void emi_mtape_header_parse(struct emi *e, const uint8_t *pos, struct emi_mtape_header *hdr)
+{
+	hdr->type = *pos; pos += 1;
+	if (EMI_MT_HDR_WIDE(e)) {
+		pos += 3;
+		hdr->size = ntohl(*(uint32_t*)pos); pos += 4;
+	} else {
+		hdr->size = ntohs(*(uint16_t*)pos); pos += 2;
+	}
+}
 
 // -----------------------------------------------------------------------
-static int emi_mtape_header_read(struct emi *e, struct emi_mtape_header *hdr)
+static int emi_mtape_header_read(struct emi *e, uint64_t offset, struct emi_mtape_header *hdr)
 {
-	if (fread(e->hbuf, 1, EM_MT_HDR_SIZE, e->image) != EM_MT_HDR_SIZE) {
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	if (e->io->read(e, e->hbuf, hsize, offset) != hsize) {
 		return -EMI_E_HEADER_READ;
 	}
 
-	uint8_t *pos = e->hbuf;
-	hdr->type = *pos; pos += 1;
-	hdr->size = ntohs(*(uint16_t*)pos); pos += 2;
+	emi_mtape_header_parse(e, e->hbuf, hdr);
 
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-static int emi_mtape_header_write(struct emi *e, struct emi_mtape_header *hdr)
+static int emi_mtape_header_write(struct emi *e, uint64_t offset, struct emi_mtape_header *hdr)
 {
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	memset(e->hbuf, 0, hsize);
 	uint8_t *pos = e->hbuf;
 	*pos = hdr->type; pos += 1;
-	*(uint16_t*)pos = htons(hdr->size); pos += 2;
+	if (EMI_MT_HDR_WIDE(e)) {
+		pos += 3;
+		*(uint32_t*)pos = htonl(hdr->size); pos += 4;
+	} else {
+		*(uint16_t*)pos = htons(hdr->size); pos += 2;
+	}
 
-	if (fwrite(e->hbuf, 1, EM_MT_HDR_SIZE, e->image) != EM_MT_HDR_SIZE) {
+	if (e->io->write(e, e->hbuf, hsize, offset) != hsize) {
 		return -EMI_E_HEADER_WRITE;
 	}
 
+	emi_dirty_mark(e, offset - e->hsize, hsize);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Read header of the block at current position, skipping over erased gaps
+static int emi_mtape_header_read_next(struct emi *e, struct emi_mtape_header *hdr)
+{
+	int res;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	while (1) {
+		res = emi_mtape_header_read(e, e->pos, hdr);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		if (hdr->type != EMI_MT_ERASED) {
+			break;
+		}
+		e->pos += hsize + hdr->size + hsize;
+	}
+
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
 static int emi_mtape_full(struct emi *e)
 {
-	long pos = ftell(e->image);
-	if (pos > e->len) {
+	if (e->pos > e->len) {
 		return 1;
 	}
 	return 0;
 }
 
 // -----------------------------------------------------------------------
+static int emi_mtape_cbuf_alloc(struct emi *e, uint32_t size)
+{
+	if (e->cbuf_size >= size) {
+		return EMI_E_OK;
+	}
+
+	uint8_t *cbuf = realloc(e->cbuf, size);
+	if (!cbuf) {
+		return -EMI_E_ALLOC;
+	}
+
+	e->cbuf = cbuf;
+	e->cbuf_size = size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Compress block data into e->cbuf, return payload size or 0 if block
+// doesn't compress well enough to be worth storing compressed.
+static uint32_t emi_mtape_compress(struct emi *e, uint8_t *buf, unsigned size)
+{
+	size_t clen;
+
+	if (size <= EMI_MT_CDATA_HDR_SIZE) {
+		return 0;
+	}
+	if (emi_mtape_cbuf_alloc(e, size) != EMI_E_OK) {
+		return 0;
+	}
+
+	// payload larger than the data itself is of no use
+	clen = emi_lz_compress(buf, size, e->cbuf + EMI_MT_CDATA_HDR_SIZE, size - EMI_MT_CDATA_HDR_SIZE);
+	if (clen == 0) {
+		return 0;
+	}
+
+	*(uint32_t*)e->cbuf = htonl(size);
+
+	return EMI_MT_CDATA_HDR_SIZE + clen;
+}
+
+// -----------------------------------------------------------------------
+void emi_mtape_close(struct emi *e)
+{
+	free(e->cbuf);
+	e->cbuf = NULL;
+	e->cbuf_size = 0;
+}
+
+// -----------------------------------------------------------------------
+// Media driver open (image lock held)
 int emi_mtape_open(struct emi *e)
 {
 	int res;
 
 	// seek to tape start
-	res = emi_mtape_bot(e);
+	res = __emi_mtape_bot(e);
 	if (res != EMI_E_OK) {
 		return res;
 	}
@@ -93,14 +231,19 @@ int emi_mtape_open(struct emi *e)
 }
 
 // -----------------------------------------------------------------------
-struct emi * emi_mtape_create(char *img_name, uint32_t size)
+struct emi * emi_mtape_create(char *img_name, uint64_t size, uint32_t flags)
 {
 	struct emi *e;
 	int res;
 	struct emi_mtape_header hdr;
 
+	if (flags & ~EMI_COMPRESSED) {
+		emi_err = -EMI_E_FLAGS;
+		return NULL;
+	}
+
 	// create image
-	e = emi_create(img_name, EMI_T_MTAPE, 0, 0, 0, 0, size, 0);
+	e = emi_create(img_name, EMI_T_MTAPE, 0, 0, 0, 0, size, flags);
 	if (!e) {
 		return NULL;
 	}
@@ -108,7 +251,7 @@ struct emi * emi_mtape_create(char *img_name, uint32_t size)
 	// write BOT block
 	hdr.type = EMI_MT_BOT;
 	hdr.size = 0;
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->hsize, &hdr);
 	if (res != EMI_E_OK) {
 		emi_err = res;
 		emi_close(e);
@@ -117,7 +260,7 @@ struct emi * emi_mtape_create(char *img_name, uint32_t size)
 
 	// write EOT block
 	hdr.type = EMI_MT_EOT;
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->hsize + EMI_MT_HDR_SIZE(e), &hdr);
 	if (res != EMI_E_OK) {
 		emi_err = res;
 		emi_close(e);
@@ -136,34 +279,62 @@ struct emi * emi_mtape_create(char *img_name, uint32_t size)
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_read(struct emi *e, uint8_t *buf)
+// Read next block into 'buf' of 'size' bytes. Block that doesn't fit
+// is left in place.
+static int __emi_mtape_read(struct emi *e, uint8_t *buf, unsigned size)
 {
 	int res;
 	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+	uint32_t len;
 
 	if (e->type != EMI_T_MTAPE) {
 		return -EMI_E_ACCESS;
 	}
 
 	// read block header
-	res = emi_mtape_header_read(e, &hdr);
+	res = emi_mtape_header_read_next(e, &hdr);
 	if (res != EMI_E_OK) {
 		return res;
 	}
 
 	switch (hdr.type) {
 		case EMI_MT_DATA:
-			res = fread(buf, 1, hdr.size, e->image);
-			if (res != hdr.size) {
+			if (hdr.size > size) {
+				return -EMI_E_BLOCK_SIZE;
+			}
+			if (e->io->read(e, buf, hdr.size, e->pos + hsize) != hdr.size) {
 				return -EMI_E_READ;
 			}
+			len = hdr.size;
+			emi_hot_mark(e, e->pos - e->hsize, hsize + hdr.size + hsize);
 			// skip to next block start
-			res = fseek(e->image, EM_MT_HDR_SIZE, SEEK_CUR);
-			if (res < 0) {
-				return -EMI_E_SEEK;
+			e->pos += hsize + hdr.size + hsize;
+			break;
+		case EMI_MT_CDATA:
+			if (hdr.size < EMI_MT_CDATA_HDR_SIZE) {
+				return -EMI_E_READ;
 			}
+			res = emi_mtape_cbuf_alloc(e, hdr.size);
+			if (res != EMI_E_OK) {
+				return res;
+			}
+			if (e->io->read(e, e->cbuf, hdr.size, e->pos + hsize) != hdr.size) {
+				return -EMI_E_READ;
+			}
+			len = ntohl(*(uint32_t*)e->cbuf);
+			if (len > size) {
+				return -EMI_E_BLOCK_SIZE;
+			}
+			if (emi_lz_decompress(e->cbuf + EMI_MT_CDATA_HDR_SIZE, hdr.size - EMI_MT_CDATA_HDR_SIZE, buf, len) != len) {
+				return -EMI_E_READ;
+			}
+			emi_hot_mark(e, e->pos - e->hsize, hsize + hdr.size + hsize);
+			// skip to next block start
+			e->pos += hsize + hdr.size + hsize;
 			break;
 		case EMI_MT_EOF:
+			e->pos += hsize;
 			return -EMI_E_EOF;
 		case EMI_MT_BOT:
 			return -EMI_E_BOT;
@@ -173,14 +344,39 @@ int emi_mtape_read(struct emi *e, uint8_t *buf)
 			return -EMI_E_READ;
 	}
 
-	return hdr.size;
+	return len;
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size)
+// Read next block into 'buf', which needs to fit the largest block
+// written to the tape
+int emi_mtape_read(struct emi *e, uint8_t *buf)
+{
+	emi_lock(e);
+	int res = __emi_mtape_read(e, buf, UINT_MAX);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Read next block into 'buf' of 'size' bytes. Blocks larger than that
+// fail with EMI_E_BLOCK_SIZE, with tape position left at the block.
+int emi_mtape_read_buf(struct emi *e, uint8_t *buf, unsigned size)
+{
+	emi_lock(e);
+	int res = __emi_mtape_read(e, buf, size);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size)
 {
 	int res;
 	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
 
 	if (e->type != EMI_T_MTAPE) {
 		return -EMI_E_ACCESS;
@@ -190,6 +386,10 @@ int emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size)
 		return -EMI_E_WRPROTECT;
 	}
 
+	if (size > EMI_MT_BLOCK_MAX(e)) {
+		return -EMI_E_BLOCK_SIZE;
+	}
+
 	// tape full?
 	if (emi_mtape_full(e)) {
 		return -EMI_E_EOT;
@@ -198,43 +398,71 @@ int emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size)
 	hdr.type = EMI_MT_DATA;
 	hdr.size = size;
 
+	// store compressed if it pays off
+	if (e->flags & EMI_COMPRESSED) {
+		uint32_t csize = emi_mtape_compress(e, buf, size);
+		if (csize) {
+			hdr.type = EMI_MT_CDATA;
+			hdr.size = csize;
+			buf = e->cbuf;
+		}
+	}
+
+	// block and the EOT marker past it
+	if (e->journal && emi_journal_prepare(e, e->pos, hsize + hdr.size + hsize + hsize)) {
+		emi_journal_commit(e);
+	}
+
 	// write header
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->pos, &hdr);
 	if (res != EMI_E_OK) {
 		return -EMI_E_WRITE;
 	}
 
 	// write data
-	res = fwrite(buf, 1, hdr.size, e->image);
-	if (res != hdr.size) {
+	if (e->io->write(e, buf, hdr.size, e->pos + hsize) != hdr.size) {
 		return -EMI_E_WRITE;
 	}
+	emi_dirty_mark(e, e->pos + hsize - e->hsize, hdr.size);
 
 	// write footer
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->pos + hsize + hdr.size, &hdr);
 	if (res != EMI_E_OK) {
 		return -EMI_E_WRITE;
 	}
 
-	// write EOT
+	e->pos += hsize + hdr.size + hsize;
+
+	// write EOT, but stay before it
 	hdr.type = EMI_MT_EOT;
 	hdr.size = 0;
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->pos, &hdr);
 	if (res != EMI_E_OK) {
 		return -EMI_E_WRITE;
 	}
 
-	// rewind before EOT
-	res = fseek(e->image, -EM_MT_HDR_SIZE, SEEK_CUR);
-	if (res < 0) {
-		return -EMI_E_SEEK;
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_mtape_write(struct emi *e, uint8_t *buf, unsigned size)
+{
+	if (emi_writer_active(e)) {
+		int res = emi_writer_mtape_write(e, buf, size);
+		if (res <= 0) {
+			return res;
+		}
 	}
 
-	return EMI_E_OK;
+	emi_lock(e);
+	int res = __emi_mtape_write(e, buf, size);
+	emi_unlock(e);
+
+	return res;
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_write_eof(struct emi *e)
+static int __emi_mtape_write_eof(struct emi *e)
 {
 	int res;
 	struct emi_mtape_header hdr;
@@ -252,18 +480,25 @@ int emi_mtape_write_eof(struct emi *e)
 		return -EMI_E_WRPROTECT;
 	}
 
+	// tape mark and the EOT marker past it
+	if (e->journal && emi_journal_prepare(e, e->pos, EMI_MT_HDR_SIZE(e) * 2)) {
+		emi_journal_commit(e);
+	}
+
 	// write header
 	hdr.type = EMI_MT_EOF;
 	hdr.size = 0;
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->pos, &hdr);
 	if (res != EMI_E_OK) {
 		return -EMI_E_WRITE;
 	}
 
+	e->pos += EMI_MT_HDR_SIZE(e);
+
 	// write EOT
 	hdr.type = EMI_MT_EOT;
 	hdr.size = 0;
-	res = emi_mtape_header_write(e, &hdr);
+	res = emi_mtape_header_write(e, e->pos, &hdr);
 	if (res != EMI_E_OK) {
 		return -EMI_E_WRITE;
 	}
@@ -272,37 +507,47 @@ int emi_mtape_write_eof(struct emi *e)
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_fwd(struct emi *e)
+int emi_mtape_write_eof(struct emi *e)
+{
+	if (emi_writer_active(e)) {
+		return emi_writer_mtape_write_eof(e);
+	}
+
+	emi_lock(e);
+	int res = __emi_mtape_write_eof(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_fwd(struct emi *e)
 {
 	int res;
 	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
 
 	if (e->type != EMI_T_MTAPE) {
 		return -EMI_E_ACCESS;
 	}
 
 	// read block header
-	res = emi_mtape_header_read(e, &hdr);
+	res = emi_mtape_header_read_next(e, &hdr);
 	if (res != EMI_E_OK) {
 		return res;
 	}
 
 	switch (hdr.type) {
 		case EMI_MT_DATA:
+		case EMI_MT_CDATA:
 			// skip to next block header
-			res = fseek(e->image, hdr.size + EM_MT_HDR_SIZE, SEEK_CUR);
-			if (res < 0) {
-				return -EMI_E_SEEK;
-			}
+			e->pos += hsize + hdr.size + hsize;
 			break;
 		case EMI_MT_EOF:
+			e->pos += hsize;
 			break;
 		case EMI_MT_EOT:
-			// skip back to EOT block header
-			res = fseek(e->image, -EM_MT_HDR_SIZE, SEEK_CUR);
-			if (res < 0) {
-				return -EMI_E_SEEK;
-			}
+			// stay at EOT block header
 			return -EMI_E_EOT;
 		case EMI_MT_BOT:
 			// shouldn't happen
@@ -313,24 +558,885 @@ int emi_mtape_fwd(struct emi *e)
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_rew(struct emi *e)
+int emi_mtape_fwd(struct emi *e)
+{
+	emi_lock(e);
+	int res = __emi_mtape_fwd(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_erase(struct emi *e)
 {
 	int res;
 	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
 
-	// skip to previous block footer
-	res = fseek(e->image, -EM_MT_HDR_SIZE, SEEK_CUR);
-	if (res < 0) {
-		return -EMI_E_SEEK;
+	if (e->type != EMI_T_MTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	if (e->flags & EMI_WRPROTECT) {
+		return -EMI_E_WRPROTECT;
+	}
+
+	// read block header
+	res = emi_mtape_header_read_next(e, &hdr);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	switch (hdr.type) {
+		case EMI_MT_DATA:
+		case EMI_MT_CDATA:
+			break;
+		case EMI_MT_EOF:
+			return -EMI_E_EOF;
+		case EMI_MT_BOT:
+			return -EMI_E_BOT;
+		case EMI_MT_EOT:
+			return -EMI_E_EOT;
+		default:
+			return -EMI_E_READ;
+	}
+
+	// erased data gets discarded, keep all of it
+	if (e->journal && emi_journal_prepare(e, e->pos, hsize + hdr.size + hsize)) {
+		emi_journal_commit(e);
+	}
+
+	// turn the block into an erased gap of the same length
+	hdr.type = EMI_MT_ERASED;
+	res = emi_mtape_header_write(e, e->pos, &hdr);
+	if (res != EMI_E_OK) {
+		return -EMI_E_WRITE;
+	}
+	res = emi_mtape_header_write(e, e->pos + hsize + hdr.size, &hdr);
+	if (res != EMI_E_OK) {
+		return -EMI_E_WRITE;
+	}
+
+	// erased data is of no use anymore
+	e->io->discard(e, e->pos + hsize, hdr.size);
+
+	e->pos += hsize + hdr.size + hsize;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_mtape_erase(struct emi *e)
+{
+	emi_lock(e);
+	int res = __emi_mtape_erase(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Move 'len' bytes from image offset 'src' down to 'dst' (dst <= src)
+static int emi_mtape_move(struct emi *e, uint64_t dst, uint64_t src, uint64_t len, uint8_t *buf)
+{
+	if (dst == src) {
+		return EMI_E_OK;
 	}
 
-	// read block footer
-	res = emi_mtape_header_read(e, &hdr);
+	while (len > 0) {
+		size_t chunk = len > EMI_MT_COPY_BUF_SIZE ? EMI_MT_COPY_BUF_SIZE : len;
+		if (e->io->read(e, buf, chunk, src) != chunk) {
+			return -EMI_E_READ;
+		}
+		if (e->io->write(e, buf, chunk, dst) != chunk) {
+			return -EMI_E_WRITE;
+		}
+		emi_dirty_mark(e, dst - e->hsize, chunk);
+		src += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Copy 'len' bytes from image offset 'src' to offset 'dst' of file 'fd'
+static int emi_mtape_copy_out(struct emi *e, int fd, uint64_t dst, uint64_t src, uint64_t len, uint8_t *buf)
+{
+	while (len > 0) {
+		size_t chunk = len > EMI_MT_COPY_BUF_SIZE ? EMI_MT_COPY_BUF_SIZE : len;
+		if (e->io->read(e, buf, chunk, src) != chunk) {
+			return -EMI_E_READ;
+		}
+		if (pwrite(fd, buf, chunk, dst) != chunk) {
+			return -EMI_E_WRITE;
+		}
+		src += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Switch image storage over to the compacted file and put it in place
+static int emi_mtape_compact_swap(struct emi *e, char *tmp_name)
+{
+	void *old_io_data = e->io_data;
+
+	// storage is opened before the rename, so it always follows the compacted file
+	e->io_data = NULL;
+	int res = e->io->open(e, tmp_name, 0);
+	void *new_io_data = e->io_data;
+	e->io_data = old_io_data;
 	if (res != EMI_E_OK) {
 		return res;
 	}
 
-	int seek = 0;
+	res = emi_registry_rename(e, tmp_name);
+	if (res != EMI_E_OK) {
+		e->io_data = new_io_data;
+		e->io->close(e);
+		e->io_data = old_io_data;
+		return res;
+	}
+
+	e->io->close(e);
+	e->io_data = new_io_data;
+
+	// whole tape moved, next checkpoint has to be a full one
+	free(e->ckpt);
+	e->ckpt = NULL;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_compact(struct emi *e)
+{
+	int res;
+	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+	uint64_t offset, out_offset, new_pos, len;
+	uint8_t *buf = NULL;
+	char *tmp_name = NULL;
+	int fd = -1;
+
+	if (e->type != EMI_T_MTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	if (e->flags & EMI_WRPROTECT) {
+		return -EMI_E_WRPROTECT;
+	}
+
+	// Image served by emimgd can't be replaced under its other clients,
+	// nor can its blocks be moved safely in place
+	if (e->io == &emi_io_remote) {
+		return -EMI_E_ACCESS;
+	}
+
+	buf = malloc(EMI_MT_COPY_BUF_SIZE);
+	if (!buf) {
+		return -EMI_E_ALLOC;
+	}
+
+	// Local image files are compacted into a new file that replaces the old
+	// one only when complete. Blocks are moved down in place only for images
+	// kept in memory, where a crash can't leave a half-moved tape behind.
+	if (e->img_name && (e->io != &emi_io_mem)) {
+		tmp_name = malloc(strlen(e->img_name) + strlen(EMI_MT_COMPACT_SUFFIX) + 1);
+		if (!tmp_name) {
+			res = -EMI_E_ALLOC;
+			goto fin;
+		}
+		sprintf(tmp_name, "%s%s", e->img_name, EMI_MT_COMPACT_SUFFIX);
+		fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			res = -EMI_E_OPEN;
+			goto fin;
+		}
+	}
+
+	// blocks move, there is no going back
+	emi_journal_reset(e);
+
+	// image header and BOT stay as they are
+	offset = out_offset = new_pos = e->hsize + hsize;
+	if (fd >= 0) {
+		res = emi_mtape_copy_out(e, fd, 0, 0, offset, buf);
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+	}
+
+	// move live blocks down over the gaps, one streaming pass up to EOT
+	while (1) {
+		if (offset == e->pos) {
+			new_pos = out_offset;
+		}
+		res = emi_mtape_header_read(e, offset, &hdr);
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+		if (hdr.type == EMI_MT_EOT) {
+			len = hsize;
+		} else {
+			switch (hdr.type) {
+				case EMI_MT_DATA:
+				case EMI_MT_CDATA:
+					len = hsize + hdr.size + hsize;
+					break;
+				case EMI_MT_EOF:
+					len = hsize;
+					break;
+				case EMI_MT_ERASED:
+					offset += hsize + hdr.size + hsize;
+					continue;
+				default:
+					res = -EMI_E_READ;
+					goto fin;
+			}
+		}
+		if (fd >= 0) {
+			res = emi_mtape_copy_out(e, fd, out_offset, offset, len, buf);
+		} else {
+			res = emi_mtape_move(e, out_offset, offset, len, buf);
+		}
+		if (res != EMI_E_OK) {
+			goto fin;
+		}
+		if (hdr.type == EMI_MT_EOT) {
+			break;
+		}
+		offset += len;
+		out_offset += len;
+	}
+
+	if (e->pos > offset) {
+		new_pos = out_offset;
+	}
+
+	if (fd >= 0) {
+		// compacted tape has to be on disk before it replaces the old one
+		if (fsync(fd)) {
+			res = -EMI_E_WRITE;
+			goto fin;
+		}
+		res = emi_mtape_compact_swap(e, tmp_name);
+	} else {
+		// anything past EOT is stale
+		res = e->io->truncate(e, out_offset + hsize);
+	}
+	if (res != EMI_E_OK) {
+		goto fin;
+	}
+
+	e->pos = new_pos;
+
+fin:
+	if (fd >= 0) {
+		close(fd);
+		if (res != EMI_E_OK) {
+			unlink(tmp_name);
+		}
+	}
+	free(tmp_name);
+	free(buf);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_mtape_compact(struct emi *e)
+{
+	emi_lock(e);
+	int res = __emi_mtape_compact(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static const char *emi_mtape_fault_descs[] = {
+/* none */				"no fault",
+/* EMI_MTF_NO_BOT */	"no BOT marker at tape start",
+/* EMI_MTF_BOT */		"BOT marker past tape start",
+/* EMI_MTF_TYPE */		"unknown block type",
+/* EMI_MTF_SIZE */		"block size out of range",
+/* EMI_MTF_HEADER */	"image ends inside block header",
+/* EMI_MTF_DATA */		"image ends inside block data",
+/* EMI_MTF_FOOTER */	"block footer doesn't match its header",
+/* EMI_MTF_CDATA */		"compressed block data is corrupt",
+/* EMI_MTF_LEN */		"block written past tape length",
+/* EMI_MTF_NO_EOT */	"tape ends without EOT marker",
+/* EMI_MTF_MAX */		"unknown fault"
+};
+
+// -----------------------------------------------------------------------
+const char * emi_mtape_fault_desc(int fault)
+{
+	if ((fault < 0) || (fault >= EMI_MTF_MAX)) {
+		return emi_mtape_fault_descs[EMI_MTF_MAX];
+	} else {
+		return emi_mtape_fault_descs[fault];
+	}
+}
+
+struct emi_mtape_checker {
+	struct emi *e;
+	struct emi_mtape_check *c;
+	pthread_mutex_t io_lock;	// backends don't have to handle concurrent I/O
+	pthread_mutex_t lock;		// queue and check results
+	pthread_cond_t cond;
+	struct {
+		uint64_t offset;
+		uint32_t size;
+	} queue[EMI_MT_CHECK_QUEUE];	// compressed blocks waiting for verification
+	unsigned head;
+	unsigned tail;
+	int done;					// no more blocks will be queued
+	unsigned threads;			// verifying threads running
+	int res;					// first I/O failure
+	uint8_t *win;				// block headers window
+	uint64_t win_offset;
+	size_t win_len;
+	size_t win_read;			// window fill size
+};
+
+struct emi_mtape_check_buf {
+	uint8_t *in;
+	uint32_t in_size;
+	uint8_t *out;
+	uint32_t out_size;
+};
+
+// -----------------------------------------------------------------------
+// Record fault at block 'offset' (checker lock held). Faults first
+// on tape are kept.
+static void emi_mtape_fault_add(struct emi_mtape_check *c, uint64_t offset, int fault)
+{
+	unsigned count = c->fault_count < EMI_MTAPE_CHECK_FAULTS ? c->fault_count : EMI_MTAPE_CHECK_FAULTS;
+	unsigned i = count;
+
+	c->fault_count++;
+
+	while ((i > 0) && (c->faults[i-1].offset > offset)) {
+		i--;
+	}
+	if (i >= EMI_MTAPE_CHECK_FAULTS) {
+		return;
+	}
+	if (count == EMI_MTAPE_CHECK_FAULTS) {
+		count--;
+	}
+
+	memmove(c->faults + i + 1, c->faults + i, (count - i) * sizeof(c->faults[0]));
+	c->faults[i].offset = offset;
+	c->faults[i].fault = fault;
+}
+
+// -----------------------------------------------------------------------
+static void emi_mtape_check_fault(struct emi_mtape_checker *k, uint64_t offset, int fault)
+{
+	pthread_mutex_lock(&k->lock);
+	emi_mtape_fault_add(k->c, offset, fault);
+	pthread_mutex_unlock(&k->lock);
+}
+
+// -----------------------------------------------------------------------
+static int emi_mtape_check_buf_alloc(uint8_t **buf, uint32_t *buf_size, uint32_t size)
+{
+	if (*buf_size >= size) {
+		return EMI_E_OK;
+	}
+
+	uint8_t *b = realloc(*buf, size);
+	if (!b) {
+		return -EMI_E_ALLOC;
+	}
+
+	*buf = b;
+	*buf_size = size;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Check that compressed block at 'offset' decompresses to its original
+// size. Returns EMI_E_OK, fault or negative error.
+static int emi_mtape_check_cdata(struct emi_mtape_checker *k, uint64_t offset, uint32_t size, struct emi_mtape_check_buf *b)
+{
+	int res;
+	struct emi *e = k->e;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	const uint8_t *data = e->io->map(e, offset + hsize, size);
+	if (!data) {
+		res = emi_mtape_check_buf_alloc(&b->in, &b->in_size, size);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		pthread_mutex_lock(&k->io_lock);
+		int64_t len = e->io->read(e, b->in, size, offset + hsize);
+		pthread_mutex_unlock(&k->io_lock);
+		if (len != size) {
+			return -EMI_E_READ;
+		}
+		data = b->in;
+	}
+
+	uint32_t orig = ntohl(*(uint32_t*)data);
+	if (orig > EMI_MT_BLOCK_MAX(e)) {
+		return EMI_MTF_CDATA;
+	}
+	res = emi_mtape_check_buf_alloc(&b->out, &b->out_size, orig ? orig : 1);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+	if (emi_lz_decompress(data + EMI_MT_CDATA_HDR_SIZE, size - EMI_MT_CDATA_HDR_SIZE, b->out, orig) != orig) {
+		return EMI_MTF_CDATA;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_mtape_check_thread(void *ptr)
+{
+	struct emi_mtape_checker *k = ptr;
+	struct emi_mtape_check_buf b = { NULL, 0, NULL, 0 };
+
+	pthread_mutex_lock(&k->lock);
+	while (1) {
+		if (k->head == k->tail) {
+			if (k->done) {
+				break;
+			}
+			pthread_cond_wait(&k->cond, &k->lock);
+			continue;
+		}
+		uint64_t offset = k->queue[k->tail % EMI_MT_CHECK_QUEUE].offset;
+		uint32_t size = k->queue[k->tail % EMI_MT_CHECK_QUEUE].size;
+		k->tail++;
+		// there is space in queue now
+		pthread_cond_broadcast(&k->cond);
+		pthread_mutex_unlock(&k->lock);
+
+		int res = emi_mtape_check_cdata(k, offset, size, &b);
+
+		pthread_mutex_lock(&k->lock);
+		if (res > 0) {
+			emi_mtape_fault_add(k->c, offset, res);
+		} else if ((res < 0) && (k->res == EMI_E_OK)) {
+			k->res = res;
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+
+	free(b.in);
+	free(b.out);
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Get 'count' bytes at image 'offset': directly if backend has them
+// mapped, through the window (filled with large reads) otherwise
+static const uint8_t * emi_mtape_check_get(struct emi_mtape_checker *k, uint64_t offset, unsigned count)
+{
+	struct emi *e = k->e;
+
+	const uint8_t *data = e->io->map(e, offset, count);
+	if (data) {
+		return data;
+	}
+
+	if ((offset >= k->win_offset) && (offset + count <= k->win_offset + k->win_len)) {
+		return k->win + (offset - k->win_offset);
+	}
+
+	pthread_mutex_lock(&k->io_lock);
+	int64_t len = e->io->read(e, k->win, k->win_read, offset);
+	pthread_mutex_unlock(&k->io_lock);
+	if (len < (int64_t) count) {
+		k->win_len = 0;
+		return NULL;
+	}
+
+	k->win_offset = offset;
+	k->win_len = len;
+
+	return k->win;
+}
+
+// -----------------------------------------------------------------------
+// Follow the block chain from BOT up to EOT (or the first break in the
+// chain). Compressed blocks are handed over to verifying threads.
+static int emi_mtape_check_walk(struct emi_mtape_checker *k, uint64_t size, struct emi_mtape_check_buf *b)
+{
+	struct emi *e = k->e;
+	struct emi_mtape_check *c = k->c;
+	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+	uint8_t header[EMI_MT_HDR_SIZE_V21];
+	uint64_t offset = e->hsize;
+	const uint8_t *data;
+
+	while (1) {
+		if (offset + hsize > size) {
+			if (offset == e->hsize) {
+				emi_mtape_check_fault(k, offset, EMI_MTF_NO_BOT);
+			} else {
+				emi_mtape_check_fault(k, offset, offset == size ? EMI_MTF_NO_EOT : EMI_MTF_HEADER);
+			}
+			return EMI_E_OK;
+		}
+		data = emi_mtape_check_get(k, offset, hsize);
+		if (!data) {
+			return -EMI_E_READ;
+		}
+		emi_mtape_header_parse(e, data, &hdr);
+
+		if (offset == e->hsize) {
+			if (hdr.type != EMI_MT_BOT) {
+				emi_mtape_check_fault(k, offset, EMI_MTF_NO_BOT);
+				return EMI_E_OK;
+			}
+			offset += hsize;
+			continue;
+		}
+
+		switch (hdr.type) {
+			case EMI_MT_DATA:
+			case EMI_MT_CDATA:
+			case EMI_MT_ERASED:
+				break;
+			case EMI_MT_EOF:
+				if (e->len && (offset > e->len)) {
+					emi_mtape_check_fault(k, offset, EMI_MTF_LEN);
+				}
+				c->marks++;
+				offset += hsize;
+				continue;
+			case EMI_MT_EOT:
+				c->eot = offset;
+				c->trailing = size - (offset + hsize);
+				return EMI_E_OK;
+			case EMI_MT_BOT:
+				emi_mtape_check_fault(k, offset, EMI_MTF_BOT);
+				return EMI_E_OK;
+			default:
+				emi_mtape_check_fault(k, offset, EMI_MTF_TYPE);
+				return EMI_E_OK;
+		}
+
+		if ((hdr.size > EMI_MT_BLOCK_MAX(e)) || ((hdr.type == EMI_MT_CDATA) && (hdr.size < EMI_MT_CDATA_HDR_SIZE))) {
+			emi_mtape_check_fault(k, offset, EMI_MTF_SIZE);
+			return EMI_E_OK;
+		}
+		uint64_t footer = offset + hsize + hdr.size;
+		if (footer + hsize > size) {
+			emi_mtape_check_fault(k, offset, EMI_MTF_DATA);
+			return EMI_E_OK;
+		}
+
+		// footer is a copy of the header (window may move when reading it)
+		memcpy(header, data, hsize);
+		data = emi_mtape_check_get(k, footer, hsize);
+		if (!data) {
+			return -EMI_E_READ;
+		}
+		if (memcmp(header, data, hsize)) {
+			emi_mtape_check_fault(k, offset, EMI_MTF_FOOTER);
+			return EMI_E_OK;
+		}
+
+		// blocks (including erased ones) are written only before tape end
+		if (e->len && (offset > e->len)) {
+			emi_mtape_check_fault(k, offset, EMI_MTF_LEN);
+		}
+
+		if (hdr.type == EMI_MT_ERASED) {
+			c->erased++;
+		} else {
+			c->blocks++;
+		}
+
+		if (hdr.type == EMI_MT_CDATA) {
+			if (k->threads) {
+				pthread_mutex_lock(&k->lock);
+				while (k->head - k->tail == EMI_MT_CHECK_QUEUE) {
+					pthread_cond_wait(&k->cond, &k->lock);
+				}
+				k->queue[k->head % EMI_MT_CHECK_QUEUE].offset = offset;
+				k->queue[k->head % EMI_MT_CHECK_QUEUE].size = hdr.size;
+				k->head++;
+				pthread_cond_broadcast(&k->cond);
+				pthread_mutex_unlock(&k->lock);
+			} else {
+				int res = emi_mtape_check_cdata(k, offset, hdr.size, b);
+				if (res < 0) {
+					return res;
+				} else if (res > 0) {
+					emi_mtape_check_fault(k, offset, res);
+				}
+			}
+		}
+
+		offset = footer + hsize;
+
+		// large blocks are most likely followed by large blocks:
+		// don't read data that is skipped anyway
+		k->win_read = hdr.size > EMI_MT_CHECK_WINDOW / 4 ? EMI_MT_CHECK_WINDOW / 64 : EMI_MT_CHECK_WINDOW;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Put EOT marker at 'offset', dropping the rest of the tape
+static int emi_mtape_cut(struct emi *e, uint64_t offset)
+{
+	int res;
+	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	// data is gone, there is no going back
+	emi_journal_reset(e);
+
+	hdr.size = 0;
+
+	// nothing is left, tape needs BOT too
+	if (offset < e->hsize + hsize) {
+		hdr.type = EMI_MT_BOT;
+		res = emi_mtape_header_write(e, e->hsize, &hdr);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		offset = e->hsize + hsize;
+	}
+
+	hdr.type = EMI_MT_EOT;
+	res = emi_mtape_header_write(e, offset, &hdr);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	res = e->io->truncate(e, offset + hsize);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	e->pos = e->hsize + hsize;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_check(struct emi *e, struct emi_mtape_check *c, int truncate)
+{
+	int res;
+	pthread_t threads[EMI_MT_CHECK_THREADS_MAX];
+	struct emi_mtape_check_buf b = { NULL, 0, NULL, 0 };
+
+	if (e->type != EMI_T_MTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	if (truncate && (e->flags & EMI_WRPROTECT)) {
+		return -EMI_E_WRPROTECT;
+	}
+
+	memset(c, 0, sizeof(struct emi_mtape_check));
+
+	int64_t size = e->io->size(e);
+	if (size < 0) {
+		return size;
+	}
+
+	struct emi_mtape_checker *k = calloc(1, sizeof(struct emi_mtape_checker));
+	if (!k) {
+		return -EMI_E_ALLOC;
+	}
+	k->win = malloc(EMI_MT_CHECK_WINDOW);
+	if (!k->win) {
+		free(k);
+		return -EMI_E_ALLOC;
+	}
+	k->win_read = EMI_MT_CHECK_WINDOW;
+	k->e = e;
+	k->c = c;
+	k->res = EMI_E_OK;
+	pthread_mutex_init(&k->io_lock, NULL);
+	pthread_mutex_init(&k->lock, NULL);
+	pthread_cond_init(&k->cond, NULL);
+
+	// only compressed blocks have data that can be verified
+	if (e->flags & EMI_COMPRESSED) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		unsigned count = cpus > 0 ? cpus : 1;
+		if (count > EMI_MT_CHECK_THREADS_MAX) {
+			count = EMI_MT_CHECK_THREADS_MAX;
+		}
+		while ((k->threads < count) && !pthread_create(threads + k->threads, NULL, emi_mtape_check_thread, k)) {
+			k->threads++;
+		}
+	}
+
+	res = emi_mtape_check_walk(k, size, &b);
+
+	pthread_mutex_lock(&k->lock);
+	k->done = 1;
+	pthread_cond_broadcast(&k->cond);
+	pthread_mutex_unlock(&k->lock);
+	for (unsigned i=0 ; i<k->threads ; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if (res == EMI_E_OK) {
+		res = k->res;
+	}
+
+	// cut the tape at the first fault
+	if ((res == EMI_E_OK) && truncate && c->fault_count) {
+		res = emi_mtape_cut(e, c->faults[0].offset);
+	}
+
+	pthread_cond_destroy(&k->cond);
+	pthread_mutex_destroy(&k->lock);
+	pthread_mutex_destroy(&k->io_lock);
+	free(b.in);
+	free(b.out);
+	free(k->win);
+	free(k);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Check tape structure: block chain from BOT to EOT, block footers,
+// compressed block data and tape length. With 'truncate' set, tape is
+// cut at the first fault found (EOT marker gets written there).
+int emi_mtape_check(struct emi *e, struct emi_mtape_check *c, int truncate)
+{
+	emi_lock(e);
+	int res = __emi_mtape_check(e, c, truncate);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Copy tape contents to another (freshly created) tape image, rewriting
+// block headers in destination image format. Erased blocks are dropped.
+int emi_mtape_copy(struct emi *src, struct emi *dst)
+{
+	int res;
+	struct emi_mtape_header hdr;
+	unsigned src_hsize = EMI_MT_HDR_SIZE(src);
+	unsigned dst_hsize = EMI_MT_HDR_SIZE(dst);
+	uint64_t in = src->hsize;
+	uint64_t out = dst->hsize;
+	uint8_t *buf = NULL;
+	uint32_t buf_size = 0;
+
+	while (1) {
+		res = emi_mtape_header_read(src, in, &hdr);
+		if (res != EMI_E_OK) {
+			break;
+		}
+		switch (hdr.type) {
+			case EMI_MT_DATA:
+			case EMI_MT_CDATA:
+				if (hdr.size > EMI_MT_BLOCK_MAX(dst)) {
+					res = -EMI_E_BLOCK_SIZE;
+					goto fin;
+				}
+				if (hdr.size > buf_size) {
+					uint8_t *nbuf = realloc(buf, hdr.size);
+					if (!nbuf) {
+						res = -EMI_E_ALLOC;
+						goto fin;
+					}
+					buf = nbuf;
+					buf_size = hdr.size;
+				}
+				if (src->io->read(src, buf, hdr.size, in + src_hsize) != hdr.size) {
+					res = -EMI_E_READ;
+					goto fin;
+				}
+				if (dst->io->write(dst, buf, hdr.size, out + dst_hsize) != hdr.size) {
+					res = -EMI_E_WRITE;
+					goto fin;
+				}
+				res = emi_mtape_header_write(dst, out, &hdr);
+				if (res != EMI_E_OK) {
+					goto fin;
+				}
+				res = emi_mtape_header_write(dst, out + dst_hsize + hdr.size, &hdr);
+				if (res != EMI_E_OK) {
+					goto fin;
+				}
+				in += src_hsize + hdr.size + src_hsize;
+				out += dst_hsize + hdr.size + dst_hsize;
+				break;
+			case EMI_MT_ERASED:
+				in += src_hsize + hdr.size + src_hsize;
+				break;
+			case EMI_MT_BOT:
+			case EMI_MT_EOF:
+			case EMI_MT_EOT:
+				res = emi_mtape_header_write(dst, out, &hdr);
+				if (res != EMI_E_OK) {
+					goto fin;
+				}
+				if (hdr.type == EMI_MT_EOT) {
+					goto fin;
+				}
+				in += src_hsize;
+				out += dst_hsize;
+				break;
+			default:
+				res = -EMI_E_READ;
+				goto fin;
+		}
+	}
+
+fin:
+	free(buf);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_mtape_rew(struct emi *e)
+{
+	int res;
+	struct emi_mtape_header hdr;
+	unsigned hsize = EMI_MT_HDR_SIZE(e);
+
+	uint64_t seek = 0;
+
+	// read previous block footer, skipping over erased gaps
+	while (1) {
+		if (e->pos < e->hsize + hsize) {
+			return -EMI_E_SEEK;
+		}
+		res = emi_mtape_header_read(e, e->pos - hsize, &hdr);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		if (hdr.type != EMI_MT_ERASED) {
+			break;
+		}
+		seek = hsize + hdr.size + hsize;
+		if (seek > e->pos - e->hsize) {
+			return -EMI_E_SEEK;
+		}
+		e->pos -= seek;
+	}
 
 	switch (hdr.type) {
 		case EMI_MT_BOT:
@@ -339,35 +1445,51 @@ int emi_mtape_rew(struct emi *e)
 			// shouldn't happen
 			return -EMI_E_EOT;
 		case EMI_MT_EOF:
-			seek = EM_MT_HDR_SIZE;
+			seek = hsize;
 			break;
 		case EMI_MT_DATA:
+		case EMI_MT_CDATA:
 			// + data block
-			seek = EM_MT_HDR_SIZE + hdr.size + EM_MT_HDR_SIZE;
+			seek = hsize + hdr.size + hsize;
 			break;
 	}
 
 	// skip to previous block start
-	res = fseek(e->image, -seek, SEEK_CUR);
-	if (res < 0) {
+	if (seek > e->pos - e->hsize) {
 		return -EMI_E_SEEK;
 	}
+	e->pos -= seek;
 
 	return EMI_E_OK;
 }
 
 // -----------------------------------------------------------------------
-int emi_mtape_bot(struct emi *e)
+int emi_mtape_rew(struct emi *e)
 {
-	int res;
+	emi_lock(e);
+	int res = __emi_mtape_rew(e);
+	emi_unlock(e);
+
+	return res;
+}
 
+// -----------------------------------------------------------------------
+static int __emi_mtape_bot(struct emi *e)
+{
 	// seek to tape start
-	res = fseek(e->image, EMI_HEADER_SIZE+EM_MT_HDR_SIZE, SEEK_SET);
-	if (res < 0) {
-		return -EMI_E_SEEK;
-	}
+	e->pos = e->hsize + EMI_MT_HDR_SIZE(e);
 
 	return EMI_E_OK;
 }
 
+// -----------------------------------------------------------------------
+int emi_mtape_bot(struct emi *e)
+{
+	emi_lock(e);
+	int res = __emi_mtape_bot(e);
+	emi_unlock(e);
+
+	return res;
+}
+
 // vim: tabstop=4 shiftwidth=4 autoindent
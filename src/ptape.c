@@ -15,22 +15,114 @@
 //  Foundation, Inc.,
 //  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
+#define _XOPEN_SOURCE 500
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "emimg.h"
+#include "io.h"
+
+#define EMI_PT_BUF_SIZE (64 * 1024)
+
+struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint64_t len, uint32_t flags);
+struct emi * emi_open_stream(int fd, unsigned mode, uint16_t type, int raw);
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+void emi_dirty_mark(struct emi *e, uint64_t offset, uint64_t len);
+int emi_writer_active(struct emi *e);
+int emi_writer_ptape_write(struct emi *e, const uint8_t *buf, unsigned size);
+
+// -----------------------------------------------------------------------
+static int emi_ptape_flush(struct emi *e)
+{
+	if (!e->pbuf_dirty) {
+		return EMI_E_OK;
+	}
+
+	if (e->io->write(e, e->pbuf, e->pbuf_len, e->hsize + e->pbuf_pos) != e->pbuf_len) {
+		return -EMI_E_WRITE;
+	}
+	emi_dirty_mark(e, e->pbuf_pos, e->pbuf_len);
+
+	e->pbuf_dirty = 0;
 
-struct emi * emi_create(char *img_name, uint16_t type, uint16_t block_size, uint16_t cylinders, uint8_t heads, uint8_t spt, uint32_t len, uint32_t flags);
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static int emi_ptape_fill(struct emi *e)
+{
+	int res;
+	uint64_t len;
+
+	res = emi_ptape_flush(e);
+	if (res != EMI_E_OK) {
+		return res;
+	}
+
+	e->pbuf_pos = e->pos;
+	e->pbuf_len = 0;
+
+	len = e->len - e->pos;
+	if (len > EMI_PT_BUF_SIZE) {
+		len = EMI_PT_BUF_SIZE;
+	}
+
+	if (e->io->read(e, e->pbuf, len, e->hsize + e->pos) != len) {
+		return -EMI_E_READ;
+	}
+
+	e->pbuf_len = len;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_ptape_open(struct emi *e)
+{
+	e->pbuf = malloc(EMI_PT_BUF_SIZE);
+	if (!e->pbuf) {
+		return -EMI_E_ALLOC;
+	}
+	e->pbuf_pos = 0;
+	e->pbuf_len = 0;
+	e->pbuf_dirty = 0;
+	e->pos = 0;
+
+	// trust the data actually present over header
+	int64_t size = e->io->size(e);
+	if (size < 0) {
+		return size;
+	}
+	if ((size > e->hsize) && (size - e->hsize > e->len)) {
+		e->len = size - e->hsize;
+	}
+
+	return EMI_E_OK;
+}
 
 // -----------------------------------------------------------------------
 void emi_ptape_close(struct emi *e)
 {
+	if (e->pbuf) {
+		emi_ptape_flush(e);
+		free(e->pbuf);
+		e->pbuf = NULL;
+	}
+
 	if (e->len != 0)  {
 		e->flags |= EMI_USED;
 	}
 }
 
+// -----------------------------------------------------------------------
+int emi_ptape_sync(struct emi *e)
+{
+	return emi_ptape_flush(e);
+}
+
 // -----------------------------------------------------------------------
 struct emi * emi_ptape_create(char *img_name)
 {
@@ -42,34 +134,149 @@ struct emi * emi_ptape_create(char *img_name)
 		return NULL;
 	}
 
+	if (emi_ptape_open(e) != EMI_E_OK) {
+		emi_err = -EMI_E_ALLOC;
+		emi_close(e);
+		return NULL;
+	}
+
 	return e;
 }
 
 // -----------------------------------------------------------------------
-int emi_ptape_read(struct emi *e)
+// Open punched tape on a pipe, FIFO, terminal, etc. for reading (EMI_RO)
+// or punching (EMI_WO). Tape being read may start with the image header,
+// unless EMI_PT_RAW is given. Punched tape gets the image header (with
+// length of 0) unless EMI_PT_RAW is given. Tape can't be rewound, its
+// length grows as it's read or punched. 'fd' is not closed by emi_close().
+struct emi * emi_ptape_stream(int fd, unsigned mode, unsigned flags)
+{
+	struct emi *e = emi_open_stream(fd, mode, EMI_T_PTAPE, flags & EMI_PT_RAW);
+	if (!e) {
+		return NULL;
+	}
+
+	if (e->type != EMI_T_PTAPE) {
+		emi_err = -EMI_E_IMG_TYPE;
+		emi_close(e);
+		return NULL;
+	}
+
+	// length in header (if any) doesn't matter, stream ends when it ends
+	e->pos = 0;
+	e->len = 0;
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+// Stream data is buffered by the storage backend already
+static int emi_ptape_stream_read(struct emi *e, uint8_t *buf, unsigned size)
+{
+	int64_t res = e->io->read(e, buf, size, e->hsize + e->pos);
+	if (res < 0) {
+		return res;
+	}
+	if (res == 0) {
+		return -EMI_E_EOF;
+	}
+
+	e->pos += res;
+	if (e->pos > e->len) {
+		e->len = e->pos;
+	}
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int __emi_ptape_read_buf(struct emi *e, uint8_t *buf, unsigned size)
 {
 	int res;
-	uint8_t data;
+	unsigned done = 0;
 
 	if (e->type != EMI_T_PTAPE) {
 		return -EMI_E_ACCESS;
 	}
 
-	res = fread(&data, 1, 1, e->image);
-	if (res != 1) {
-		if (feof(e->image)) {
-			return -EMI_E_EOF;
+	if (e->io == &emi_io_stream) {
+		return emi_ptape_stream_read(e, buf, size);
+	}
+
+	if (e->pos >= e->len) {
+		return -EMI_E_EOF;
+	}
+
+	// don't read past the end of tape
+	if (size > e->len - e->pos) {
+		size = e->len - e->pos;
+	}
+
+	while (done < size) {
+		unsigned chunk = size - done;
+
+		// data not in buffer
+		if ((e->pos < e->pbuf_pos) || (e->pos >= e->pbuf_pos + e->pbuf_len)) {
+			// large transfers go directly to the caller
+			if (chunk >= EMI_PT_BUF_SIZE) {
+				res = emi_ptape_flush(e);
+				if (res != EMI_E_OK) {
+					return res;
+				}
+				if (e->io->read(e, buf + done, chunk, e->hsize + e->pos) != chunk) {
+					return -EMI_E_READ;
+				}
+				e->pos += chunk;
+				done += chunk;
+				break;
+			}
+			res = emi_ptape_fill(e);
+			if (res != EMI_E_OK) {
+				return res;
+			}
 		}
-		return -EMI_E_READ;
+
+		unsigned avail = e->pbuf_pos + e->pbuf_len - e->pos;
+		if (chunk > avail) {
+			chunk = avail;
+		}
+		memcpy(buf + done, e->pbuf + (e->pos - e->pbuf_pos), chunk);
+		e->pos += chunk;
+		done += chunk;
+	}
+
+	return done;
+}
+
+// -----------------------------------------------------------------------
+int emi_ptape_read_buf(struct emi *e, uint8_t *buf, unsigned size)
+{
+	emi_lock(e);
+	int res = __emi_ptape_read_buf(e, buf, size);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_ptape_read(struct emi *e)
+{
+	int res;
+	uint8_t data;
+
+	res = emi_ptape_read_buf(e, &data, 1);
+	if (res < 0) {
+		return res;
 	}
 
 	return data;
 }
 
 // -----------------------------------------------------------------------
-int emi_ptape_write(struct emi *e, uint8_t data)
+static int __emi_ptape_write_buf(struct emi *e, uint8_t *buf, unsigned size)
 {
 	int res;
+	unsigned done = 0;
 
 	if (e->type != EMI_T_PTAPE) {
 		return -EMI_E_ACCESS;
@@ -79,15 +286,159 @@ int emi_ptape_write(struct emi *e, uint8_t data)
 		return -EMI_E_WRPROTECT;
 	}
 
-	// write data
-	res = fwrite(&data, 1, 1, e->image);
-	if (res != 1) {
-		return -EMI_E_WRITE;
+	if (e->io == &emi_io_stream) {
+		res = e->io->write(e, buf, size, e->hsize + e->pos);
+		if (res < 0) {
+			return res;
+		}
+		e->pos += size;
+		e->len = e->pos;
+		return EMI_E_OK;
 	}
 
-	e->len += 1;
+	// large transfers go directly to the image
+	if (size >= EMI_PT_BUF_SIZE) {
+		res = emi_ptape_flush(e);
+		if (res != EMI_E_OK) {
+			return res;
+		}
+		e->pbuf_len = 0;
+		if (e->io->write(e, buf, size, e->hsize + e->pos) != size) {
+			return -EMI_E_WRITE;
+		}
+		emi_dirty_mark(e, e->pos, size);
+		done = size;
+		e->pos += size;
+	}
+
+	while (done < size) {
+		// buffer has to cover current position, restart it if it doesn't
+		if ((e->pos < e->pbuf_pos) || (e->pos > e->pbuf_pos + e->pbuf_len) || (e->pos == e->pbuf_pos + EMI_PT_BUF_SIZE)) {
+			res = emi_ptape_flush(e);
+			if (res != EMI_E_OK) {
+				return res;
+			}
+			e->pbuf_pos = e->pos;
+			e->pbuf_len = 0;
+		}
+
+		unsigned offset = e->pos - e->pbuf_pos;
+		unsigned chunk = size - done;
+		if (chunk > EMI_PT_BUF_SIZE - offset) {
+			chunk = EMI_PT_BUF_SIZE - offset;
+		}
+		memcpy(e->pbuf + offset, buf + done, chunk);
+		if (offset + chunk > e->pbuf_len) {
+			e->pbuf_len = offset + chunk;
+		}
+		e->pbuf_dirty = 1;
+		e->pos += chunk;
+		done += chunk;
+	}
+
+	if (e->pos > e->len) {
+		e->len = e->pos;
+	}
 
 	return EMI_E_OK;
 }
 
+// -----------------------------------------------------------------------
+int emi_ptape_write_buf(struct emi *e, uint8_t *buf, unsigned size)
+{
+	if (emi_writer_active(e)) {
+		int res = emi_writer_ptape_write(e, buf, size);
+		if (res <= 0) {
+			return res;
+		}
+	}
+
+	emi_lock(e);
+	int res = __emi_ptape_write_buf(e, buf, size);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_ptape_write(struct emi *e, uint8_t data)
+{
+	return emi_ptape_write_buf(e, &data, 1);
+}
+
+// -----------------------------------------------------------------------
+static int __emi_ptape_seek(struct emi *e, uint64_t pos)
+{
+	if (e->type != EMI_T_PTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	// stream can only be moved forward (skipping or leaving blank tape)
+	if (e->io == &emi_io_stream) {
+		if (pos < e->pos) {
+			return -EMI_E_SEEK;
+		}
+		e->pos = pos;
+		return EMI_E_OK;
+	}
+
+	if (pos > e->len) {
+		return -EMI_E_SEEK;
+	}
+
+	e->pos = pos;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_ptape_seek(struct emi *e, uint64_t pos)
+{
+	emi_lock(e);
+	int res = __emi_ptape_seek(e, pos);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int64_t __emi_ptape_pos(struct emi *e)
+{
+	if (e->type != EMI_T_PTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	return e->pos;
+}
+
+// -----------------------------------------------------------------------
+int64_t emi_ptape_pos(struct emi *e)
+{
+	emi_lock(e);
+	int64_t res = __emi_ptape_pos(e);
+	emi_unlock(e);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+static int64_t __emi_ptape_len(struct emi *e)
+{
+	if (e->type != EMI_T_PTAPE) {
+		return -EMI_E_ACCESS;
+	}
+
+	return e->len;
+}
+
+// -----------------------------------------------------------------------
+int64_t emi_ptape_len(struct emi *e)
+{
+	emi_lock(e);
+	int64_t res = __emi_ptape_len(e);
+	emi_unlock(e);
+
+	return res;
+}
+
 // vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,90 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+#ifndef EMI_REMOTE_H
+#define EMI_REMOTE_H
+
+#include <inttypes.h>
+
+// emimgd protocol.
+//
+// Each image opened with EMI_IO_REMOTE gets its own connection to the
+// daemon's UNIX socket. Daemon accepts only connections from its own
+// user and serves only files in its root directory. On connect, daemon
+// sends a hello response along with a shared memory buffer descriptor
+// (SCM_RIGHTS). Client then sends requests, one at a time, each answered
+// with a response. Request and response headers go through the socket,
+// data (image name, read and written data) through the shared buffer,
+// at most its size at a time.
+//
+//  OPEN     : open image file (absolute name in buffer, 'len' bytes),
+//             'flags' = create (file must not exist yet)
+//  READ     : read 'len' bytes at 'offset' into buffer, res = bytes read
+//  WRITE    : write 'len' bytes at 'offset' from buffer, res = bytes written
+//  SYNC     : push image data to stable storage
+//  SIZE     : res = image size
+//  TRUNCATE : set image size to 'offset'
+//  DISCARD  : data range no longer needed
+//  ALLOCATE : reserve storage for the data range
+//
+// Negative 'res' is an EMI_E_* error.
+//
+// Clients keep their own copies of the image header, so daemon lets only
+// one client at a time change a file (WRITE, TRUNCATE, DISCARD, ALLOCATE).
+// The first one to do so holds the file until it disconnects. Others get
+// EMI_E_WRPROTECT, and so do clients that opened the file before the last
+// writer disconnected, as their header copy may be out of date.
+
+// socket: $EMIMGD_SOCKET, $XDG_RUNTIME_DIR/emimgd.sock or emimgd.sock
+// in a private per-user directory in /tmp
+#define EMI_REMOTE_SOCKET		"emimgd.sock"
+#define EMI_REMOTE_SOCKET_DIR	"/tmp/emimgd-%u"
+#define EMI_REMOTE_SOCKET_ENV	"EMIMGD_SOCKET"
+#define EMI_REMOTE_SHM_SIZE		(1024 * 1024)
+#define EMI_REMOTE_MAGIC		0x45344944	// "E4ID"
+
+enum emi_remote_ops {
+	EMI_REMOTE_OPEN = 1,
+	EMI_REMOTE_READ,
+	EMI_REMOTE_WRITE,
+	EMI_REMOTE_SYNC,
+	EMI_REMOTE_SIZE,
+	EMI_REMOTE_TRUNCATE,
+	EMI_REMOTE_DISCARD,
+	EMI_REMOTE_ALLOCATE,
+};
+
+struct emi_remote_req {
+	uint32_t op;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t len;
+};
+
+struct emi_remote_resp {
+	uint32_t magic;
+	uint32_t shm_size;		// hello only
+	int64_t res;
+};
+
+int emi_remote_send(int fd, const void *buf, size_t len);
+int emi_remote_recv(int fd, void *buf, size_t len);
+int emi_remote_socket(char *buf, size_t len);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,549 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Tape sets: magnetic tape spanning several volume images, with an
+// autoloader switching volumes at the end of tape.
+//
+// Set catalog is an empty, write-protected magnetic tape image. Its
+// EMI_META_TAPESET entry describes the set: volume size (8), volume
+// flags (4), volume count (2). Volumes are magnetic tape images named
+// after the catalog: <catalog>.000, <catalog>.001, ...
+//
+// Writing past the end of the last volume appends a new one to the set.
+// Next volume is created and preallocated by a background thread as soon
+// as writing reaches the last volume, so switching costs no more than
+// opening a file. Writing to an earlier volume leaves the following ones
+// in place (like tapes left in the magazine), reading goes on into them.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "emimg.h"
+
+#define EMI_TAPESET_DESC_SIZE 14
+#define EMI_TAPESET_VOLUMES_MAX 0xffff
+
+struct emi_tapeset {
+	struct emi *cat;		// set catalog
+	uint64_t vol_size;
+	uint32_t vol_flags;
+	unsigned count;			// number of volumes
+	unsigned vol;			// loaded volume
+	struct emi *e;			// loaded volume image
+	pthread_mutex_t lock;
+
+	// next volume, prepared in background
+	pthread_t spare_thread;
+	int spare_pending;
+	struct emi *spare;
+	int spare_res;
+};
+
+// -----------------------------------------------------------------------
+static uint64_t emi_tapeset_get64(uint8_t *pos)
+{
+	return ((uint64_t) ntohl(*(uint32_t*)pos) << 32) | ntohl(*(uint32_t*)(pos+4));
+}
+
+// -----------------------------------------------------------------------
+static void emi_tapeset_put64(uint8_t *pos, uint64_t v)
+{
+	*(uint32_t*)pos = htonl(v >> 32);
+	*(uint32_t*)(pos+4) = htonl(v & 0xffffffff);
+}
+
+// -----------------------------------------------------------------------
+// Volume image name, to be freed by the caller
+static char * emi_tapeset_vol_name(struct emi_tapeset *ts, unsigned vol)
+{
+	size_t len = strlen(ts->cat->img_name) + 16;
+	char *name = malloc(len);
+	if (name) {
+		snprintf(name, len, "%s.%03u", ts->cat->img_name, vol);
+	}
+
+	return name;
+}
+
+// -----------------------------------------------------------------------
+// Write set description into the catalog
+static int emi_tapeset_desc_write(struct emi_tapeset *ts)
+{
+	uint8_t desc[EMI_TAPESET_DESC_SIZE];
+
+	emi_tapeset_put64(desc, ts->vol_size);
+	*(uint32_t*)(desc+8) = htonl(ts->vol_flags);
+	*(uint16_t*)(desc+12) = htons(ts->count);
+
+	return emi_meta_set(ts->cat, EMI_META_TAPESET, desc, sizeof(desc));
+}
+
+// -----------------------------------------------------------------------
+static int emi_tapeset_desc_read(struct emi_tapeset *ts)
+{
+	uint8_t desc[EMI_TAPESET_DESC_SIZE];
+
+	int len = emi_meta_get(ts->cat, EMI_META_TAPESET, desc, sizeof(desc));
+	if (len < 0) {
+		return -EMI_E_VOLUME;
+	}
+	if (len != sizeof(desc)) {
+		return -EMI_E_META;
+	}
+
+	ts->vol_size = emi_tapeset_get64(desc);
+	ts->vol_flags = ntohl(*(uint32_t*)(desc+8));
+	ts->count = ntohs(*(uint16_t*)(desc+12));
+
+	if (ts->count < 1) {
+		return -EMI_E_VOLUME;
+	}
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Create and preallocate volume 'vol'
+static struct emi * emi_tapeset_vol_create(struct emi_tapeset *ts, unsigned vol)
+{
+	char *name = emi_tapeset_vol_name(ts, vol);
+	if (!name) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	struct emi *e = emi_mtape_create(name, ts->vol_size, ts->vol_flags);
+	if (e) {
+		int res = emi_preallocate(e, 0);
+		if (res != EMI_E_OK) {
+			emi_close(e);
+			unlink(name);
+			emi_err = res;
+			e = NULL;
+		}
+	}
+
+	free(name);
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+static void * emi_tapeset_spare_thread(void *ptr)
+{
+	struct emi_tapeset *ts = ptr;
+
+	ts->spare = emi_tapeset_vol_create(ts, ts->count);
+	ts->spare_res = ts->spare ? EMI_E_OK : emi_err;
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Start preparing next volume, if there is none on the way
+static void emi_tapeset_spare_start(struct emi_tapeset *ts)
+{
+	if (ts->spare_pending || (ts->count >= EMI_TAPESET_VOLUMES_MAX)) {
+		return;
+	}
+
+	ts->spare = NULL;
+	ts->spare_res = EMI_E_OK;
+	if (!pthread_create(&ts->spare_thread, NULL, emi_tapeset_spare_thread, ts)) {
+		ts->spare_pending = 1;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Wait for the next volume to be ready, create it if it's not on the way
+static struct emi * emi_tapeset_spare_get(struct emi_tapeset *ts)
+{
+	if (ts->count >= EMI_TAPESET_VOLUMES_MAX) {
+		emi_err = -EMI_E_EOT;
+		return NULL;
+	}
+
+	if (!ts->spare_pending) {
+		return emi_tapeset_vol_create(ts, ts->count);
+	}
+
+	pthread_join(ts->spare_thread, NULL);
+	ts->spare_pending = 0;
+
+	if (!ts->spare) {
+		emi_err = ts->spare_res;
+	}
+
+	return ts->spare;
+}
+
+// -----------------------------------------------------------------------
+// Drop volume prepared in advance, but not used
+static void emi_tapeset_spare_drop(struct emi_tapeset *ts)
+{
+	if (!ts->spare_pending) {
+		return;
+	}
+
+	pthread_join(ts->spare_thread, NULL);
+	ts->spare_pending = 0;
+
+	if (ts->spare) {
+		char *name = emi_tapeset_vol_name(ts, ts->count);
+		emi_close(ts->spare);
+		if (name) {
+			unlink(name);
+			free(name);
+		}
+		ts->spare = NULL;
+	}
+}
+
+// -----------------------------------------------------------------------
+static int __emi_tapeset_load(struct emi_tapeset *ts, unsigned vol)
+{
+	if (vol >= ts->count) {
+		return -EMI_E_VOLUME;
+	}
+
+	if (ts->e && (ts->vol == vol)) {
+		return emi_mtape_bot(ts->e);
+	}
+
+	char *name = emi_tapeset_vol_name(ts, vol);
+	if (!name) {
+		return -EMI_E_ALLOC;
+	}
+
+	struct emi *e = emi_open_io(name, ts->cat->io_flags);
+	free(name);
+	if (!e) {
+		return emi_err;
+	}
+	if (e->type != EMI_T_MTAPE) {
+		emi_close(e);
+		return -EMI_E_IMG_TYPE;
+	}
+
+	if (ts->e) {
+		emi_close(ts->e);
+	}
+	ts->e = e;
+	ts->vol = vol;
+
+	return emi_mtape_bot(e);
+}
+
+// -----------------------------------------------------------------------
+// Load volume 'vol' and rewind it to BOT
+int emi_tapeset_load(struct emi_tapeset *ts, unsigned vol)
+{
+	pthread_mutex_lock(&ts->lock);
+	int res = __emi_tapeset_load(ts, vol);
+	pthread_mutex_unlock(&ts->lock);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Switch to the next volume at EOT. When 'append' is set, past the last
+// volume a new one is added to the set.
+static int emi_tapeset_next(struct emi_tapeset *ts, int append)
+{
+	int res;
+
+	if (ts->vol + 1 < ts->count) {
+		return __emi_tapeset_load(ts, ts->vol + 1);
+	}
+
+	if (!append) {
+		return -EMI_E_EOT;
+	}
+
+	struct emi *e = emi_tapeset_spare_get(ts);
+	if (!e) {
+		return emi_err;
+	}
+
+	ts->spare = NULL;
+	ts->count++;
+	res = emi_tapeset_desc_write(ts);
+	if (res != EMI_E_OK) {
+		ts->count--;
+		char *name = emi_tapeset_vol_name(ts, ts->count);
+		emi_close(e);
+		if (name) {
+			unlink(name);
+			free(name);
+		}
+		return res;
+	}
+
+	emi_close(ts->e);
+	ts->e = e;
+	ts->vol = ts->count - 1;
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+static struct emi_tapeset * emi_tapeset_alloc(struct emi *cat)
+{
+	struct emi_tapeset *ts = calloc(1, sizeof(struct emi_tapeset));
+	if (!ts) {
+		emi_err = -EMI_E_ALLOC;
+		return NULL;
+	}
+
+	ts->cat = cat;
+	pthread_mutex_init(&ts->lock, NULL);
+
+	return ts;
+}
+
+// -----------------------------------------------------------------------
+// Create tape set 'img_name' with volumes of 'vol_size' bytes each and
+// given magnetic tape 'flags'. First volume is created right away.
+struct emi_tapeset * emi_tapeset_create(char *img_name, uint64_t vol_size, uint32_t flags)
+{
+	int res;
+
+	struct emi *cat = emi_mtape_create(img_name, 0, 0);
+	if (!cat) {
+		return NULL;
+	}
+
+	struct emi_tapeset *ts = emi_tapeset_alloc(cat);
+	if (!ts) {
+		res = emi_err;
+		goto fail_cat;
+	}
+	ts->vol_size = vol_size;
+	ts->vol_flags = flags;
+	ts->count = 1;
+
+	ts->e = emi_tapeset_vol_create(ts, 0);
+	if (!ts->e) {
+		res = emi_err;
+		goto fail;
+	}
+
+	res = emi_tapeset_desc_write(ts);
+	if (res != EMI_E_OK) {
+		goto fail_vol;
+	}
+
+	// catalog holds no data
+	res = emi_flag_set(cat, EMI_WRPROTECT);
+	if (res != EMI_E_OK) {
+		goto fail_vol;
+	}
+
+	return ts;
+
+fail_vol:
+	emi_close(ts->e);
+	char *name = emi_tapeset_vol_name(ts, 0);
+	if (name) {
+		unlink(name);
+		free(name);
+	}
+fail:
+	pthread_mutex_destroy(&ts->lock);
+	free(ts);
+fail_cat:
+	emi_close(cat);
+	unlink(img_name);
+	emi_err = res;
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Open tape set 'img_name', with first volume loaded
+struct emi_tapeset * emi_tapeset_open(char *img_name)
+{
+	int res;
+
+	struct emi *cat = emi_open(img_name);
+	if (!cat) {
+		return NULL;
+	}
+
+	struct emi_tapeset *ts = emi_tapeset_alloc(cat);
+	if (!ts) {
+		emi_close(cat);
+		return NULL;
+	}
+
+	res = emi_tapeset_desc_read(ts);
+	if (res == EMI_E_OK) {
+		res = __emi_tapeset_load(ts, 0);
+	}
+	if (res != EMI_E_OK) {
+		pthread_mutex_destroy(&ts->lock);
+		free(ts);
+		emi_close(cat);
+		emi_err = res;
+		return NULL;
+	}
+
+	return ts;
+}
+
+// -----------------------------------------------------------------------
+void emi_tapeset_close(struct emi_tapeset *ts)
+{
+	if (!ts) {
+		return;
+	}
+
+	emi_tapeset_spare_drop(ts);
+	if (ts->e) {
+		emi_close(ts->e);
+	}
+	emi_close(ts->cat);
+	pthread_mutex_destroy(&ts->lock);
+	free(ts);
+}
+
+// -----------------------------------------------------------------------
+int emi_tapeset_volume(struct emi_tapeset *ts)
+{
+	pthread_mutex_lock(&ts->lock);
+	int vol = ts->vol;
+	pthread_mutex_unlock(&ts->lock);
+
+	return vol;
+}
+
+// -----------------------------------------------------------------------
+int emi_tapeset_count(struct emi_tapeset *ts)
+{
+	pthread_mutex_lock(&ts->lock);
+	int count = ts->count;
+	pthread_mutex_unlock(&ts->lock);
+
+	return count;
+}
+
+// -----------------------------------------------------------------------
+// Currently loaded volume, valid until the volume is switched
+struct emi * emi_tapeset_tape(struct emi_tapeset *ts)
+{
+	pthread_mutex_lock(&ts->lock);
+	struct emi *e = ts->e;
+	pthread_mutex_unlock(&ts->lock);
+
+	return e;
+}
+
+// -----------------------------------------------------------------------
+// Rewind the set to the beginning of the first volume
+int emi_tapeset_bot(struct emi_tapeset *ts)
+{
+	return emi_tapeset_load(ts, 0);
+}
+
+// -----------------------------------------------------------------------
+// Read next block into 'buf' of 'size' bytes, switching volumes at EOT
+int emi_tapeset_read_buf(struct emi_tapeset *ts, uint8_t *buf, unsigned size)
+{
+	pthread_mutex_lock(&ts->lock);
+
+	int res = emi_mtape_read_buf(ts->e, buf, size);
+	while (res == -EMI_E_EOT) {
+		res = emi_tapeset_next(ts, 0);
+		if (res != EMI_E_OK) {
+			break;
+		}
+		res = emi_mtape_read_buf(ts->e, buf, size);
+	}
+
+	pthread_mutex_unlock(&ts->lock);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_tapeset_read(struct emi_tapeset *ts, uint8_t *buf)
+{
+	return emi_tapeset_read_buf(ts, buf, UINT_MAX);
+}
+
+// -----------------------------------------------------------------------
+// Write block (or tape mark, when 'buf' is NULL), switching volumes at EOT
+static int emi_tapeset_put(struct emi_tapeset *ts, uint8_t *buf, unsigned size)
+{
+	pthread_mutex_lock(&ts->lock);
+
+	int res = buf ? emi_mtape_write(ts->e, buf, size) : emi_mtape_write_eof(ts->e);
+	if (res == -EMI_E_EOT) {
+		res = emi_tapeset_next(ts, 1);
+		// next volume is at BOT, EOT there means there is no room for the block
+		if (res == EMI_E_OK) {
+			res = buf ? emi_mtape_write(ts->e, buf, size) : emi_mtape_write_eof(ts->e);
+		}
+	}
+
+	// get next volume ready while this one fills up
+	if ((res == EMI_E_OK) && (ts->vol + 1 == ts->count)) {
+		emi_tapeset_spare_start(ts);
+	}
+
+	pthread_mutex_unlock(&ts->lock);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+int emi_tapeset_write(struct emi_tapeset *ts, uint8_t *buf, unsigned size)
+{
+	if (!buf) {
+		return -EMI_E_WRITE;
+	}
+
+	return emi_tapeset_put(ts, buf, size);
+}
+
+// -----------------------------------------------------------------------
+int emi_tapeset_write_eof(struct emi_tapeset *ts)
+{
+	return emi_tapeset_put(ts, NULL, 0);
+}
+
+// -----------------------------------------------------------------------
+void emi_tapeset_print(struct emi *e)
+{
+	uint8_t desc[EMI_TAPESET_DESC_SIZE];
+
+	if (emi_meta_get(e, EMI_META_TAPESET, desc, sizeof(desc)) != sizeof(desc)) {
+		return;
+	}
+
+	printf("Tape set     : %u volume(s), %"PRIu64" bytes each%s\n",
+		ntohs(*(uint16_t*)(desc+12)),
+		emi_tapeset_get64(desc),
+		ntohl(*(uint32_t*)(desc+8)) & EMI_COMPRESSED ? ", compressed" : ""
+	);
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent
@@ -0,0 +1,340 @@
+//  Copyright (c) 2016 Jakub Filipowicz <jakubf@gmail.com>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc.,
+//  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+// Background tape writer.
+//
+// Tape writes (emi_mtape_write(), emi_mtape_write_eof(), emi_ptape_write*())
+// are put into a ring buffer and return right away, writer thread then
+// does them in order. Writers take turns putting records into the ring,
+// so there is always one producer and one consumer (writer thread) and
+// ring positions need no locking. Mutex and condition are there only for
+// sleeping when ring is empty (writer) or full (producer).
+//
+// Any other operation on the image waits for the ring to drain first
+// (see emi_lock()), so it sees the tape as if writes were synchronous.
+//
+// First failed write is remembered and returned by all following queued
+// writes (which are dropped) until emi_flush() reports it.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "emimg.h"
+
+#define EMI_WRITER_RING_SIZE (4 * 1024 * 1024)
+// larger writes are done synchronously
+#define EMI_WRITER_REC_MAX (EMI_WRITER_RING_SIZE / 4)
+
+#define EMI_WRITER_ALIGN(x) (((x) + 7) & ~(uint64_t) 7)
+
+enum emi_writer_ops {
+	EMI_WRITER_PAD,			// skip to the ring start
+	EMI_WRITER_MTAPE_WRITE,
+	EMI_WRITER_MTAPE_WRITE_EOF,
+	EMI_WRITER_PTAPE_WRITE,
+};
+
+struct emi_writer_rec {
+	uint32_t op;
+	uint32_t size;			// data size (data follows the record)
+};
+
+struct emi_writer {
+	struct emi *e;
+	uint8_t *ring;
+	uint64_t head;			// ring position past the last record (written by producer)
+	uint64_t tail;			// ring position of the next record to do (written by writer)
+	int err;				// first failed write result
+
+	pthread_t thread;
+	int quit;
+	pthread_mutex_t put_lock;	// one producer at a time
+	pthread_mutex_t lock;		// sleeping only
+	pthread_cond_t data_cond;	// ring not empty anymore
+	pthread_cond_t space_cond;	// writer made progress
+	int sleeping;			// writer waits for data
+	int waiting;			// number of threads waiting for writer progress
+};
+
+void emi_lock(struct emi *e);
+void emi_unlock(struct emi *e);
+
+// -----------------------------------------------------------------------
+static int emi_writer_do(struct emi *e, struct emi_writer_rec *rec)
+{
+	uint8_t *data = (uint8_t*) (rec + 1);
+
+	switch (rec->op) {
+		case EMI_WRITER_MTAPE_WRITE:
+			return emi_mtape_write(e, data, rec->size);
+		case EMI_WRITER_MTAPE_WRITE_EOF:
+			return emi_mtape_write_eof(e);
+		case EMI_WRITER_PTAPE_WRITE:
+			return emi_ptape_write_buf(e, data, rec->size);
+		default:
+			return EMI_E_OK;
+	}
+}
+
+// -----------------------------------------------------------------------
+static void * emi_writer_thread(void *ptr)
+{
+	struct emi_writer *w = ptr;
+
+	while (1) {
+		uint64_t tail = w->tail;
+
+		// wait for data
+		if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail) {
+			pthread_mutex_lock(&w->lock);
+			__atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+			while ((__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail) && !w->quit) {
+				pthread_cond_wait(&w->data_cond, &w->lock);
+			}
+			__atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+			int quit = w->quit && (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail);
+			pthread_mutex_unlock(&w->lock);
+			if (quit) {
+				break;
+			}
+			continue;
+		}
+
+		struct emi_writer_rec *rec = (struct emi_writer_rec*) (w->ring + tail % EMI_WRITER_RING_SIZE);
+
+		// after a failure, writes are dropped until the error is reported
+		if (!__atomic_load_n(&w->err, __ATOMIC_ACQUIRE)) {
+			int res = emi_writer_do(w->e, rec);
+			if (res < 0) {
+				__atomic_store_n(&w->err, res, __ATOMIC_RELEASE);
+			}
+		}
+
+		__atomic_store_n(&w->tail, tail + sizeof(struct emi_writer_rec) + EMI_WRITER_ALIGN(rec->size), __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&w->lock);
+			pthread_cond_broadcast(&w->space_cond);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Wait until writer gets to ring position 'pos'
+static void emi_writer_wait(struct emi_writer *w, uint64_t pos)
+{
+	if (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= pos) {
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	__atomic_add_fetch(&w->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) < pos) {
+		pthread_cond_wait(&w->space_cond, &w->lock);
+	}
+	__atomic_sub_fetch(&w->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// -----------------------------------------------------------------------
+// Does image have a background writer that the calling thread should use?
+int emi_writer_active(struct emi *e)
+{
+	return e->writer && !pthread_equal(pthread_self(), e->writer->thread);
+}
+
+// -----------------------------------------------------------------------
+// Wait for all writes queued so far to be done
+void emi_writer_drain(struct emi *e)
+{
+	struct emi_writer *w = e->writer;
+
+	if (!emi_writer_active(e)) {
+		return;
+	}
+
+	emi_writer_wait(w, __atomic_load_n(&w->head, __ATOMIC_ACQUIRE));
+}
+
+// -----------------------------------------------------------------------
+// Queue write for the background writer. Returns 1 if the write is too
+// large to be queued: queue is drained then and it's up to the caller.
+static int emi_writer_put(struct emi *e, unsigned op, const uint8_t *buf, unsigned size)
+{
+	struct emi_writer *w = e->writer;
+	uint64_t len = sizeof(struct emi_writer_rec) + EMI_WRITER_ALIGN(size);
+
+	if (len > EMI_WRITER_REC_MAX) {
+		emi_writer_drain(e);
+		int err = __atomic_load_n(&w->err, __ATOMIC_ACQUIRE);
+		return err ? err : 1;
+	}
+
+	pthread_mutex_lock(&w->put_lock);
+
+	int err = __atomic_load_n(&w->err, __ATOMIC_ACQUIRE);
+	if (err) {
+		pthread_mutex_unlock(&w->put_lock);
+		return err;
+	}
+
+	// record doesn't fit before the ring end, pad up to it
+	uint64_t head = w->head;
+	uint64_t pad = EMI_WRITER_RING_SIZE - head % EMI_WRITER_RING_SIZE;
+	if (pad >= len) {
+		pad = 0;
+	}
+
+	// back-pressure: wait for the space
+	if (head + pad + len > EMI_WRITER_RING_SIZE) {
+		emi_writer_wait(w, head + pad + len - EMI_WRITER_RING_SIZE);
+	}
+
+	struct emi_writer_rec *rec = (struct emi_writer_rec*) (w->ring + head % EMI_WRITER_RING_SIZE);
+	if (pad) {
+		rec->op = EMI_WRITER_PAD;
+		rec->size = pad - sizeof(struct emi_writer_rec);
+		rec = (struct emi_writer_rec*) w->ring;
+	}
+	rec->op = op;
+	rec->size = size;
+	if (size) {
+		memcpy(rec + 1, buf, size);
+	}
+
+	__atomic_store_n(&w->head, head + pad + len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->data_cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	pthread_mutex_unlock(&w->put_lock);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+int emi_writer_mtape_write(struct emi *e, const uint8_t *buf, unsigned size)
+{
+	return emi_writer_put(e, EMI_WRITER_MTAPE_WRITE, buf, size);
+}
+
+// -----------------------------------------------------------------------
+int emi_writer_mtape_write_eof(struct emi *e)
+{
+	return emi_writer_put(e, EMI_WRITER_MTAPE_WRITE_EOF, NULL, 0);
+}
+
+// -----------------------------------------------------------------------
+int emi_writer_ptape_write(struct emi *e, const uint8_t *buf, unsigned size)
+{
+	return emi_writer_put(e, EMI_WRITER_PTAPE_WRITE, buf, size);
+}
+
+// -----------------------------------------------------------------------
+// Start background writer for tape image writes
+int emi_writer_start(struct emi *e)
+{
+	if ((e->type != EMI_T_MTAPE) && (e->type != EMI_T_PTAPE)) {
+		return -EMI_E_ACCESS;
+	}
+	if (e->writer) {
+		return EMI_E_OK;
+	}
+
+	struct emi_writer *w = calloc(1, sizeof(struct emi_writer));
+	if (!w) {
+		return -EMI_E_ALLOC;
+	}
+	w->ring = malloc(EMI_WRITER_RING_SIZE);
+	if (!w->ring) {
+		free(w);
+		return -EMI_E_ALLOC;
+	}
+	w->e = e;
+
+	pthread_mutex_init(&w->put_lock, NULL);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->data_cond, NULL);
+	pthread_cond_init(&w->space_cond, NULL);
+
+	// image lock keeps other threads away until writer is there
+	emi_lock(e);
+	if (pthread_create(&w->thread, NULL, emi_writer_thread, w)) {
+		emi_unlock(e);
+		free(w->ring);
+		free(w);
+		return -EMI_E_ALLOC;
+	}
+	e->writer = w;
+	emi_unlock(e);
+
+	return EMI_E_OK;
+}
+
+// -----------------------------------------------------------------------
+// Wait for queued writes and stop the background writer
+int emi_writer_stop(struct emi *e)
+{
+	struct emi_writer *w = e->writer;
+
+	if (!w) {
+		return EMI_E_OK;
+	}
+
+	emi_writer_drain(e);
+
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	pthread_cond_signal(&w->data_cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	e->writer = NULL;
+
+	int res = w->err;
+
+	pthread_cond_destroy(&w->space_cond);
+	pthread_cond_destroy(&w->data_cond);
+	pthread_mutex_destroy(&w->lock);
+	pthread_mutex_destroy(&w->put_lock);
+	free(w->ring);
+	free(w);
+
+	return res;
+}
+
+// -----------------------------------------------------------------------
+// Wait for all writes queued so far, report (and forget) failed write
+int emi_writer_flush(struct emi *e)
+{
+	struct emi_writer *w = e->writer;
+
+	if (!w) {
+		return EMI_E_OK;
+	}
+
+	emi_writer_drain(e);
+
+	return __atomic_exchange_n(&w->err, EMI_E_OK, __ATOMIC_ACQ_REL);
+}
+
+// vim: tabstop=4 shiftwidth=4 autoindent